@@ -0,0 +1,394 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/**
+ * Constrained optimizer for the wifi-zigbee scenario.
+ *
+ * Maximizes --objective (Wi-Fi throughput by default) subject to a minimum
+ * Zigbee PDR and a maximum Zigbee p99 delay, over a search space such as
+ *
+ *   --space=wifiDataRate=10Mbps:300Mbps:log;wifiChannelWidth=20|40|80;wifiBeCwMin=3:63:int
+ *
+ * A numeric axis is "lo:hi" with optional ":log" and/or ":int"; a unit suffix
+ * on the bounds ("Mbps") is kept. A categorical axis is "a|b|c".
+ *
+ * The search is successive halving: --initial candidates are drawn with a
+ * Latin hypercube and run for --minTime simulated seconds; the best 1/eta are
+ * promoted to eta times the budget, up to --maxTime. Each bracket is seeded
+ * independently. Candidates run in parallel through the sweep runner, so
+ * every run lands in the result cache and repeated searches are cheap.
+ *
+ * Runs print PROGRESS lines (see --progressInterval in wifi-zigbee.cc) and are
+ * killed as soon as the heartbeats already dropped or late make the
+ * constraints unreachable.
+ *
+ * The Pareto frontier (throughput, PDR, p99 delay) of the runs at the full
+ * budget is printed and written to --outFile; every run goes to --allFile.
+ */
+
+#include "wifi-zigbee-runtime-model.h"
+#include "wifi-zigbee-sweep.h"
+
+#include "ns3/core-module.h"
+
+#include <iostream>
+#include <random>
+#include <thread>
+
+using namespace ns3;
+using namespace sweep;
+
+NS_LOG_COMPONENT_DEFINE("WifiZigbeeOptimize");
+
+struct Axis {
+  std::string name;
+  std::vector<std::string> choices; //!< categorical values, empty for numeric axes
+  double lo = 0.0;
+  double hi = 0.0;
+  bool log = false;
+  bool integer = false;
+  std::string unit;
+};
+
+struct Candidate {
+  std::vector<std::pair<std::string, std::string>> point;
+  double budget = 0.0;
+  RunRecord record;
+  double score = 0.0;
+  bool feasible = false;
+};
+
+static std::vector<Axis> ParseSpace(const std::string& spec) {
+  std::vector<Axis> space;
+  for (const auto& item : Split(spec, ';')) {
+    size_t eq = item.find('=');
+    if (Trim(item).empty() || eq == std::string::npos) {
+      continue;
+    }
+    Axis axis;
+    axis.name = Trim(item.substr(0, eq));
+    std::string def = Trim(item.substr(eq + 1));
+    if (def.find('|') != std::string::npos) {
+      for (const auto& c : Split(def, '|')) {
+        axis.choices.push_back(Trim(c));
+      }
+      space.push_back(axis);
+      continue;
+    }
+    auto fields = Split(def, ':');
+    NS_ABORT_MSG_IF(fields.size() < 2, "Axis " << axis.name << " needs lo:hi or a|b|c");
+    // Bounds stay in the scale of their unit suffix ("10Mbps" -> 10, "Mbps")
+    char* end = nullptr;
+    axis.lo = std::strtod(fields[0].c_str(), &end);
+    NS_ABORT_MSG_IF(end == fields[0].c_str(), "Axis " << axis.name << " has a non-numeric lower bound");
+    axis.unit = end;
+    axis.hi = std::strtod(fields[1].c_str(), &end);
+    NS_ABORT_MSG_IF(end == fields[1].c_str(), "Axis " << axis.name << " has a non-numeric upper bound");
+    for (size_t i = 2; i < fields.size(); i++) {
+      axis.log = axis.log || fields[i] == "log";
+      axis.integer = axis.integer || fields[i] == "int";
+    }
+    NS_ABORT_MSG_IF(axis.log && axis.lo <= 0.0, "Log axis " << axis.name << " needs positive bounds");
+    space.push_back(axis);
+  }
+  return space;
+}
+
+/**
+ * Map u in [0, 1) to a value of the axis.
+ */
+static std::string AxisValue(const Axis& axis, double u) {
+  if (!axis.choices.empty()) {
+    return axis.choices[std::min(axis.choices.size() - 1, size_t(u * double(axis.choices.size())))];
+  }
+  double v = axis.log ? std::exp(std::log(axis.lo) + u * (std::log(axis.hi) - std::log(axis.lo)))
+                      : axis.lo + u * (axis.hi - axis.lo);
+  std::ostringstream os;
+  if (axis.integer) {
+    os << std::llround(v);
+  } else {
+    os << std::setprecision(4) << v;
+  }
+  return os.str() + axis.unit;
+}
+
+/**
+ * Latin hypercube: every axis is cut into n strata and each stratum is used once.
+ */
+static std::vector<std::vector<std::pair<std::string, std::string>>> LatinHypercube(const std::vector<Axis>& space,
+                                                                                   uint32_t n, std::mt19937_64& rng) {
+  std::vector<std::vector<std::pair<std::string, std::string>>> points(n);
+  std::uniform_real_distribution<double> jitter(0.0, 1.0);
+  for (const auto& axis : space) {
+    std::vector<uint32_t> strata(n);
+    for (uint32_t i = 0; i < n; i++) {
+      strata[i] = i;
+    }
+    std::shuffle(strata.begin(), strata.end(), rng);
+    for (uint32_t i = 0; i < n; i++) {
+      points[i].emplace_back(axis.name, AxisValue(axis, (strata[i] + jitter(rng)) / double(n)));
+    }
+  }
+  return points;
+}
+
+static double GetResult(const RunRecord& rec, const std::string& key, double fallback) {
+  auto it = rec.results.find(key);
+  return it != rec.results.end() ? std::stod(it->second) : fallback;
+}
+
+static const double c_delayQuantile = 0.99; // of zigbee.delayP99
+
+/**
+ * Feasible candidates are ranked by objective, infeasible ones after all
+ * feasible ones by how far they miss the constraints.
+ */
+static void Score(Candidate& c, const std::string& objective, double minPdr, double maxP99) {
+  if (!c.record.ok) {
+    c.feasible = false;
+    c.score = -1e300;
+    return;
+  }
+  double pdr = GetResult(c.record, "zigbee.pdr", 0.0);
+  double p99 = GetResult(c.record, "zigbee.delayP99", 1e9);
+  double violation = std::max(0.0, minPdr - pdr) / std::max(minPdr, 1e-9) + std::max(0.0, p99 - maxP99) / maxP99;
+  c.feasible = violation == 0.0;
+  c.score = c.feasible ? GetResult(c.record, objective, 0.0) : -1e100 - violation;
+}
+
+int main(int argc, char* argv[]) {
+  std::string simBinary = "./build/scratch/ns3.44-wifi-zigbee-default";
+  std::string cacheDir = "output/cache";
+  std::string ns3Version = "3.44";
+  uint32_t parallel = std::max(1u, std::thread::hardware_concurrency());
+  std::string space = "wifiDataRate=10Mbps:300Mbps:log;wifiChannelWidth=20|40|80;wifiBeCwMin=3:63:int;"
+                      "wifiBeAifsn=2:9:int;zigbeeMaxCsmaBackoffs=2:5:int;zigbeeMaxFrameRetries=1:7:int";
+  std::string fixed = "";
+  uint32_t initial = 27;
+  uint32_t eta = 3;
+  double minTime = 30.0;
+  double maxTime = 120.0;
+  uint32_t brackets = 1;
+  std::string objective = "wifi.throughputKbps";
+  double minPdr = 0.99;
+  double maxP99 = 0.1;
+  uint32_t seed = 1;
+  bool earlyAbort = true;
+  std::string outFile = "output/pareto.csv";
+  std::string allFile = "output/optimize.csv";
+
+  CommandLine cmd;
+  cmd.AddValue("simBinary", "Path of the wifi-zigbee simulator binary", simBinary);
+  cmd.AddValue("cacheDir", "Directory of the result cache", cacheDir);
+  cmd.AddValue("ns3Version", "ns-3 version, part of the cache key", ns3Version);
+  cmd.AddValue("parallel", "Number of simulations run concurrently", parallel);
+  cmd.AddValue("space", "Search space, e.g. \"a=1:100:log;b=3:9:int;c=x|y\"", space);
+  cmd.AddValue("fixed", "Extra simulator arguments for every run, e.g. \"heartbeatInterval=0.5;rngRun=2\"", fixed);
+  cmd.AddValue("initial", "Candidates drawn per bracket", initial);
+  cmd.AddValue("eta", "Keep 1/eta of the candidates per rung and multiply the budget by eta", eta);
+  cmd.AddValue("minTime", "simulationTime of the first rung (s)", minTime);
+  cmd.AddValue("maxTime", "simulationTime of the last rung (s)", maxTime);
+  cmd.AddValue("brackets", "Independent successive-halving brackets", brackets);
+  cmd.AddValue("objective", "Result key to maximize", objective);
+  cmd.AddValue("minPdr", "Constraint: minimum zigbee.pdr", minPdr);
+  cmd.AddValue("maxP99", "Constraint: maximum zigbee.delayP99 (s)", maxP99);
+  cmd.AddValue("seed", "Seed of the Latin hypercube sampler", seed);
+  cmd.AddValue("earlyAbort", "Kill runs whose partial results already violate the constraints", earlyAbort);
+  cmd.AddValue("outFile", "CSV of the Pareto frontier", outFile);
+  cmd.AddValue("allFile", "CSV of every run", allFile);
+  cmd.Parse(argc, argv);
+
+  NS_ABORT_MSG_IF(eta < 2, "eta must be at least 2");
+  NS_ABORT_MSG_IF(minTime > maxTime, "minTime must not exceed maxTime");
+  std::vector<Axis> axes = ParseSpace(space);
+  NS_ABORT_MSG_IF(axes.empty(), "Empty search space");
+  std::vector<std::string> fixedArgs;
+  for (const auto& kv : Split(fixed, ';')) {
+    if (!Trim(kv).empty()) {
+      fixedArgs.push_back("--" + Trim(kv));
+    }
+  }
+
+  std::string binaryHash = Sha256File(simBinary);
+  NS_ABORT_MSG_IF(binaryHash.empty(), "Unable to read simulator binary " << simBinary);
+  ResultCache cache(cacheDir);
+  JobRunner runner(simBinary, cache, parallel);
+  if (earlyAbort) {
+    // Only final outcomes count: heartbeats a MAC dropped and heartbeats
+    // received after maxP99 (packets merely overdue may still arrive). At most
+    // expected - dropped heartbeats can be received, and the p99 delay
+    // (nearest rank, as in wifi-zigbee.cc) exceeds maxP99 once more than
+    // n - ceil(0.99 n) of the n received ones are late.
+    runner.SetProgressCallback([&](const SweepJob&, const KeyValues& p) {
+      double expected = p.count("expected") ? std::stod(p.at("expected")) : 0.0;
+      if (expected <= 0.0) {
+        return true;
+      }
+      double dropped = p.count("dropped") ? std::stod(p.at("dropped")) : 0.0;
+      double late = p.count("late") ? std::stod(p.at("late")) : 0.0;
+      double maxRecv = std::max(0.0, expected - dropped);
+      return 1.0 - dropped / expected >= minPdr && late <= maxRecv - std::ceil(c_delayQuantile * maxRecv);
+    });
+  }
+  runner.SetFinishedCallback([](const SweepJob& job, const RunRecord& rec) {
+    NS_LOG_UNCOND((rec.ok ? "done    " : rec.aborted ? "aborted " : "FAILED  ")
+                  << job.key.substr(0, 12) << " cpu=" << std::fixed << std::setprecision(1) << rec.cpuSeconds << "s" << std::defaultfloat);
+  });
+
+  std::mt19937_64 rng(seed);
+  std::vector<Candidate> all;
+  uint32_t aborted = 0;
+  double cpuSpent = 0.0;
+  double cpuSaved = 0.0;
+  auto wallStart = std::chrono::steady_clock::now();
+
+  for (uint32_t b = 0; b < brackets; b++) {
+    std::vector<Candidate> rung;
+    for (const auto& point : LatinHypercube(axes, initial, rng)) {
+      Candidate c;
+      c.point = point;
+      rung.push_back(c);
+    }
+    for (double budget = minTime;; budget = std::min(maxTime, budget * eta)) {
+      std::vector<SweepJob> jobs;
+      for (auto& c : rung) {
+        c.budget = budget;
+        SweepJob job;
+        for (const auto& kv : c.point) {
+          job.args.push_back("--" + kv.first + "=" + kv.second);
+        }
+        job.args.insert(job.args.end(), fixedArgs.begin(), fixedArgs.end());
+        std::ostringstream time;
+        time << budget;
+        job.args.push_back("--simulationTime=" + time.str());
+        job.args.push_back("--logLevel=0");
+        job.args.push_back("--progressInterval=5");
+        std::ostringstream bound;
+        bound << maxP99;
+        job.args.push_back("--progressDelayBound=" + bound.str());
+        NS_ABORT_MSG_IF(!ResolveJob(simBinary, binaryHash, ns3Version, job),
+                        "Simulator rejected candidate " << jobs.size());
+        jobs.push_back(job);
+      }
+
+      NS_LOG_UNCOND("=== Bracket " << b << ": " << rung.size() << " candidates at simulationTime=" << budget
+                                   << " s ===");
+      std::vector<RunRecord> records = runner.Run(jobs);
+      for (size_t i = 0; i < rung.size(); i++) {
+        rung[i].record = records[i];
+        Score(rung[i], objective, minPdr, maxP99);
+        aborted += records[i].aborted ? 1 : 0;
+        (records[i].cached ? cpuSaved : cpuSpent) += records[i].cpuSeconds;
+        all.push_back(rung[i]);
+      }
+      if (budget >= maxTime || rung.size() <= 1) {
+        break;
+      }
+      std::stable_sort(rung.begin(), rung.end(),
+                       [](const Candidate& x, const Candidate& y) { return x.score > y.score; });
+      rung.resize(std::max<size_t>(1, rung.size() / eta));
+    }
+  }
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  // Pareto frontier over the full-budget runs: max objective, max PDR, min p99
+  std::vector<const Candidate*> finals;
+  for (const auto& c : all) {
+    if (c.budget >= maxTime && c.record.ok) {
+      finals.push_back(&c);
+    }
+  }
+  auto metrics = [&](const Candidate* c) {
+    return std::array<double, 3>{GetResult(c->record, objective, 0.0), GetResult(c->record, "zigbee.pdr", 0.0),
+                                 -GetResult(c->record, "zigbee.delayP99", 1e9)};
+  };
+  std::vector<const Candidate*> frontier;
+  for (const auto* c : finals) {
+    auto mc = metrics(c);
+    bool dominated = false;
+    for (const auto* o : finals) {
+      auto mo = metrics(o);
+      bool geq = mo[0] >= mc[0] && mo[1] >= mc[1] && mo[2] >= mc[2];
+      bool gt = mo[0] > mc[0] || mo[1] > mc[1] || mo[2] > mc[2];
+      if (geq && gt) {
+        dominated = true;
+        break;
+      }
+    }
+    if (!dominated) {
+      frontier.push_back(c);
+    }
+  }
+  std::sort(frontier.begin(), frontier.end(),
+            [&](const Candidate* x, const Candidate* y) { return metrics(x)[0] > metrics(y)[0]; });
+
+  auto writeCsv = [&](const std::string& path, const std::vector<const Candidate*>& rows) {
+    std::filesystem::path parent = std::filesystem::path(path).parent_path();
+    if (!parent.empty()) {
+      std::filesystem::create_directories(parent);
+    }
+    std::ofstream out(path);
+    out << "simulationTime,ok,aborted,cached,feasible,cpuSeconds";
+    for (const auto& axis : axes) {
+      out << "," << axis.name;
+    }
+    out << "," << objective << ",zigbee.pdr,zigbee.delayP99\n";
+    for (const auto* c : rows) {
+      out << c->budget << "," << c->record.ok << "," << c->record.aborted << "," << c->record.cached << ","
+          << c->feasible << "," << c->record.cpuSeconds;
+      for (const auto& kv : c->point) {
+        out << "," << kv.second;
+      }
+      auto m = metrics(c);
+      if (c->record.ok) {
+        out << "," << m[0] << "," << m[1] << "," << -m[2] << "\n";
+      } else {
+        out << ",,,\n";
+      }
+    }
+  };
+  std::vector<const Candidate*> allRows;
+  for (const auto& c : all) {
+    allRows.push_back(&c);
+  }
+  writeCsv(allFile, allRows);
+  writeCsv(outFile, frontier);
+
+  const Candidate* best = nullptr;
+  for (const auto* c : finals) {
+    if (c->feasible && (!best || c->score > best->score)) {
+      best = c;
+    }
+  }
+
+  NS_LOG_UNCOND("=== Pareto frontier (" << objective << ", zigbee.pdr, zigbee.delayP99) ===");
+  for (const auto* c : frontier) {
+    auto m = metrics(c);
+    std::ostringstream point;
+    for (const auto& kv : c->point) {
+      point << " " << kv.first << "=" << kv.second;
+    }
+    NS_LOG_UNCOND((c->feasible ? "* " : "  ") << std::fixed << std::setprecision(2) << std::setw(10) << m[0] << " | "
+                                              << std::setprecision(4) << m[1] << " | " << std::setprecision(4)
+                                              << -m[2] << " |" << point.str());
+  }
+  NS_LOG_UNCOND("=== Optimizer summary ===");
+  NS_LOG_UNCOND("  runs          = " << all.size() << " (" << aborted << " aborted early)");
+  NS_LOG_UNCOND("  cpu spent     = " << std::fixed << std::setprecision(1) << cpuSpent << " s");
+  NS_LOG_UNCOND("  cpu saved     = " << std::setprecision(1) << cpuSaved << " s (cache)");
+  NS_LOG_UNCOND("  wall time     = " << std::setprecision(1) << wallSeconds << " s");
+  if (best) {
+    std::ostringstream point;
+    for (const auto& kv : best->point) {
+      point << " " << kv.first << "=" << kv.second;
+    }
+    NS_LOG_UNCOND("  best feasible = " << std::setprecision(2) << best->score << " (" << objective << ")"
+                                      << point.str());
+  } else {
+    NS_LOG_UNCOND("  best feasible = none");
+  }
+  NS_LOG_UNCOND("  frontier      = " << outFile);
+
+  return 0;
+}
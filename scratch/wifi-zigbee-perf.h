@@ -0,0 +1,118 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/**
+ * Linux hardware performance counters (perf_event_open) for the wifi-zigbee
+ * phase profile: cycles, instructions, cache misses and branch misses of the
+ * calling process, user space only.
+ *
+ * Every counter is opened on its own, so a counter the PMU (or the VM) does
+ * not provide is simply missing instead of failing the whole set. Counters
+ * multiplexed by the kernel are scaled by their enabled/running time. When
+ * nothing can be opened (perf_event_paranoid, containers, no PMU) Open()
+ * returns false with the reason and the run continues without counters.
+ */
+
+#ifndef WIFI_ZIGBEE_PERF_H
+#define WIFI_ZIGBEE_PERF_H
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace perf {
+
+class CounterSet {
+public:
+  CounterSet() = default;
+  CounterSet(const CounterSet&) = delete;
+  CounterSet& operator=(const CounterSet&) = delete;
+
+  ~CounterSet() { Close(); }
+
+  /**
+   * Open and start the counters of the calling process.
+   * \return false if none of them is available; error tells why
+   */
+  bool Open(std::string& error) {
+    Close();
+    static const struct {
+      const char* name;
+      uint64_t config;
+    } c_events[] = {{"cycles", PERF_COUNT_HW_CPU_CYCLES},
+                    {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+                    {"cacheMisses", PERF_COUNT_HW_CACHE_MISSES},
+                    {"branchMisses", PERF_COUNT_HW_BRANCH_MISSES}};
+    m_pid = getpid();
+    for (const auto& ev : c_events) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = ev.config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+      if (fd < 0) {
+        error = std::string("perf_event_open(") + ev.name + "): " + std::strerror(errno);
+        continue;
+      }
+      m_names.push_back(ev.name);
+      m_fds.push_back(fd);
+    }
+    if (m_fds.empty()) {
+      return false;
+    }
+    error.clear();
+    return true;
+  }
+
+  void Close() {
+    for (int fd : m_fds) {
+      close(fd);
+    }
+    m_fds.clear();
+    m_names.clear();
+  }
+
+  /**
+   * \return counts since Open(), scaled for multiplexing, in Names() order
+   */
+  std::vector<double> Read() const {
+    std::vector<double> values;
+    for (int fd : m_fds) {
+      uint64_t data[3] = {0, 0, 0}; // value, time enabled, time running
+      double v = 0.0;
+      if (read(fd, data, sizeof(data)) == ssize_t(sizeof(data)) && data[2] > 0) {
+        v = double(data[0]) * double(data[1]) / double(data[2]);
+      }
+      values.push_back(v);
+    }
+    return values;
+  }
+
+  const std::vector<std::string>& Names() const { return m_names; }
+
+  bool IsOpen() const { return !m_fds.empty(); }
+
+  /** A forked child reads its parent's counters until it opens its own */
+  bool IsOwned() const { return m_pid == getpid(); }
+
+private:
+  std::vector<int> m_fds;
+  std::vector<std::string> m_names;
+  pid_t m_pid = -1;
+};
+
+} // namespace perf
+
+#endif /* WIFI_ZIGBEE_PERF_H */
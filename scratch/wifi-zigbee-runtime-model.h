@@ -0,0 +1,261 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/**
+ * Runtime prediction for sweep jobs.
+ *
+ * Learns log(cpuSeconds) as a ridge regression over the log of every numeric
+ * simulator parameter that varies in the result cache (wifiDataRate,
+ * simulationTime, node counts, ...). Units such as "160Mbps" are understood.
+ * The prediction is only used to order jobs, so a rough model is enough.
+ */
+
+#ifndef WIFI_ZIGBEE_RUNTIME_MODEL_H
+#define WIFI_ZIGBEE_RUNTIME_MODEL_H
+
+#include "wifi-zigbee-sweep.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <queue>
+
+namespace sweep {
+
+/**
+ * Parse "160Mbps", "40", "0.5" or "2k" into a number.
+ * \return false unless the value is a number, optionally followed by a k/M/G
+ *         multiplier and a unit (bps, b/s, B/s, Hz, B, s)
+ */
+inline bool ParseNumber(const std::string& s, double& value) {
+  const char* begin = s.c_str();
+  char* end = nullptr;
+  value = std::strtod(begin, &end);
+  if (end == begin || !std::isfinite(value)) {
+    return false;
+  }
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value *= 1e3;
+    end++;
+    break;
+  case 'M':
+    value *= 1e6;
+    end++;
+    break;
+  case 'G':
+    value *= 1e9;
+    end++;
+    break;
+  default:
+    break;
+  }
+  static const char* c_units[] = {"", "bps", "b/s", "B/s", "Hz", "B", "s"};
+  for (const char* unit : c_units) {
+    if (std::strcmp(end, unit) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Solve the square system a * x = b in place (Gaussian elimination with partial pivoting).
+ */
+inline std::vector<double> SolveLinear(std::vector<std::vector<double>> a, std::vector<double> b) {
+  size_t n = b.size();
+  for (size_t col = 0; col < n; col++) {
+    size_t pivot = col;
+    for (size_t r = col + 1; r < n; r++) {
+      if (std::fabs(a[r][col]) > std::fabs(a[pivot][col])) {
+        pivot = r;
+      }
+    }
+    std::swap(a[col], a[pivot]);
+    std::swap(b[col], b[pivot]);
+    if (std::fabs(a[col][col]) < 1e-12) {
+      continue;
+    }
+    for (size_t r = 0; r < n; r++) {
+      if (r == col) {
+        continue;
+      }
+      double f = a[r][col] / a[col][col];
+      for (size_t c = col; c < n; c++) {
+        a[r][c] -= f * a[col][c];
+      }
+      b[r] -= f * b[col];
+    }
+  }
+  std::vector<double> x(n, 0.0);
+  for (size_t i = 0; i < n; i++) {
+    x[i] = std::fabs(a[i][i]) < 1e-12 ? 0.0 : b[i] / a[i][i];
+  }
+  return x;
+}
+
+/**
+ * Numeric parameters that take more than one value over the cache entries
+ * (see ResultCache::Entries()), without the "param." prefix. The RNG run and
+ * seed and the content digests of input files (scenarioDigest, ...) are not
+ * parameters of the model.
+ */
+inline std::vector<std::string> VaryingParams(const std::vector<KeyValues>& entries) {
+  std::map<std::string, std::pair<double, double>> range;
+  for (const auto& e : entries) {
+    for (const auto& kv : e) {
+      double v;
+      if (kv.first.rfind("param.", 0) != 0 || !ParseNumber(kv.second, v)) {
+        continue;
+      }
+      auto it = range.find(kv.first);
+      if (it == range.end()) {
+        range[kv.first] = {v, v};
+      } else {
+        it->second.first = std::min(it->second.first, v);
+        it->second.second = std::max(it->second.second, v);
+      }
+    }
+  }
+  std::vector<std::string> names;
+  for (const auto& r : range) {
+    bool digest = r.first.size() >= 6 && r.first.compare(r.first.size() - 6, 6, "Digest") == 0;
+    if (r.second.first != r.second.second && r.first != "param.rngRun" && r.first != "param.seed" && !digest) {
+      names.push_back(r.first.substr(6));
+    }
+  }
+  return names;
+}
+
+class RuntimeModel {
+public:
+  /**
+   * Fit the model on cache entries (see ResultCache::Entries()).
+   * \return the number of samples used
+   */
+  size_t Train(const std::vector<KeyValues>& entries) {
+    m_features = VaryingParams(entries);
+
+    std::vector<std::vector<double>> xs;
+    std::vector<double> ys;
+    for (const auto& e : entries) {
+      auto cpu = e.find("cpuSeconds");
+      if (cpu == e.end() || std::stod(cpu->second) <= 0.0) {
+        continue;
+      }
+      KeyValues params;
+      for (const auto& kv : e) {
+        if (kv.first.rfind("param.", 0) == 0) {
+          params[kv.first.substr(6)] = kv.second;
+        }
+      }
+      xs.push_back(Features(params));
+      ys.push_back(std::log(std::stod(cpu->second)));
+    }
+
+    size_t k = m_features.size() + 1;
+    m_weights.assign(k, 0.0);
+    m_samples = xs.size();
+    if (m_samples < 2) {
+      return m_samples;
+    }
+
+    // Ridge regression: (X'X + lambda I) w = X'y, the intercept is not penalised
+    std::vector<std::vector<double>> xtx(k, std::vector<double>(k, 0.0));
+    std::vector<double> xty(k, 0.0);
+    for (size_t s = 0; s < xs.size(); s++) {
+      for (size_t i = 0; i < k; i++) {
+        xty[i] += xs[s][i] * ys[s];
+        for (size_t j = 0; j < k; j++) {
+          xtx[i][j] += xs[s][i] * xs[s][j];
+        }
+      }
+    }
+    for (size_t i = 1; i < k; i++) {
+      xtx[i][i] += 1e-3 * double(m_samples);
+    }
+    m_weights = SolveLinear(xtx, xty);
+
+    double mean = 0.0;
+    for (double y : ys) {
+      mean += y / double(ys.size());
+    }
+    double ssRes = 0.0;
+    double ssTot = 0.0;
+    for (size_t s = 0; s < xs.size(); s++) {
+      double err = Dot(xs[s]) - ys[s];
+      ssRes += err * err;
+      ssTot += (ys[s] - mean) * (ys[s] - mean);
+    }
+    m_r2 = ssTot > 0.0 ? 1.0 - ssRes / ssTot : 0.0;
+    return m_samples;
+  }
+
+  bool IsTrained() const { return m_samples >= 2; }
+
+  /**
+   * \return predicted CPU seconds for a resolved configuration (1 if untrained)
+   */
+  double Predict(const KeyValues& params) const {
+    if (!IsTrained()) {
+      return 1.0;
+    }
+    return std::exp(Dot(Features(params)));
+  }
+
+  double GetR2() const { return m_r2; }
+
+  size_t GetSamples() const { return m_samples; }
+
+  const std::vector<std::string>& GetFeatures() const { return m_features; }
+
+private:
+  std::vector<double> Features(const KeyValues& params) const {
+    std::vector<double> x{1.0};
+    for (const auto& name : m_features) {
+      double v = 0.0;
+      auto it = params.find(name);
+      if (it != params.end()) {
+        ParseNumber(it->second, v);
+      }
+      x.push_back(std::log1p(std::max(v, 0.0)));
+    }
+    return x;
+  }
+
+  double Dot(const std::vector<double>& x) const {
+    double y = 0.0;
+    for (size_t i = 0; i < x.size() && i < m_weights.size(); i++) {
+      y += x[i] * m_weights[i];
+    }
+    return y;
+  }
+
+  std::vector<std::string> m_features;
+  std::vector<double> m_weights;
+  size_t m_samples = 0;
+  double m_r2 = 0.0;
+};
+
+/**
+ * Makespan of greedy list scheduling of `durations` (in dispatch order) on `workers` slots.
+ */
+inline double ListScheduleMakespan(const std::vector<double>& durations, uint32_t workers) {
+  std::priority_queue<double, std::vector<double>, std::greater<double>> freeAt;
+  for (uint32_t i = 0; i < std::max<uint32_t>(workers, 1); i++) {
+    freeAt.push(0.0);
+  }
+  double makespan = 0.0;
+  for (double d : durations) {
+    double start = freeAt.top();
+    freeAt.pop();
+    freeAt.push(start + d);
+    makespan = std::max(makespan, start + d);
+  }
+  return makespan;
+}
+
+} // namespace sweep
+
+#endif /* WIFI_ZIGBEE_RUNTIME_MODEL_H */
@@ -0,0 +1,293 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/**
+ * Surrogate model tool for the wifi-zigbee scenario.
+ *
+ * Trains one boosted-tree ensemble per --targets key on every run in the
+ * result cache (see wifi-zigbee-surrogate.h), reports its out-of-bag error
+ * and answers what-if queries without simulating:
+ *
+ *   ./ns3 run "wifi-zigbee-surrogate --query=wifiDataRate=120Mbps,heartbeatInterval=0.25"
+ *
+ * Several queries are separated by ';', or read from --queryFile in the
+ * points format of wifi-zigbee-sweep. Parameters not given take the value
+ * most common in the cache.
+ *
+ * With --recommend=N it draws --candidates random points inside the range
+ * covered by the cache and writes the N with the largest normalized ensemble
+ * spread to --recommendFile, ready for wifi-zigbee-sweep --pointsFile.
+ */
+
+#include "wifi-zigbee-surrogate.h"
+#include "wifi-zigbee-sweep.h"
+
+#include "ns3/core-module.h"
+
+#include <iostream>
+
+using namespace ns3;
+using namespace sweep;
+
+NS_LOG_COMPONENT_DEFINE("WifiZigbeeSurrogate");
+
+/**
+ * Value range and unit suffix of one model feature, as seen in the cache.
+ */
+struct FeatureRange {
+  double lo = 0.0;
+  double hi = 0.0;
+  bool integer = true;
+  std::string unit;         //!< suffix of the cached values, e.g. "Mbps"
+  double multiplier = 1.0;  //!< what ParseNumber applied for the suffix
+  std::string mostCommon;
+  std::vector<std::string> levels; //!< observed values if there are few, candidates only use these
+};
+
+static std::map<std::string, FeatureRange> GetRanges(const std::vector<KeyValues>& entries,
+                                                     const std::vector<std::string>& features) {
+  std::map<std::string, FeatureRange> ranges;
+  for (const auto& name : features) {
+    FeatureRange r;
+    std::map<std::string, uint32_t> counts;
+    bool first = true;
+    for (const auto& e : entries) {
+      auto it = e.find("param." + name);
+      double v;
+      if (it == e.end() || !ParseNumber(it->second, v)) {
+        continue;
+      }
+      counts[it->second]++;
+      char* end = nullptr;
+      double raw = std::strtod(it->second.c_str(), &end);
+      if (first) {
+        r.unit = end;
+        r.multiplier = raw != 0.0 ? v / raw : 1.0;
+        r.lo = v;
+        r.hi = v;
+        first = false;
+      }
+      r.lo = std::min(r.lo, v);
+      r.hi = std::max(r.hi, v);
+      r.integer = r.integer && raw == std::floor(raw);
+    }
+    uint32_t best = 0;
+    for (const auto& c : counts) {
+      if (c.second > best) {
+        best = c.second;
+        r.mostCommon = c.first;
+      }
+    }
+    if (counts.size() <= 8) {
+      for (const auto& c : counts) {
+        r.levels.push_back(c.first);
+      }
+    }
+    ranges[name] = r;
+  }
+  return ranges;
+}
+
+static std::string FormatValue(const FeatureRange& r, double v) {
+  std::ostringstream os;
+  double scaled = v / r.multiplier;
+  if (r.integer) {
+    os << std::llround(scaled);
+  } else {
+    os << std::setprecision(4) << scaled;
+  }
+  return os.str() + r.unit;
+}
+
+static std::vector<KeyValues> ParseQueries(const std::string& query, const std::string& queryFile) {
+  std::vector<KeyValues> queries;
+  for (const auto& q : Split(query, ';')) {
+    if (Trim(q).empty()) {
+      continue;
+    }
+    KeyValues kv;
+    for (const auto& item : Split(q, ',')) {
+      size_t eq = item.find('=');
+      NS_ABORT_MSG_IF(eq == std::string::npos, "Malformed query item '" << item << "'");
+      kv[Trim(item.substr(0, eq))] = Trim(item.substr(eq + 1));
+    }
+    queries.push_back(kv);
+  }
+  if (!queryFile.empty()) {
+    std::ifstream in(queryFile);
+    NS_ABORT_MSG_IF(!in, "Unable to open query file " << queryFile);
+    std::string line;
+    while (std::getline(in, line)) {
+      line = Trim(line);
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+      KeyValues kv;
+      std::istringstream tokens(line);
+      std::string token;
+      while (tokens >> token) {
+        if (token.rfind("--", 0) == 0) {
+          token = token.substr(2);
+        }
+        size_t eq = token.find('=');
+        NS_ABORT_MSG_IF(eq == std::string::npos, "Malformed token '" << token << "' in " << queryFile);
+        kv[token.substr(0, eq)] = token.substr(eq + 1);
+      }
+      queries.push_back(kv);
+    }
+  }
+  return queries;
+}
+
+int main(int argc, char* argv[]) {
+  std::string cacheDir = "output/cache";
+  std::string targets = "zigbee.pdr,zigbee.delayP99,wifi.throughputKbps";
+  uint32_t members = 10;
+  uint32_t trees = 100;
+  uint32_t depth = 3;
+  uint32_t minLeaf = 2;
+  double learningRate = 0.1;
+  uint32_t seed = 1;
+  std::string query = "";
+  std::string queryFile = "";
+  uint32_t recommend = 0;
+  uint32_t candidates = 2000;
+  std::string recommendFile = "output/recommend.txt";
+
+  CommandLine cmd;
+  cmd.AddValue("cacheDir", "Directory of the result cache", cacheDir);
+  cmd.AddValue("targets", "Comma separated result keys to model", targets);
+  cmd.AddValue("members", "Bootstrap ensemble size", members);
+  cmd.AddValue("trees", "Boosting rounds per ensemble member", trees);
+  cmd.AddValue("depth", "Maximum depth of each tree", depth);
+  cmd.AddValue("minLeaf", "Minimum samples per leaf", minLeaf);
+  cmd.AddValue("learningRate", "Shrinkage of each boosting round", learningRate);
+  cmd.AddValue("seed", "Seed of the bootstrap and candidate sampling", seed);
+  cmd.AddValue("query", "Points to predict, e.g. \"a=1,b=2;a=3,b=4\"", query);
+  cmd.AddValue("queryFile", "File of points to predict (one per line, key=value pairs)", queryFile);
+  cmd.AddValue("recommend", "Number of points to recommend for simulation", recommend);
+  cmd.AddValue("candidates", "Random candidates scored for the recommendation", candidates);
+  cmd.AddValue("recommendFile", "Points file written with the recommendation", recommendFile);
+  cmd.Parse(argc, argv);
+
+  ResultCache cache(cacheDir);
+  std::vector<KeyValues> entries = cache.Entries();
+  std::vector<std::string> features = VaryingParams(entries);
+  std::map<std::string, FeatureRange> ranges = GetRanges(entries, features);
+
+  BoostingParams params;
+  params.trees = trees;
+  params.depth = depth;
+  params.minLeaf = minLeaf;
+  params.learningRate = learningRate;
+
+  std::vector<std::string> names;
+  std::vector<SurrogateModel> models;
+  for (const auto& t : Split(targets, ',')) {
+    if (Trim(t).empty()) {
+      continue;
+    }
+    names.push_back(Trim(t));
+    models.emplace_back();
+    models.back().Train(entries, features, names.back(), members, params, seed);
+  }
+
+  NS_LOG_UNCOND("=== Surrogate models (" << entries.size() << " cached runs, " << features.size()
+                                         << " features) ===");
+  std::ostringstream featureList;
+  for (const auto& f : features) {
+    const auto& r = ranges[f];
+    featureList << " " << f << "=[" << FormatValue(r, r.lo) << ", " << FormatValue(r, r.hi) << "]";
+  }
+  NS_LOG_UNCOND("  features:" << featureList.str());
+  NS_LOG_UNCOND("Target               | Samples | OOB RMSE     | OOB R2");
+  for (size_t i = 0; i < names.size(); i++) {
+    NS_LOG_UNCOND(std::left << std::setw(20) << names[i] << std::right << " | " << std::setw(7)
+                            << models[i].GetSamples() << " | " << std::scientific << std::setprecision(3)
+                            << std::setw(12) << models[i].GetRmse() << " | " << std::fixed << std::setprecision(3)
+                            << models[i].GetR2() << std::defaultfloat);
+  }
+
+  // Queries: unspecified parameters take the most common cached value
+  std::vector<KeyValues> queries = ParseQueries(query, queryFile);
+  if (!queries.empty()) {
+    NS_LOG_UNCOND("=== Predictions (mean +- ensemble spread) ===");
+  }
+  for (auto& q : queries) {
+    for (const auto& f : features) {
+      if (!q.count(f)) {
+        q[f] = ranges[f].mostCommon;
+      }
+    }
+    std::ostringstream line;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::pair<double, double>> predictions;
+    for (const auto& m : models) {
+      predictions.push_back(m.IsTrained() ? m.Predict(q) : std::make_pair(0.0, 0.0));
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    for (const auto& f : features) {
+      line << f << "=" << q[f] << " ";
+    }
+    NS_LOG_UNCOND(line.str());
+    for (size_t i = 0; i < names.size(); i++) {
+      NS_LOG_UNCOND("  " << std::left << std::setw(20) << names[i] << std::right << " = " << std::setprecision(6)
+                         << predictions[i].first << " +- " << std::setprecision(3) << predictions[i].second
+                         << (models[i].IsTrained() ? "" : " (untrained)"));
+    }
+    NS_LOG_UNCOND("  predicted in " << std::fixed << std::setprecision(1) << us << " us" << std::defaultfloat);
+  }
+
+  // Active learning: candidates where the ensemble members disagree most,
+  // relative to the spread of each target over the cache
+  if (recommend > 0 && !features.empty()) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> u(0.0, 1.0);
+    std::vector<std::pair<double, KeyValues>> scored;
+    for (uint32_t c = 0; c < candidates; c++) {
+      KeyValues p;
+      for (const auto& f : features) {
+        const auto& r = ranges[f];
+        if (!r.levels.empty()) {
+          p[f] = r.levels[std::min(r.levels.size() - 1, size_t(u(rng) * double(r.levels.size())))];
+          continue;
+        }
+        bool logScale = r.lo > 0.0 && r.hi / r.lo > 10.0;
+        double v = logScale ? std::exp(std::log(r.lo) + u(rng) * (std::log(r.hi) - std::log(r.lo)))
+                            : r.lo + u(rng) * (r.hi - r.lo);
+        p[f] = FormatValue(r, v);
+      }
+      double score = 0.0;
+      for (const auto& m : models) {
+        if (m.IsTrained() && m.GetScale() > 0.0) {
+          score += m.Predict(p).second / m.GetScale();
+        }
+      }
+      scored.emplace_back(score, p);
+    }
+    std::stable_sort(scored.begin(), scored.end(),
+                     [](const auto& a, const auto& b) { return a.first > b.first; });
+    scored.resize(std::min<size_t>(scored.size(), recommend));
+
+    std::filesystem::path parent = std::filesystem::path(recommendFile).parent_path();
+    if (!parent.empty()) {
+      std::filesystem::create_directories(parent);
+    }
+    std::ofstream out(recommendFile);
+    out << "# Points where the surrogate is least certain (score = sum of spread / target stddev)\n";
+    NS_LOG_UNCOND("=== Recommended points ===");
+    for (const auto& s : scored) {
+      std::ostringstream line;
+      for (const auto& kv : s.second) {
+        line << kv.first << "=" << kv.second << " ";
+      }
+      out << line.str() << "\n";
+      NS_LOG_UNCOND("  score=" << std::fixed << std::setprecision(3) << s.first << std::defaultfloat << "  "
+                               << line.str());
+    }
+    NS_LOG_UNCOND("  written to " << recommendFile);
+  }
+
+  return 0;
+}
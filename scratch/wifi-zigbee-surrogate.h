@@ -0,0 +1,290 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/**
+ * Surrogate model of the wifi-zigbee scenario.
+ *
+ * Gradient-boosted regression trees over the numeric parameters that vary in
+ * the result cache, predicting one result key. A bootstrap ensemble of such
+ * models gives the prediction spread, which is used as the uncertainty and to
+ * pick the points whose simulation would teach the model most.
+ */
+
+#ifndef WIFI_ZIGBEE_SURROGATE_H
+#define WIFI_ZIGBEE_SURROGATE_H
+
+#include "wifi-zigbee-runtime-model.h"
+
+#include <numeric>
+#include <random>
+
+namespace sweep {
+
+/**
+ * Least-squares regression tree stored as a flat node array.
+ */
+class RegressionTree {
+public:
+  /**
+   * Fit the tree on the given rows of x (one feature vector per sample).
+   */
+  void Fit(const std::vector<std::vector<double>>& x, const std::vector<double>& y, std::vector<size_t> rows,
+           uint32_t maxDepth, uint32_t minLeaf) {
+    m_nodes.clear();
+    Grow(x, y, rows, maxDepth, minLeaf);
+  }
+
+  double Predict(const std::vector<double>& x) const {
+    size_t n = 0;
+    while (m_nodes[n].feature >= 0) {
+      n = x[m_nodes[n].feature] <= m_nodes[n].threshold ? m_nodes[n].left : m_nodes[n].right;
+    }
+    return m_nodes[n].value;
+  }
+
+private:
+  struct Node {
+    int32_t feature = -1; //!< -1 for leaves
+    double threshold = 0.0;
+    size_t left = 0;
+    size_t right = 0;
+    double value = 0.0;
+  };
+
+  size_t Grow(const std::vector<std::vector<double>>& x, const std::vector<double>& y, std::vector<size_t>& rows,
+              uint32_t depth, uint32_t minLeaf) {
+    size_t id = m_nodes.size();
+    m_nodes.emplace_back();
+    double sum = 0.0;
+    for (size_t r : rows) {
+      sum += y[r];
+    }
+    m_nodes[id].value = rows.empty() ? 0.0 : sum / double(rows.size());
+    if (depth == 0 || rows.size() < std::max<size_t>(2, 2 * size_t(minLeaf))) {
+      return id;
+    }
+
+    // Best split: maximize the reduction of the squared error, i.e. maximize
+    // sumL^2/nL + sumR^2/nR over all thresholds between distinct values
+    double bestGain = sum * sum / double(rows.size()) + 1e-12;
+    int32_t bestFeature = -1;
+    double bestThreshold = 0.0;
+    for (size_t f = 0; f < x[rows[0]].size(); f++) {
+      std::sort(rows.begin(), rows.end(), [&](size_t a, size_t b) { return x[a][f] < x[b][f]; });
+      double left = 0.0;
+      for (size_t i = 0; i + 1 < rows.size(); i++) {
+        left += y[rows[i]];
+        size_t nl = i + 1;
+        size_t nr = rows.size() - nl;
+        if (nl < minLeaf || nr < minLeaf || x[rows[i]][f] == x[rows[i + 1]][f]) {
+          continue;
+        }
+        double right = sum - left;
+        double gain = left * left / double(nl) + right * right / double(nr);
+        if (gain > bestGain) {
+          bestGain = gain;
+          bestFeature = int32_t(f);
+          bestThreshold = 0.5 * (x[rows[i]][f] + x[rows[i + 1]][f]);
+        }
+      }
+    }
+    if (bestFeature < 0) {
+      return id;
+    }
+
+    std::vector<size_t> lrows;
+    std::vector<size_t> rrows;
+    for (size_t r : rows) {
+      (x[r][bestFeature] <= bestThreshold ? lrows : rrows).push_back(r);
+    }
+    m_nodes[id].feature = bestFeature;
+    m_nodes[id].threshold = bestThreshold;
+    size_t l = Grow(x, y, lrows, depth - 1, minLeaf);
+    size_t r = Grow(x, y, rrows, depth - 1, minLeaf);
+    m_nodes[id].left = l;
+    m_nodes[id].right = r;
+    return id;
+  }
+
+  std::vector<Node> m_nodes;
+};
+
+struct BoostingParams {
+  uint32_t trees = 100;
+  uint32_t depth = 3;
+  uint32_t minLeaf = 2;
+  double learningRate = 0.1;
+};
+
+/**
+ * Gradient boosting with squared loss: every tree fits the residuals of the
+ * previous ones.
+ */
+class BoostedTrees {
+public:
+  void Fit(const std::vector<std::vector<double>>& x, const std::vector<double>& y, const std::vector<size_t>& rows,
+           const BoostingParams& params) {
+    m_rate = params.learningRate;
+    m_base = 0.0;
+    for (size_t r : rows) {
+      m_base += y[r] / double(rows.size());
+    }
+    std::vector<double> residual(y.size(), 0.0);
+    for (size_t r : rows) {
+      residual[r] = y[r] - m_base;
+    }
+    m_trees.assign(params.trees, RegressionTree());
+    for (auto& tree : m_trees) {
+      tree.Fit(x, residual, rows, params.depth, params.minLeaf);
+      for (size_t r : rows) {
+        residual[r] -= m_rate * tree.Predict(x[r]);
+      }
+    }
+  }
+
+  double Predict(const std::vector<double>& x) const {
+    double y = m_base;
+    for (const auto& tree : m_trees) {
+      y += m_rate * tree.Predict(x);
+    }
+    return y;
+  }
+
+private:
+  double m_base = 0.0;
+  double m_rate = 0.1;
+  std::vector<RegressionTree> m_trees;
+};
+
+/**
+ * Bootstrap ensemble of boosted trees predicting one result key.
+ */
+class SurrogateModel {
+public:
+  /**
+   * Train on cache entries (see ResultCache::Entries()) that have `target`.
+   * \return the number of samples used
+   */
+  size_t Train(const std::vector<KeyValues>& entries, const std::vector<std::string>& features,
+               const std::string& target, uint32_t members, const BoostingParams& params, uint64_t seed) {
+    m_features = features;
+    m_members.clear();
+    std::vector<std::vector<double>> x;
+    std::vector<double> y;
+    for (const auto& e : entries) {
+      auto it = e.find("result." + target);
+      if (it == e.end()) {
+        continue;
+      }
+      KeyValues p;
+      for (const auto& kv : e) {
+        if (kv.first.rfind("param.", 0) == 0) {
+          p[kv.first.substr(6)] = kv.second;
+        }
+      }
+      x.push_back(Features(p));
+      y.push_back(std::stod(it->second));
+    }
+    m_samples = x.size();
+    if (m_samples < 2) {
+      return m_samples;
+    }
+
+    // Every member sees a bootstrap resample; the samples it did not see give
+    // an out-of-bag estimate of the prediction error
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<size_t> pick(0, m_samples - 1);
+    std::vector<double> oobSum(m_samples, 0.0);
+    std::vector<uint32_t> oobCount(m_samples, 0);
+    m_members.resize(std::max(members, 1u));
+    for (auto& member : m_members) {
+      std::vector<size_t> rows(m_samples);
+      std::vector<bool> seen(m_samples, false);
+      for (auto& r : rows) {
+        r = pick(rng);
+        seen[r] = true;
+      }
+      member.Fit(x, y, rows, params);
+      for (size_t s = 0; s < m_samples; s++) {
+        if (!seen[s]) {
+          oobSum[s] += member.Predict(x[s]);
+          oobCount[s]++;
+        }
+      }
+    }
+
+    double mean = std::accumulate(y.begin(), y.end(), 0.0) / double(m_samples);
+    double ssRes = 0.0;
+    double ssTot = 0.0;
+    size_t oob = 0;
+    for (size_t s = 0; s < m_samples; s++) {
+      if (oobCount[s] == 0) {
+        continue;
+      }
+      double err = oobSum[s] / oobCount[s] - y[s];
+      ssRes += err * err;
+      ssTot += (y[s] - mean) * (y[s] - mean);
+      oob++;
+    }
+    m_rmse = oob > 0 ? std::sqrt(ssRes / double(oob)) : 0.0;
+    m_r2 = ssTot > 0.0 ? 1.0 - ssRes / ssTot : 0.0;
+    m_scale = std::sqrt(ssTot / double(std::max<size_t>(oob, 1)));
+    return m_samples;
+  }
+
+  bool IsTrained() const { return !m_members.empty(); }
+
+  /**
+   * \return mean and standard deviation of the member predictions
+   */
+  std::pair<double, double> Predict(const KeyValues& params) const {
+    std::vector<double> x = Features(params);
+    double sum = 0.0;
+    double sum2 = 0.0;
+    for (const auto& member : m_members) {
+      double y = member.Predict(x);
+      sum += y;
+      sum2 += y * y;
+    }
+    double n = double(m_members.size());
+    double mean = sum / n;
+    return {mean, std::sqrt(std::max(0.0, sum2 / n - mean * mean))};
+  }
+
+  size_t GetSamples() const { return m_samples; }
+
+  /** Out-of-bag root mean squared error */
+  double GetRmse() const { return m_rmse; }
+
+  /** Out-of-bag coefficient of determination */
+  double GetR2() const { return m_r2; }
+
+  /** Standard deviation of the target, to compare uncertainties across targets */
+  double GetScale() const { return m_scale; }
+
+private:
+  std::vector<double> Features(const KeyValues& params) const {
+    std::vector<double> x;
+    for (const auto& name : m_features) {
+      double v = 0.0;
+      auto it = params.find(name);
+      if (it != params.end()) {
+        ParseNumber(it->second, v);
+      }
+      x.push_back(v);
+    }
+    return x;
+  }
+
+  std::vector<std::string> m_features;
+  std::vector<BoostedTrees> m_members;
+  size_t m_samples = 0;
+  double m_rmse = 0.0;
+  double m_r2 = 0.0;
+  double m_scale = 0.0;
+};
+
+} // namespace sweep
+
+#endif /* WIFI_ZIGBEE_SURROGATE_H */
@@ -0,0 +1,360 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/**
+ * Sweep driver for the wifi-zigbee scenario.
+ *
+ * Expands a parameter grid (or a file of points) times a number of RNG runs
+ * into simulator invocations and runs only those that are not already in the
+ * content-addressed result cache (see wifi-zigbee-sweep.h).
+ *
+ * Example (from the ns-3 directory):
+ *
+ *   ./ns3 run "wifi-zigbee-sweep --grid=wifiDataRate=10Mbps,80Mbps,160Mbps;heartbeatInterval=0.5,1 --runs=5"
+ *
+ * A points file holds one point per line, as whitespace separated key=value
+ * pairs; lines starting with '#' are ignored.
+ *
+ * With --schedule=lpt (default) the cache misses are dispatched longest
+ * predicted job first, using a runtime model trained on the cache (see
+ * wifi-zigbee-runtime-model.h). Every replication is a job of its own, so
+ * the runs of an expensive point are spread over all workers instead of
+ * queueing behind each other at the tail of the sweep.
+ *
+ * All points use the same rngRun values, and the simulator ties each random
+ * stream to a component role, so runs of two points with the same rngRun use
+ * common random numbers. --pairAxis=<param> reports, for each pair of values
+ * of that parameter, the variance of the paired differences of --pairMetric
+ * against the variance an unpaired comparison would have.
+ */
+
+#include "wifi-zigbee-runtime-model.h"
+#include "wifi-zigbee-sweep.h"
+
+#include "ns3/core-module.h"
+
+#include <iostream>
+#include <thread>
+
+using namespace ns3;
+using namespace sweep;
+
+NS_LOG_COMPONENT_DEFINE("WifiZigbeeSweep");
+
+using Point = std::vector<std::pair<std::string, std::string>>;
+
+static std::vector<Point> ExpandGrid(const std::string& grid) {
+  std::vector<Point> points{Point{}};
+  for (const auto& axis : Split(grid, ';')) {
+    size_t eq = axis.find('=');
+    if (Trim(axis).empty() || eq == std::string::npos) {
+      continue;
+    }
+    std::string name = Trim(axis.substr(0, eq));
+    std::vector<Point> expanded;
+    for (const auto& p : points) {
+      for (const auto& value : Split(axis.substr(eq + 1), ',')) {
+        Point q = p;
+        q.emplace_back(name, Trim(value));
+        expanded.push_back(q);
+      }
+    }
+    points = expanded;
+  }
+  return points;
+}
+
+static std::vector<Point> ReadPoints(const std::string& path) {
+  std::vector<Point> points;
+  std::ifstream in(path);
+  NS_ABORT_MSG_IF(!in, "Unable to open points file " << path);
+  std::string line;
+  while (std::getline(in, line)) {
+    line = Trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    Point p;
+    std::istringstream tokens(line);
+    std::string token;
+    while (tokens >> token) {
+      if (token.rfind("--", 0) == 0) {
+        token = token.substr(2);
+      }
+      size_t eq = token.find('=');
+      NS_ABORT_MSG_IF(eq == std::string::npos, "Malformed token '" << token << "' in " << path);
+      p.emplace_back(token.substr(0, eq), token.substr(eq + 1));
+    }
+    points.push_back(p);
+  }
+  return points;
+}
+
+static void WriteCsv(const std::string& path, const std::vector<SweepJob>& jobs, const std::vector<RunRecord>& records) {
+  std::set<std::string> paramKeys;
+  std::set<std::string> resultKeys;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    for (const auto& kv : jobs[i].params) {
+      paramKeys.insert(kv.first);
+    }
+    for (const auto& kv : records[i].results) {
+      resultKeys.insert(kv.first);
+    }
+  }
+
+  std::filesystem::path parent = std::filesystem::path(path).parent_path();
+  if (!parent.empty()) {
+    std::filesystem::create_directories(parent);
+  }
+  std::ofstream out(path);
+  out << "key,ok,cached,cpuSeconds";
+  for (const auto& k : paramKeys) {
+    out << "," << k;
+  }
+  for (const auto& k : resultKeys) {
+    out << "," << k;
+  }
+  out << "\n";
+  for (size_t i = 0; i < jobs.size(); i++) {
+    out << jobs[i].key << "," << records[i].ok << "," << records[i].cached << "," << records[i].cpuSeconds;
+    for (const auto& k : paramKeys) {
+      auto it = jobs[i].params.find(k);
+      out << "," << (it != jobs[i].params.end() ? it->second : "");
+    }
+    for (const auto& k : resultKeys) {
+      auto it = records[i].results.find(k);
+      out << "," << (it != records[i].results.end() ? it->second : "");
+    }
+    out << "\n";
+  }
+}
+
+static double Variance(const std::vector<double>& v) {
+  if (v.size() < 2) {
+    return 0.0;
+  }
+  double mean = 0.0;
+  for (double x : v) {
+    mean += x / double(v.size());
+  }
+  double ss = 0.0;
+  for (double x : v) {
+    ss += (x - mean) * (x - mean);
+  }
+  return ss / double(v.size() - 1);
+}
+
+static void PrintPairedReport(const std::string& axis, const std::string& metric, const std::vector<SweepJob>& jobs,
+                              const std::vector<RunRecord>& records) {
+  // group -> axis value -> rngRun -> metric
+  std::map<std::string, std::map<std::string, std::map<std::string, double>>> groups;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    auto m = records[i].results.find(metric);
+    auto a = jobs[i].params.find(axis);
+    auto r = jobs[i].params.find("rngRun");
+    if (!records[i].ok || m == records[i].results.end() || a == jobs[i].params.end() || r == jobs[i].params.end()) {
+      continue;
+    }
+    std::string group;
+    for (const auto& kv : jobs[i].params) {
+      if (kv.first != axis && kv.first != "rngRun") {
+        group += kv.first + "=" + kv.second + " ";
+      }
+    }
+    groups[group][a->second][r->second] = std::stod(m->second);
+  }
+
+  NS_LOG_UNCOND("=== Paired differences of " << metric << " along " << axis << " ===");
+  NS_LOG_UNCOND("A          | B          | Runs | MeanDiff   | Var(paired) | Var(A)+Var(B) | Reduction");
+  for (const auto& g : groups) {
+    for (auto a = g.second.begin(); a != g.second.end(); ++a) {
+      auto b = std::next(a);
+      if (b == g.second.end()) {
+        break;
+      }
+      std::vector<double> va;
+      std::vector<double> vb;
+      std::vector<double> diff;
+      for (const auto& run : a->second) {
+        auto other = b->second.find(run.first);
+        if (other != b->second.end()) {
+          va.push_back(run.second);
+          vb.push_back(other->second);
+          diff.push_back(run.second - other->second);
+        }
+      }
+      if (diff.size() < 2) {
+        continue;
+      }
+      double meanDiff = 0.0;
+      for (double d : diff) {
+        meanDiff += d / double(diff.size());
+      }
+      double paired = Variance(diff);
+      double unpaired = Variance(va) + Variance(vb);
+      std::ostringstream reduction;
+      if (paired > 0.0) {
+        reduction << std::fixed << std::setprecision(2) << unpaired / paired << "x";
+      } else {
+        reduction << "inf";
+      }
+      NS_LOG_UNCOND(std::left << std::setw(10) << a->first << " | " << std::setw(10) << b->first << std::right << " | "
+                              << std::setw(4) << diff.size() << " | " << std::scientific << std::setprecision(3)
+                              << std::setw(10) << meanDiff << " | " << std::setw(11) << paired << " | "
+                              << std::setw(13) << unpaired << " | " << reduction.str() << std::defaultfloat);
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  std::string simBinary = "./build/scratch/ns3.44-wifi-zigbee-default";
+  std::string grid = "";
+  std::string pointsFile = "";
+  uint32_t runs = 1;
+  uint32_t firstRun = 1;
+  uint32_t parallel = std::max(1u, std::thread::hardware_concurrency());
+  std::string cacheDir = "output/cache";
+  std::string ns3Version = "3.44";
+  std::string outFile = "output/sweep.csv";
+  std::string schedule = "lpt";
+  std::string pairAxis = "";
+  std::string pairMetric = "zigbee.pdr";
+
+  CommandLine cmd;
+  cmd.AddValue("simBinary", "Path to the wifi-zigbee simulator binary", simBinary);
+  cmd.AddValue("grid", "Parameter grid, e.g. \"wifiDataRate=10Mbps,160Mbps;heartbeatInterval=0.5,1\"", grid);
+  cmd.AddValue("pointsFile", "File with one point (key=value ...) per line", pointsFile);
+  cmd.AddValue("runs", "Number of RNG runs per point", runs);
+  cmd.AddValue("firstRun", "First rngRun value", firstRun);
+  cmd.AddValue("parallel", "Maximum number of concurrent simulator processes", parallel);
+  cmd.AddValue("cacheDir", "Result cache directory", cacheDir);
+  cmd.AddValue("ns3Version", "ns-3 version, part of every cache key", ns3Version);
+  cmd.AddValue("outFile", "Aggregated CSV output (one line per run)", outFile);
+  cmd.AddValue("schedule", "Dispatch order of cache misses: lpt (longest predicted first) or input", schedule);
+  cmd.AddValue("pairAxis", "Report paired-difference variance reduction along this parameter", pairAxis);
+  cmd.AddValue("pairMetric", "Result key used by the paired report", pairMetric);
+  cmd.Parse(argc, argv);
+
+  std::vector<Point> points = pointsFile.empty() ? ExpandGrid(grid) : ReadPoints(pointsFile);
+  std::string binaryHash = Sha256File(simBinary);
+  NS_ABORT_MSG_IF(binaryHash.empty(), "Unable to read simulator binary " << simBinary);
+
+  std::vector<SweepJob> jobs;
+  for (const auto& point : points) {
+    bool hasRun = false;
+    SweepJob base;
+    for (const auto& kv : point) {
+      base.args.push_back("--" + kv.first + "=" + kv.second);
+      hasRun = hasRun || kv.first == "rngRun";
+    }
+    base.args.push_back("--logLevel=0");
+    for (uint32_t r = 0; r < (hasRun ? 1 : runs); r++) {
+      SweepJob job = base;
+      if (!hasRun) {
+        job.args.push_back("--rngRun=" + std::to_string(firstRun + r));
+      }
+      NS_ABORT_MSG_IF(!ResolveJob(simBinary, binaryHash, ns3Version, job),
+                      "Simulator rejected the arguments of point " << jobs.size());
+      jobs.push_back(job);
+    }
+  }
+
+  ResultCache cache(cacheDir);
+
+  // Dispatch order: longest predicted job first
+  RuntimeModel model;
+  model.Train(cache.Entries());
+  std::vector<double> predicted;
+  for (const auto& job : jobs) {
+    predicted.push_back(model.Predict(job.params));
+  }
+  std::vector<size_t> order(jobs.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  if (schedule == "lpt") {
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return predicted[a] > predicted[b]; });
+  } else {
+    NS_ABORT_MSG_IF(schedule != "input", "Unknown schedule " << schedule);
+  }
+  std::vector<SweepJob> ordered;
+  for (size_t i : order) {
+    ordered.push_back(jobs[i]);
+  }
+
+  JobRunner runner(simBinary, cache, parallel);
+  runner.SetFinishedCallback([](const SweepJob& job, const RunRecord& rec) {
+    NS_LOG_UNCOND((rec.ok ? "done   " : "FAILED ") << job.key.substr(0, 12) << " cpu=" << std::fixed
+                                                   << std::setprecision(1) << rec.cpuSeconds << "s");
+  });
+
+  auto wallStart = std::chrono::steady_clock::now();
+  std::vector<RunRecord> orderedRecords = runner.Run(ordered);
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  std::vector<RunRecord> records(jobs.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    records[order[i]] = orderedRecords[i];
+  }
+
+  // Makespan of the executed jobs in input order versus the chosen order,
+  // both with the predicted and with the measured durations
+  std::vector<double> predInput;
+  std::vector<double> predChosen;
+  std::vector<double> actualInput;
+  std::vector<double> actualChosen;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (!records[i].cached) {
+      predInput.push_back(predicted[i]);
+      actualInput.push_back(records[i].cpuSeconds);
+    }
+    if (!records[order[i]].cached) {
+      predChosen.push_back(predicted[order[i]]);
+      actualChosen.push_back(records[order[i]].cpuSeconds);
+    }
+  }
+
+  uint32_t hits = 0;
+  uint32_t failures = 0;
+  double cpuSaved = 0.0;
+  double cpuSpent = 0.0;
+  for (const auto& rec : records) {
+    if (rec.cached) {
+      hits++;
+      cpuSaved += rec.cpuSeconds;
+    } else {
+      cpuSpent += rec.cpuSeconds;
+      failures += rec.ok ? 0 : 1;
+    }
+  }
+
+  WriteCsv(outFile, jobs, records);
+
+  NS_LOG_UNCOND("=== Sweep summary ===");
+  NS_LOG_UNCOND("  runs          = " << jobs.size() << " (" << points.size() << " points)");
+  NS_LOG_UNCOND("  cache hits    = " << hits << " (" << std::fixed << std::setprecision(1)
+                                      << (jobs.empty() ? 0.0 : 100.0 * hits / jobs.size()) << "%)");
+  NS_LOG_UNCOND("  executed      = " << (jobs.size() - hits) << " (" << failures << " failed)");
+  NS_LOG_UNCOND("  cpu spent     = " << std::setprecision(1) << cpuSpent << " s");
+  NS_LOG_UNCOND("  cpu saved     = " << std::setprecision(1) << cpuSaved << " s");
+  NS_LOG_UNCOND("  wall time     = " << std::setprecision(1) << wallSeconds << " s");
+  NS_LOG_UNCOND("  runtime model = " << model.GetSamples() << " samples, " << model.GetFeatures().size()
+                                      << " features, R2=" << std::setprecision(3) << model.GetR2());
+  if (model.IsTrained() && !actualInput.empty()) {
+    double predIn = ListScheduleMakespan(predInput, parallel);
+    double predOut = ListScheduleMakespan(predChosen, parallel);
+    double actIn = ListScheduleMakespan(actualInput, parallel);
+    double actOut = ListScheduleMakespan(actualChosen, parallel);
+    NS_LOG_UNCOND("  makespan      = " << std::setprecision(1) << actOut << " s (" << schedule << ") vs " << actIn
+                                      << " s (input order), improvement " << std::setprecision(1)
+                                      << (actIn > 0.0 ? 100.0 * (actIn - actOut) / actIn : 0.0) << "%");
+    NS_LOG_UNCOND("  predicted     = " << std::setprecision(1) << predOut << " s vs " << predIn << " s");
+  }
+  NS_LOG_UNCOND("  results       = " << outFile);
+
+  if (!pairAxis.empty()) {
+    PrintPairedReport(pairAxis, pairMetric, jobs, records);
+  }
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,620 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/**
+ * Support code shared by the sweep drivers of the wifi-zigbee scenario.
+ *
+ * A sweep job is one invocation of the simulator binary with a list of
+ * --key=value arguments. Every job is identified by the SHA-256 of its fully
+ * resolved configuration (as printed by `wifi-zigbee --dumpConfig`), the hash
+ * of the simulator binary and the ns-3 version. Finished jobs are stored in a
+ * content-addressed cache directory:
+ *
+ *   <cacheDir>/<key[0..1]>/<key>/results.txt   key=value results of the run
+ *   <cacheDir>/<key[0..1]>/<key>/meta.txt      cpu/wall time, arguments, config
+ *   <cacheDir>/<key[0..1]>/<key>/stdout.log    simulator output
+ *
+ * This header has no ns-3 dependency on purpose, the drivers only talk to
+ * the simulator through its command line and its results file.
+ */
+
+#ifndef WIFI_ZIGBEE_SWEEP_H
+#define WIFI_ZIGBEE_SWEEP_H
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace sweep {
+
+using KeyValues = std::map<std::string, std::string>;
+
+/**
+ * Minimal SHA-256 (FIPS 180-4), enough to content-address cache entries.
+ */
+class Sha256 {
+public:
+  Sha256() {
+    m_state = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  }
+
+  void Update(const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    m_length += len;
+    while (len > 0) {
+      size_t n = std::min(len, sizeof(m_block) - m_blockLen);
+      std::memcpy(m_block + m_blockLen, p, n);
+      m_blockLen += n;
+      p += n;
+      len -= n;
+      if (m_blockLen == sizeof(m_block)) {
+        Compress(m_block);
+        m_blockLen = 0;
+      }
+    }
+  }
+
+  void Update(const std::string& s) { Update(s.data(), s.size()); }
+
+  std::string HexDigest() {
+    uint64_t bits = m_length * 8;
+    uint8_t pad = 0x80;
+    Update(&pad, 1);
+    uint8_t zero = 0;
+    while (m_blockLen != 56) {
+      Update(&zero, 1);
+    }
+    uint8_t lenBytes[8];
+    for (int i = 0; i < 8; i++) {
+      lenBytes[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    }
+    Update(lenBytes, 8);
+
+    static const char* hex = "0123456789abcdef";
+    std::string out;
+    for (uint32_t word : m_state) {
+      for (int i = 28; i >= 0; i -= 4) {
+        out += hex[(word >> i) & 0xf];
+      }
+    }
+    return out;
+  }
+
+private:
+  static uint32_t Rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+  void Compress(const uint8_t* block) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) | (uint32_t(block[4 * i + 2]) << 8) |
+             uint32_t(block[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + k[i] + w[i];
+      uint32_t s0 = Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+    m_state[5] += f;
+    m_state[6] += g;
+    m_state[7] += h;
+  }
+
+  std::array<uint32_t, 8> m_state;
+  uint8_t m_block[64];
+  size_t m_blockLen = 0;
+  uint64_t m_length = 0;
+};
+
+inline std::string Sha256Hex(const std::string& s) {
+  Sha256 h;
+  h.Update(s);
+  return h.HexDigest();
+}
+
+inline std::string Sha256File(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return "";
+  }
+  Sha256 h;
+  char buf[1 << 16];
+  while (in) {
+    in.read(buf, sizeof(buf));
+    h.Update(buf, static_cast<size_t>(in.gcount()));
+  }
+  return h.HexDigest();
+}
+
+inline std::string Trim(const std::string& s) {
+  size_t b = s.find_first_not_of(" \t\r\n");
+  if (b == std::string::npos) {
+    return "";
+  }
+  size_t e = s.find_last_not_of(" \t\r\n");
+  return s.substr(b, e - b + 1);
+}
+
+inline std::vector<std::string> Split(const std::string& s, char sep) {
+  std::vector<std::string> out;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, sep)) {
+    out.push_back(item);
+  }
+  return out;
+}
+
+inline KeyValues ParseKeyValues(std::istream& in) {
+  KeyValues kv;
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t eq = line.find('=');
+    if (eq == std::string::npos || line[0] == '#') {
+      continue;
+    }
+    kv[Trim(line.substr(0, eq))] = Trim(line.substr(eq + 1));
+  }
+  return kv;
+}
+
+inline bool ReadKeyValues(const std::string& path, KeyValues& kv) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  kv = ParseKeyValues(in);
+  return true;
+}
+
+inline bool WriteKeyValues(const std::string& path, const KeyValues& kv) {
+  std::ofstream out(path);
+  for (const auto& e : kv) {
+    out << e.first << "=" << e.second << "\n";
+  }
+  return bool(out);
+}
+
+/**
+ * One point of a sweep: simulator arguments (without the binary) in --key=value form.
+ */
+struct SweepJob {
+  std::vector<std::string> args;
+  std::string config; //!< resolved configuration as printed by --dumpConfig
+  std::string key;    //!< content address of config + binary + ns-3 version
+  KeyValues params;   //!< config parsed into key=value pairs
+};
+
+/**
+ * Outcome of one run, either fresh or loaded from the cache.
+ */
+struct RunRecord {
+  bool cached = false;
+  bool ok = false;
+  bool aborted = false; //!< stopped early by the progress callback, results hold "progress.*" only
+  double cpuSeconds = 0.0;
+  double wallSeconds = 0.0;
+  KeyValues results;
+};
+
+inline std::vector<char*> MakeArgv(const std::string& binary, const std::vector<std::string>& args) {
+  std::vector<char*> argv;
+  argv.push_back(const_cast<char*>(binary.c_str()));
+  for (const auto& a : args) {
+    argv.push_back(const_cast<char*>(a.c_str()));
+  }
+  argv.push_back(nullptr);
+  return argv;
+}
+
+/**
+ * Run the binary to completion and capture its standard output.
+ */
+inline bool CaptureOutput(const std::string& binary, const std::vector<std::string>& args, std::string& output) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  std::vector<char*> argv = MakeArgv(binary, args);
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execv(binary.c_str(), argv.data());
+    _exit(127);
+  }
+  close(fds[1]);
+  output.clear();
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+    output.append(buf, static_cast<size_t>(n));
+  }
+  close(fds[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Start the binary in the background with stdout/stderr redirected to logPath.
+ */
+inline pid_t SpawnProcess(const std::string& binary, const std::vector<std::string>& args,
+                          const std::string& logPath) {
+  std::vector<char*> argv = MakeArgv(binary, args);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int fd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execv(binary.c_str(), argv.data());
+    _exit(127);
+  }
+  return pid;
+}
+
+inline double CpuSeconds(const struct rusage& ru) {
+  return double(ru.ru_utime.tv_sec) + double(ru.ru_utime.tv_usec) * 1e-6 + double(ru.ru_stime.tv_sec) +
+         double(ru.ru_stime.tv_usec) * 1e-6;
+}
+
+/**
+ * Content-addressed store of finished runs.
+ */
+class ResultCache {
+public:
+  explicit ResultCache(const std::string& dir) : m_dir(dir) {}
+
+  std::string EntryDir(const std::string& key) const { return m_dir + "/" + key.substr(0, 2) + "/" + key; }
+
+  /**
+   * A fresh staging directory for a run of key. The path is unique to this
+   * process and call, so concurrent sweeps sharing the cache never write to,
+   * or clean up, each other's runs; only the rename in Commit is shared.
+   */
+  std::string NewStagingDir(const std::string& key) const {
+    return m_dir + "/tmp/" + key + "." + std::to_string(getpid()) + "." + std::to_string(m_staged++);
+  }
+
+  bool Lookup(const std::string& key, RunRecord& record) const {
+    std::string dir = EntryDir(key);
+    KeyValues meta;
+    if (!ReadKeyValues(dir + "/meta.txt", meta) || !ReadKeyValues(dir + "/results.txt", record.results)) {
+      return false;
+    }
+    if (!ParseSeconds(meta["cpuSeconds"], record.cpuSeconds) ||
+        !ParseSeconds(meta["wallSeconds"], record.wallSeconds)) {
+      // Truncated or corrupt entry: drop it, so that the rerun can take its place
+      std::error_code ec;
+      std::filesystem::remove_all(dir, ec);
+      return false;
+    }
+    record.cached = true;
+    record.ok = true;
+    return true;
+  }
+
+  /**
+   * Move a finished staging directory into the cache. The rename is atomic,
+   * so concurrent sweeps sharing the cache never observe half-written entries.
+   */
+  bool Commit(const SweepJob& job, const std::string& staging, const RunRecord& record) const {
+    KeyValues meta;
+    std::ostringstream cpu;
+    std::ostringstream wall;
+    cpu << std::setprecision(12) << record.cpuSeconds;
+    wall << std::setprecision(12) << record.wallSeconds;
+    meta["cpuSeconds"] = cpu.str();
+    meta["wallSeconds"] = wall.str();
+    std::string args;
+    for (const auto& a : job.args) {
+      args += (args.empty() ? "" : " ") + a;
+    }
+    meta["args"] = args;
+    WriteKeyValues(staging + "/meta.txt", meta);
+    std::ofstream(staging + "/config.txt") << job.config;
+
+    std::error_code ec;
+    std::string target = EntryDir(job.key);
+    std::filesystem::create_directories(std::filesystem::path(target).parent_path(), ec);
+    std::filesystem::rename(staging, target, ec);
+    if (ec) {
+      // Another sweep finished the same point first, keep its entry
+      std::filesystem::remove_all(staging, ec);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Iterate over every cached entry (meta, config and results merged, config
+   * keys prefixed with "param.", results with "result.").
+   */
+  std::vector<KeyValues> Entries() const {
+    std::vector<KeyValues> out;
+    std::error_code ec;
+    if (!std::filesystem::exists(m_dir, ec)) {
+      return out;
+    }
+    for (const auto& shard : std::filesystem::directory_iterator(m_dir, ec)) {
+      if (!shard.is_directory() || shard.path().filename() == "tmp") {
+        continue;
+      }
+      for (const auto& entry : std::filesystem::directory_iterator(shard.path(), ec)) {
+        KeyValues meta;
+        KeyValues config;
+        KeyValues results;
+        std::string dir = entry.path().string();
+        if (!ReadKeyValues(dir + "/meta.txt", meta) || !ReadKeyValues(dir + "/config.txt", config) ||
+            !ReadKeyValues(dir + "/results.txt", results)) {
+          continue;
+        }
+        meta["key"] = entry.path().filename().string();
+        for (const auto& kv : config) {
+          meta["param." + kv.first] = kv.second;
+        }
+        for (const auto& kv : results) {
+          meta["result." + kv.first] = kv.second;
+        }
+        out.push_back(meta);
+      }
+    }
+    return out;
+  }
+
+private:
+  /**
+   * \return false unless s is a complete number
+   */
+  static bool ParseSeconds(const std::string& s, double& value) {
+    char* end = nullptr;
+    value = std::strtod(s.c_str(), &end);
+    return !s.empty() && end != s.c_str() && *end == '\0';
+  }
+
+  std::string m_dir;
+  mutable uint64_t m_staged = 0; // staging directories handed out
+};
+
+/**
+ * Resolve the configuration of a job through the simulator and derive its key.
+ */
+inline bool ResolveJob(const std::string& binary, const std::string& binaryHash, const std::string& ns3Version,
+                       SweepJob& job) {
+  std::vector<std::string> args = job.args;
+  args.push_back("--dumpConfig=1");
+  if (!CaptureOutput(binary, args, job.config)) {
+    return false;
+  }
+  std::istringstream in(job.config);
+  job.params = ParseKeyValues(in);
+  job.key = Sha256Hex(job.config + "binary=" + binaryHash + "\nns3=" + ns3Version + "\n");
+  return true;
+}
+
+/**
+ * Runs jobs through the cache with at most `parallel` simulator processes.
+ */
+class JobRunner {
+public:
+  JobRunner(std::string binary, const ResultCache& cache, uint32_t parallel)
+      : m_binary(std::move(binary)), m_cache(cache), m_parallel(std::max<uint32_t>(parallel, 1)) {}
+
+  /**
+   * Run the given jobs in the given order, skipping cache hits.
+   * \return one record per job, in the order of the input
+   */
+  std::vector<RunRecord> Run(const std::vector<SweepJob>& jobs) {
+    std::vector<RunRecord> records(jobs.size());
+    std::vector<size_t> misses;
+    for (size_t i = 0; i < jobs.size(); i++) {
+      if (!m_cache.Lookup(jobs[i].key, records[i])) {
+        misses.push_back(i);
+      }
+    }
+
+    struct Running {
+      size_t index;
+      std::string staging;
+      std::chrono::steady_clock::time_point start;
+      std::streamoff logOffset;
+      bool aborted;
+      KeyValues progress;
+    };
+    std::map<pid_t, Running> running;
+    size_t next = 0;
+    std::set<std::string> inFlight;
+    while (next < misses.size() || !running.empty()) {
+      while (next < misses.size() && running.size() < m_parallel) {
+        size_t idx = misses[next++];
+        const SweepJob& job = jobs[idx];
+        if (inFlight.count(job.key) > 0) {
+          continue; // duplicate point in the same sweep, filled in below
+        }
+        std::string staging = m_cache.NewStagingDir(job.key);
+        std::error_code ec;
+        std::filesystem::create_directories(staging, ec);
+        std::vector<std::string> args = job.args;
+        args.push_back("--resultsFile=" + staging + "/results.txt");
+        pid_t pid = SpawnProcess(m_binary, args, staging + "/stdout.log");
+        if (pid < 0) {
+          records[idx].ok = false;
+          continue;
+        }
+        inFlight.insert(job.key);
+        running[pid] = {idx, staging, std::chrono::steady_clock::now(), 0, false, {}};
+      }
+
+      int status = 0;
+      struct rusage ru;
+      pid_t pid = wait4(-1, &status, m_onProgress ? WNOHANG : 0, &ru);
+      if (pid == 0) {
+        for (auto& r : running) {
+          PollProgress(r.first, jobs[r.second.index], r.second.staging, r.second.logOffset, r.second.aborted,
+                       r.second.progress);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        continue;
+      }
+      if (pid < 0) {
+        break;
+      }
+      auto it = running.find(pid);
+      if (it == running.end()) {
+        continue;
+      }
+      size_t idx = it->second.index;
+      RunRecord& rec = records[idx];
+      rec.cpuSeconds = CpuSeconds(ru);
+      rec.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - it->second.start).count();
+      const std::string& staging = it->second.staging;
+      rec.aborted = it->second.aborted;
+      rec.ok = !rec.aborted && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+               ReadKeyValues(staging + "/results.txt", rec.results);
+      if (rec.aborted) {
+        for (const auto& kv : it->second.progress) {
+          rec.results["progress." + kv.first] = kv.second;
+        }
+      }
+      if (rec.ok) {
+        m_cache.Commit(jobs[idx], staging, rec);
+      } else if (rec.aborted) {
+        std::error_code ec;
+        std::filesystem::remove_all(staging, ec);
+      }
+      if (m_onFinished) {
+        m_onFinished(jobs[idx], rec);
+      }
+      running.erase(it);
+    }
+
+    // Points that appeared twice in the same sweep were only run once
+    for (size_t idx : misses) {
+      if (!records[idx].ok && records[idx].results.empty()) {
+        RunRecord cached;
+        if (m_cache.Lookup(jobs[idx].key, cached)) {
+          records[idx] = cached;
+        }
+      }
+    }
+    return records;
+  }
+
+  /**
+   * Called after each simulator process exits.
+   */
+  void SetFinishedCallback(std::function<void(const SweepJob&, const RunRecord&)> cb) { m_onFinished = std::move(cb); }
+
+  /**
+   * Called for every "PROGRESS k=v ..." line printed by a running simulator
+   * (see --progressInterval). Returning false kills the run, which is then
+   * reported as aborted and not cached.
+   */
+  void SetProgressCallback(std::function<bool(const SweepJob&, const KeyValues&)> cb) { m_onProgress = std::move(cb); }
+
+private:
+  void PollProgress(pid_t pid, const SweepJob& job, const std::string& staging, std::streamoff& offset,
+                    bool& aborted, KeyValues& last) {
+    std::ifstream log(staging + "/stdout.log");
+    if (!log || aborted) {
+      return;
+    }
+    log.seekg(offset);
+    std::string line;
+    while (std::getline(log, line)) {
+      if (log.eof()) {
+        break; // partial line, read it again next time
+      }
+      offset = log.tellg();
+      if (line.rfind("PROGRESS ", 0) != 0) {
+        continue;
+      }
+      last.clear();
+      std::istringstream tokens(line.substr(9));
+      std::string token;
+      while (tokens >> token) {
+        size_t eq = token.find('=');
+        if (eq != std::string::npos) {
+          last[token.substr(0, eq)] = token.substr(eq + 1);
+        }
+      }
+      if (!m_onProgress(job, last)) {
+        kill(pid, SIGTERM);
+        aborted = true;
+        return;
+      }
+    }
+  }
+
+  std::string m_binary;
+  const ResultCache& m_cache;
+  uint32_t m_parallel;
+  std::function<void(const SweepJob&, const RunRecord&)> m_onFinished;
+  std::function<bool(const SweepJob&, const KeyValues&)> m_onProgress;
+};
+
+} // namespace sweep
+
+#endif /* WIFI_ZIGBEE_SWEEP_H */
@@ -0,0 +1,259 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/**
+ * Streaming reader of capture-derived traffic traces for the wifi-zigbee
+ * replay mode.
+ *
+ * Two formats are accepted, both ordered by time:
+ *
+ *  - CSV: one "time,src,dst,size" record per line (seconds, device ids,
+ *    bytes). A first line that does not start with a number is taken as a
+ *    header; lines starting with '#' are ignored.
+ *  - Binary: the 8 byte magic "WZTRACE1" followed by 20 byte little-endian
+ *    records: f64 time, u32 src, u32 dst, u32 size.
+ *
+ * The file is memory-mapped and parsed in place. Pages behind the read
+ * position are released every c_releaseBytes, so the resident size stays
+ * bounded for multi-gigabyte traces.
+ */
+
+#ifndef WIFI_ZIGBEE_TRACE_H
+#define WIFI_ZIGBEE_TRACE_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+namespace replay {
+
+struct TraceRecord {
+  double time = 0.0;
+  std::string src;
+  std::string dst;
+  uint32_t size = 0;
+};
+
+class TraceReader {
+public:
+  static constexpr char c_magic[9] = "WZTRACE1";
+  static constexpr size_t c_binaryRecord = 20;
+  static constexpr size_t c_releaseBytes = 64 << 20;
+
+  TraceReader() = default;
+  TraceReader(const TraceReader&) = delete;
+  TraceReader& operator=(const TraceReader&) = delete;
+
+  ~TraceReader() { Close(); }
+
+  /**
+   * \return false if the file cannot be opened or mapped
+   */
+  bool Open(const std::string& path) {
+    Close();
+    m_fd = open(path.c_str(), O_RDONLY);
+    if (m_fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) {
+      Close();
+      return false;
+    }
+    m_size = size_t(st.st_size);
+    if (m_size > 0) {
+      void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+      if (data == MAP_FAILED) {
+        Close();
+        return false;
+      }
+      m_data = static_cast<const char*>(data);
+      madvise(data, m_size, MADV_SEQUENTIAL);
+    }
+    m_binary = m_size >= 8 && std::memcmp(m_data, c_magic, 8) == 0;
+    m_pos = m_binary ? 8 : 0;
+    if (!m_binary) {
+      SkipHeader();
+    }
+    return true;
+  }
+
+  void Close() {
+    if (m_data) {
+      munmap(const_cast<char*>(m_data), m_size);
+      m_data = nullptr;
+    }
+    if (m_fd >= 0) {
+      close(m_fd);
+      m_fd = -1;
+    }
+    m_size = 0;
+    m_pos = 0;
+    m_released = 0;
+    m_records = 0;
+    m_malformed = 0;
+  }
+
+  /**
+   * Read the next record.
+   * \return false at the end of the trace
+   */
+  bool Next(TraceRecord& rec) {
+    bool ok = m_binary ? NextBinary(rec) : NextCsv(rec);
+    if (ok) {
+      m_records++;
+    }
+    Release();
+    return ok;
+  }
+
+  bool IsBinary() const { return m_binary; }
+
+  uint64_t GetRecords() const { return m_records; }
+
+  /** Lines (CSV) that could not be parsed and were skipped */
+  uint64_t GetMalformed() const { return m_malformed; }
+
+  size_t GetPosition() const { return m_pos; }
+
+  size_t GetSize() const { return m_size; }
+
+private:
+  bool NextBinary(TraceRecord& rec) {
+    if (m_pos + c_binaryRecord > m_size) {
+      return false;
+    }
+    const char* p = m_data + m_pos;
+    uint32_t src;
+    uint32_t dst;
+    std::memcpy(&rec.time, p, 8);
+    std::memcpy(&src, p + 8, 4);
+    std::memcpy(&dst, p + 12, 4);
+    std::memcpy(&rec.size, p + 16, 4);
+    rec.src = std::to_string(src);
+    rec.dst = std::to_string(dst);
+    m_pos += c_binaryRecord;
+    return true;
+  }
+
+  bool NextCsv(TraceRecord& rec) {
+    while (m_pos < m_size) {
+      const char* line = m_data + m_pos;
+      const char* end = static_cast<const char*>(std::memchr(line, '\n', m_size - m_pos));
+      if (!end) {
+        end = m_data + m_size;
+      }
+      m_pos = size_t(end - m_data) + (end < m_data + m_size ? 1 : 0);
+      if (end == line || *line == '#' || *line == '\r') {
+        continue;
+      }
+      if (ParseCsv(line, end, rec)) {
+        return true;
+      }
+      m_malformed++;
+    }
+    return false;
+  }
+
+  static bool ParseCsv(const char* p, const char* end, TraceRecord& rec) {
+    const char* fields[4];
+    size_t lengths[4];
+    for (int f = 0; f < 4; f++) {
+      const char* comma = static_cast<const char*>(std::memchr(p, ',', size_t(end - p)));
+      const char* stop = (f < 3 && comma) ? comma : end;
+      if (f < 3 && !comma) {
+        return false;
+      }
+      while (stop > p && (stop[-1] == '\r' || stop[-1] == ' ')) {
+        stop--;
+      }
+      while (p < stop && *p == ' ') {
+        p++;
+      }
+      fields[f] = p;
+      lengths[f] = size_t(stop - p);
+      p = comma ? comma + 1 : end;
+    }
+    std::string time(fields[0], lengths[0]);
+    std::string size(fields[3], lengths[3]);
+    char* stop = nullptr;
+    rec.time = std::strtod(time.c_str(), &stop);
+    if (stop == time.c_str()) {
+      return false;
+    }
+    rec.size = uint32_t(std::strtoul(size.c_str(), &stop, 10));
+    if (stop == size.c_str()) {
+      return false;
+    }
+    rec.src.assign(fields[1], lengths[1]);
+    rec.dst.assign(fields[2], lengths[2]);
+    return true;
+  }
+
+  void SkipHeader() {
+    if (m_pos < m_size && !(std::isdigit(static_cast<unsigned char>(m_data[m_pos])) || m_data[m_pos] == '.' ||
+                            m_data[m_pos] == '#' || m_data[m_pos] == '\n')) {
+      const char* end = static_cast<const char*>(std::memchr(m_data, '\n', m_size));
+      m_pos = end ? size_t(end - m_data) + 1 : m_size;
+    }
+  }
+
+  /** Drop the pages already consumed so that memory does not grow with the trace */
+  void Release() {
+    if (m_pos - m_released < c_releaseBytes) {
+      return;
+    }
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t upTo = (m_pos / page) * page;
+    if (upTo > m_released) {
+      madvise(const_cast<char*>(m_data) + m_released, upTo - m_released, MADV_DONTNEED);
+      m_released = upTo;
+    }
+  }
+
+  int m_fd = -1;
+  const char* m_data = nullptr;
+  size_t m_size = 0;
+  size_t m_pos = 0;
+  size_t m_released = 0;
+  bool m_binary = false;
+  uint64_t m_records = 0;
+  uint64_t m_malformed = 0;
+};
+
+/**
+ * FNV-1a hash of a file's contents, so that the sweep cache key changes when
+ * a trace or map is edited in place.
+ * \return "" if the path is empty or cannot be read
+ */
+inline std::string FileDigest(const std::string& path) {
+  int fd = path.empty() ? -1 : open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return "";
+  }
+  uint64_t h = 0xcbf29ce484222325ULL;
+  char buf[1 << 16];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      h = (h ^ static_cast<unsigned char>(buf[i])) * 0x100000001b3ULL;
+    }
+  }
+  close(fd);
+  char hex[17];
+  std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(h));
+  return hex;
+}
+
+} // namespace replay
+
+#endif /* WIFI_ZIGBEE_TRACE_H */
@@ -33,6 +33,10 @@
  *             |
  *             |
  *            ZR4
+ *
+ *  This is the built-in default scenario; other topologies, flows, fault
+ *  schedules and measurement windows are described in scenario files
+ *  (--scenario, see wifi-zigbee-scenario.h).
  */
 
 #include "ns3/constant-position-mobility-model.h"
@@ -55,7 +59,34 @@
 #include "ns3/wifi-module.h"
 #include "ns3/zigbee-module.h"
 
+#include "wifi-zigbee-perf.h"
+#include "wifi-zigbee-scenario.h"
+#include "wifi-zigbee-trace.h"
+
+#include <cxxabi.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <typeindex>
+#include <unordered_map>
+#include <unistd.h>
 
 using namespace ns3;
 using namespace ns3::lrwpan;
@@ -66,11 +97,17 @@ NS_LOG_COMPONENT_DEFINE("ZigbeeRouting");
 ZigbeeStackContainer zigbeeStacks;
 
 // Calculate QoS dla ZigBee
-static const uint32_t g_totalDevices = 5;
 static const uint16_t c_zigbeeBufferSize = 64;
 static uint32_t g_joinedCount = 0;
+static uint32_t g_expectedJoins = 0;
 static bool g_networkReady = false;
 
+// Scenario being simulated (--scenario) and the nodes a fault took down.
+// Zigbee packets only count towards the QoS results when they are sent
+// inside the scenario's measurement window.
+static scenario::Scenario g_scenario;
+static std::set<uint32_t> g_downNodes;
+
 struct QoSInfo {
   uint32_t sentPackets = 0;
   uint32_t recvPackets = 0;
@@ -81,6 +118,613 @@ static std::map<uint32_t, QoSInfo> qosMap;
 static std::map<uint32_t, std::map<uint32_t, std::set<uint32_t>>> receivedTracker;
 static uint32_t g_seqNo = 0;
 
+// Byte 16 of a Zigbee payload, after the 16 byte QoS header (if present)
+enum FrameKind : uint8_t { FRAME_DATA = 0, FRAME_POLL_REQUEST = 1, FRAME_POLL_RESPONSE = 2, FRAME_TSCH = 3 };
+
+/**
+ * Frame kind and sequence number of a scenario payload.
+ * \return false if the payload is too short to carry them
+ */
+static bool PayloadFrameInfo(const uint8_t* payload, uint32_t size, FrameKind& kind, uint32_t& seq) {
+  if (size < 17) {
+    return false;
+  }
+  memcpy(&seq, payload + 4, 4);
+  kind = FrameKind(payload[16]);
+  return true;
+}
+
+/**
+ * Frame kind and sequence number of the scenario payload of an NWK data
+ * frame, which starts with the MAC header if macFrame (MAC traces) or with
+ * the NWK header (MCPS indications).
+ * \return false for MAC and NWK commands and for payloads too short
+ */
+static bool PacketFrameInfo(Ptr<const Packet> p, bool macFrame, FrameKind& kind, uint32_t& seq) {
+  Ptr<Packet> copy = p->Copy();
+  if (macFrame) {
+    LrWpanMacHeader macHdr;
+    copy->RemoveHeader(macHdr);
+    if (!macHdr.IsData()) {
+      return false;
+    }
+  }
+  ZigbeeNwkHeader nwkHdr;
+  copy->RemoveHeader(nwkHdr);
+  if (nwkHdr.GetFrameType() != DATA || copy->GetSize() < 17) {
+    return false;
+  }
+  uint8_t header[17];
+  copy->CopyData(header, 17);
+  return PayloadFrameInfo(header, 17, kind, seq);
+}
+
+// Per packet delays (for percentiles) and packets still in flight (seq -> send time)
+static std::vector<double> g_delays;
+static std::map<uint32_t, double> g_outstanding;
+
+// False for nodes outside the partition simulated by this process (see PartitionState)
+static bool NodeActive(uint32_t nodeId);
+
+// Periodic progress lines ("PROGRESS t=... sent=... lost=... dropped=...
+// late=...") that let the optimizer abort runs that can no longer meet their
+// constraints: lost counts packets outstanding for longer than lossTimeout
+// (they may still arrive), dropped counts measured heartbeats a MAC gave up
+// on after its retries (final, the NWK layer does not retransmit), late
+// counts measured heartbeats received after delayBound (final as well) and
+// expected is an upper bound on the number of heartbeats the run will send.
+struct ProgressState {
+  double interval = 0.0;
+  double delayBound = 0.1;
+  double lossTimeout = 2.0;
+  uint64_t expected = 0;
+  uint64_t lateRecv = 0;
+  std::set<uint32_t> dropped; // sequence numbers
+};
+static ProgressState g_progress;
+
+// Load ramp (--loadRamp): the Wi-Fi offered load steps through a list of
+// rates within one run. Every phase first settles for rampSettle seconds and
+// then measures for rampWindow seconds. Zigbee packets count towards the
+// phase whose window contains their send time; Wi-Fi FlowMonitor counters
+// are differenced over the window.
+struct RampPhase {
+  std::string rate;
+  double start = 0.0; // measurement window
+  double stop = 0.0;
+  uint64_t zigbeeSent = 0;
+  uint64_t zigbeeRecv = 0;
+  std::vector<double> delays;
+  uint64_t wifiTx[2] = {0, 0}; // counters at window start and stop
+  uint64_t wifiRx[2] = {0, 0};
+  uint64_t wifiRxBytes[2] = {0, 0};
+};
+
+struct RampState {
+  std::string rates;
+  double settle = 2.0;
+  double window = 10.0;
+  std::vector<RampPhase> phases;
+};
+static RampState g_ramp;
+
+static RampPhase* RampPhaseAt(double t) {
+  for (auto& phase : g_ramp.phases) {
+    if (t >= phase.start && t < phase.stop) {
+      return &phase;
+    }
+  }
+  return nullptr;
+}
+
+// Random stream layout for common random numbers. Every random component
+// draws from a block of streams tied to its role and index, never to how many
+// other components exist, so two configurations that only differ in e.g. the
+// Wi-Fi load see the same NWK jitter, CSMA backoffs and fading draws.
+enum class StreamRole : int64_t {
+  ZIGBEE_NWK = 0,
+  LRWPAN = 1,
+  CHANNEL = 2,
+  WIFI_AP = 3,
+  WIFI_STA = 4,
+  WIFI_APP = 5,
+  INTERNET = 6,
+};
+static const int64_t c_streamsPerComponent = 1000;
+// 100000 components per role (10 million NWK stacks); all seven roles stay
+// below the offset of the splitting clones (c_cloneStreamOffset)
+static const int64_t c_streamsPerRole = 100000000;
+
+static int64_t StreamBase(StreamRole role, uint32_t index) {
+  // historical 0/10/20/... layout of the NWK streams
+  int64_t width = role == StreamRole::ZIGBEE_NWK ? 10 : c_streamsPerComponent;
+  NS_ABORT_MSG_IF((int64_t(index) + 1) * width > c_streamsPerRole,
+                  "Component " << index << " of stream role " << static_cast<int64_t>(role)
+                               << " does not fit in the role's stream block");
+  return static_cast<int64_t>(role) * c_streamsPerRole + int64_t(index) * width;
+}
+
+static void CheckStreams(int64_t used, StreamRole role, uint32_t index) {
+  NS_ABORT_MSG_IF(used > (role == StreamRole::ZIGBEE_NWK ? 10 : c_streamsPerComponent),
+                  "Component " << index << " of stream role " << static_cast<int64_t>(role) << " used " << used
+                               << " streams, more than its block");
+}
+
+// Components drawing random numbers, kept so that all streams are assigned in
+// one place (and can be re-assigned, e.g. by a splitting clone).
+struct StreamTargets {
+  ZigbeeStackContainer zigbeeStacks;
+  NetDeviceContainer lrwpanDevices;
+  NetDeviceContainer apDevices;
+  NetDeviceContainer staDevices;
+  NodeContainer apNodes;
+  NodeContainer staNodes;
+  ApplicationContainer wifiApps;
+  std::vector<Ptr<PropagationLossModel>> lossModels;
+};
+static StreamTargets g_streamTargets;
+
+static void AssignAllStreams(int64_t offset) {
+  const StreamTargets& t = g_streamTargets;
+  WifiHelper wifiHelper;
+  InternetStackHelper inet;
+  for (uint32_t i = 0; i < t.lossModels.size(); i++) {
+    int64_t used = t.lossModels[i]->AssignStreams(offset + StreamBase(StreamRole::CHANNEL, i));
+    CheckStreams(used, StreamRole::CHANNEL, i);
+  }
+  for (uint32_t i = 0; i < t.zigbeeStacks.GetN(); i++) {
+    int64_t used = t.zigbeeStacks.Get(i)->GetNwk()->AssignStreams(offset + StreamBase(StreamRole::ZIGBEE_NWK, i));
+    CheckStreams(used, StreamRole::ZIGBEE_NWK, i);
+  }
+  for (uint32_t i = 0; i < t.lrwpanDevices.GetN(); i++) {
+    Ptr<LrWpanNetDevice> dev = DynamicCast<LrWpanNetDevice>(t.lrwpanDevices.Get(i));
+    CheckStreams(dev->AssignStreams(offset + StreamBase(StreamRole::LRWPAN, i)), StreamRole::LRWPAN, i);
+  }
+  for (uint32_t i = 0; i < t.apDevices.GetN(); i++) {
+    int64_t used =
+        wifiHelper.AssignStreams(NetDeviceContainer(t.apDevices.Get(i)), offset + StreamBase(StreamRole::WIFI_AP, i));
+    CheckStreams(used, StreamRole::WIFI_AP, i);
+  }
+  for (uint32_t i = 0; i < t.staDevices.GetN(); i++) {
+    int64_t used = wifiHelper.AssignStreams(NetDeviceContainer(t.staDevices.Get(i)),
+                                            offset + StreamBase(StreamRole::WIFI_STA, i));
+    CheckStreams(used, StreamRole::WIFI_STA, i);
+  }
+  // Internet stack streams: AP nodes first, then the STAs
+  NodeContainer ipNodes(t.apNodes, t.staNodes);
+  for (uint32_t i = 0; i < ipNodes.GetN(); i++) {
+    int64_t used = inet.AssignStreams(NodeContainer(ipNodes.Get(i)), offset + StreamBase(StreamRole::INTERNET, i));
+    CheckStreams(used, StreamRole::INTERNET, i);
+  }
+  for (uint32_t i = 0; i < t.wifiApps.GetN(); i++) {
+    Ptr<OnOffApplication> app = DynamicCast<OnOffApplication>(t.wifiApps.Get(i));
+    if (app) {
+      CheckStreams(app->AssignStreams(offset + StreamBase(StreamRole::WIFI_APP, i)), StreamRole::WIFI_APP, i);
+    }
+  }
+}
+
+// Every CommandLine value is registered here so that the fully resolved
+// configuration can be printed, dumped for the sweep cache key, and kept in
+// one place as new options are added.
+struct ParamEntry {
+  std::string name;
+  bool keyed; // false for options that only affect output, not results
+  std::function<std::string()> value;
+};
+static std::vector<ParamEntry> g_params;
+
+template <typename T>
+static void AddParam(CommandLine& cmd, const std::string& name, const std::string& help, T& value,
+                     bool keyed = true) {
+  cmd.AddValue(name, help, value);
+  g_params.push_back({name, keyed, [&value]() {
+                        std::ostringstream oss;
+                        oss << std::setprecision(12) << value;
+                        return oss.str();
+                      }});
+}
+
+static void DumpConfig(std::ostream& os) {
+  std::vector<const ParamEntry*> keyed;
+  for (const auto& p : g_params) {
+    if (p.keyed) {
+      keyed.push_back(&p);
+    }
+  }
+  std::sort(keyed.begin(), keyed.end(), [](const ParamEntry* a, const ParamEntry* b) { return a->name < b->name; });
+  for (const auto* p : keyed) {
+    os << p->name << "=" << p->value() << "\n";
+  }
+}
+
+// Machine readable results, written as key=value lines to --resultsFile
+static std::vector<std::pair<std::string, std::string>> g_results;
+
+template <typename T>
+static void AddResult(const std::string& key, T value) {
+  std::ostringstream oss;
+  oss << std::setprecision(12) << value;
+  g_results.emplace_back(key, oss.str());
+}
+
+static void WriteResults(const std::string& path) {
+  // Write to a temporary file first so that a reader never sees a partial file
+  std::string tmpPath = path + ".tmp";
+  std::ofstream out(tmpPath);
+  if (!out) {
+    NS_LOG_ERROR("Unable to open results file " << tmpPath);
+    return;
+  }
+  for (const auto& kv : g_results) {
+    out << kv.first << "=" << kv.second << "\n";
+  }
+  out.close();
+  std::filesystem::rename(tmpPath, path);
+}
+
+// Wall time of the setup phases before Simulator::Run(), so that the startup
+// cost stays visible (and roughly linear in the node count) as scenarios grow.
+// Every Mark() closes the phase that started at the previous one.
+struct SetupTimer {
+  std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+  std::vector<std::pair<std::string, double>> phases;
+
+  void Mark(const std::string& phase) {
+    auto now = std::chrono::steady_clock::now();
+    phases.emplace_back(phase, std::chrono::duration<double>(now - last).count());
+    last = now;
+  }
+};
+static SetupTimer g_setup;
+
+static void PrintSetupTimes(uint32_t nodes) {
+  double total = 0.0;
+  for (const auto& phase : g_setup.phases) {
+    total += phase.second;
+  }
+  NS_LOG_UNCOND("=== Setup time (" << nodes << " nodes) ===");
+  NS_LOG_UNCOND("Phase        | Seconds  | Share  | us/node");
+  for (const auto& phase : g_setup.phases) {
+    NS_LOG_UNCOND(std::left << std::setw(12) << phase.first << std::right << " | " << std::fixed
+                            << std::setprecision(4) << std::setw(8) << phase.second << " | " << std::setprecision(1)
+                            << std::setw(5) << (total > 0.0 ? 100.0 * phase.second / total : 0.0) << "% | "
+                            << std::setw(7) << (nodes > 0 ? 1e6 * phase.second / nodes : 0.0) << std::defaultfloat);
+    AddResult("setup." + phase.first + "Seconds", phase.second);
+  }
+  NS_LOG_UNCOND("  total " << std::fixed << std::setprecision(4) << total << " s" << std::defaultfloat);
+  AddResult("setup.totalSeconds", total);
+}
+
+// Hardware counters (--perfCounters, see wifi-zigbee-perf.h) per phase: setup
+// (before Simulator::Run()), join (until every router joined) and measurement
+// (the rest of the run). PerfMark() closes the current phase and starts the
+// next one.
+struct PerfPhase {
+  std::string name;
+  std::vector<double> counts;
+  double wallSeconds = 0.0;
+};
+
+struct PerfState {
+  bool enabled = false;
+  perf::CounterSet counters;
+  std::vector<double> last;
+  std::chrono::steady_clock::time_point lastWall;
+  std::string current;
+  std::vector<PerfPhase> phases;
+};
+static PerfState g_perf;
+
+static void PerfMark(const std::string& next) {
+  if (!g_perf.enabled) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (!g_perf.counters.IsOwned()) {
+    // Forked partition or trajectory: count this process from here on
+    std::string error;
+    g_perf.counters.Open(error);
+    g_perf.last.assign(g_perf.counters.Names().size(), 0.0);
+  }
+  std::vector<double> values = g_perf.counters.Read();
+  if (!g_perf.current.empty()) {
+    PerfPhase phase;
+    phase.name = g_perf.current;
+    for (size_t i = 0; i < values.size(); i++) {
+      phase.counts.push_back(values[i] - (i < g_perf.last.size() ? g_perf.last[i] : 0.0));
+    }
+    phase.wallSeconds = std::chrono::duration<double>(now - g_perf.lastWall).count();
+    g_perf.phases.push_back(phase);
+  }
+  g_perf.last = values;
+  g_perf.lastWall = now;
+  g_perf.current = next;
+}
+
+static void PrintPerfCounters() {
+  const std::vector<std::string>& names = g_perf.counters.Names();
+  std::ostringstream header;
+  for (const auto& name : names) {
+    header << " | " << std::setw(14) << name;
+  }
+  NS_LOG_UNCOND("=== Hardware counters (user space) ===");
+  NS_LOG_UNCOND("Phase        | Wall(s) " << header.str() << " |  IPC  | MPKI   | BrMPKI");
+  for (const auto& phase : g_perf.phases) {
+    std::ostringstream line;
+    double cycles = 0.0;
+    double instructions = 0.0;
+    double cacheMisses = 0.0;
+    double branchMisses = 0.0;
+    std::string prefix = "perf." + phase.name + ".";
+    for (size_t i = 0; i < names.size() && i < phase.counts.size(); i++) {
+      line << " | " << std::setw(14) << std::fixed << std::setprecision(0) << phase.counts[i];
+      AddResult(prefix + names[i], phase.counts[i]);
+      cycles = names[i] == "cycles" ? phase.counts[i] : cycles;
+      instructions = names[i] == "instructions" ? phase.counts[i] : instructions;
+      cacheMisses = names[i] == "cacheMisses" ? phase.counts[i] : cacheMisses;
+      branchMisses = names[i] == "branchMisses" ? phase.counts[i] : branchMisses;
+    }
+    double ipc = cycles > 0.0 ? instructions / cycles : 0.0;
+    double mpki = instructions > 0.0 ? 1000.0 * cacheMisses / instructions : 0.0;
+    double brMpki = instructions > 0.0 ? 1000.0 * branchMisses / instructions : 0.0;
+    NS_LOG_UNCOND(std::left << std::setw(12) << phase.name << std::right << " | " << std::fixed
+                            << std::setprecision(3) << std::setw(7) << phase.wallSeconds << line.str() << " | "
+                            << std::setprecision(2) << std::setw(5) << ipc << " | " << std::setw(6) << mpki << " | "
+                            << std::setw(6) << brMpki << std::defaultfloat);
+    AddResult(prefix + "wallSeconds", phase.wallSeconds);
+    AddResult(prefix + "ipc", ipc);
+    AddResult(prefix + "cacheMpki", mpki);
+    AddResult(prefix + "branchMpki", brMpki);
+  }
+}
+
+// Rare-event splitting (--splitFactor > 1). During the measurement phase the
+// trajectory is checked every splitInterval; when the number of LR-WPAN MAC
+// retransmissions and drops in the last interval reaches splitThreshold it is
+// cloned with fork() into splitFactor copies. Each copy carries an equal
+// share of the parent's weight and the clones continue on fresh random
+// streams, so weighted sums over all leaf trajectories remain unbiased
+// estimators of the plain Monte Carlo expectations. --splitRoots runs
+// independent root trajectories to obtain a confidence interval.
+//
+// Trajectories are numbered like the nodes of a splitFactor-ary heap per
+// root, which makes their streams (and therefore the results) independent of
+// the order in which the OS schedules the clones.
+static const int64_t c_cloneStreamOffset = 1000000000;
+
+struct SplitShared {
+  std::atomic<uint32_t> trajectories;
+};
+
+struct SplitRecord {
+  uint32_t root;
+  uint32_t heapIndex;
+  uint32_t depth;
+  double weight;
+  uint64_t sent;
+  uint64_t recv;
+  double cpuSeconds;
+};
+
+struct SplitState {
+  uint32_t factor = 0;
+  uint32_t roots = 1;
+  uint32_t threshold = 5;
+  double interval = 1.0;
+  uint32_t maxDepth = 3;
+  uint32_t maxClones = 256; // safety cap on the total number of trajectories
+  bool isTop = true;
+  uint32_t root = 0;
+  uint32_t heapIndex = 0;
+  uint32_t depth = 0;
+  double weight = 1.0;
+  uint64_t lastScore = 0;
+  int pipeFd[2] = {-1, -1};
+  std::vector<pid_t> children;
+  SplitShared* shared = nullptr;
+};
+static SplitState g_split;
+static uint64_t g_macRetries = 0;
+static uint64_t g_macDrops = 0;
+static uint64_t g_macSent = 0;
+static uint64_t g_macBackoffs = 0;
+
+static void LrWpanMacSentPkt(Ptr<const Packet> p, uint8_t retries, uint8_t csmaBackoffs) {
+  g_macRetries += retries;
+  g_macSent++;
+  g_macBackoffs += csmaBackoffs;
+}
+
+static void LrWpanMacTxDrop(Ptr<const Packet> p) {
+  g_macDrops++;
+  FrameKind kind;
+  uint32_t seq;
+  if (g_progress.interval <= 0.0 || !PacketFrameInfo(p, true, kind, seq) || kind != FRAME_DATA) {
+    return;
+  }
+  auto it = g_outstanding.find(seq);
+  if (it != g_outstanding.end() && g_scenario.InWindow(it->second)) {
+    g_progress.dropped.insert(seq);
+  }
+}
+
+static double ProcessCpuSeconds() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return double(ru.ru_utime.tv_sec) + double(ru.ru_utime.tv_usec) * 1e-6 + double(ru.ru_stime.tv_sec) +
+         double(ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static void SplitReseed() {
+  uint64_t heapSize = 1;
+  uint64_t level = 1;
+  for (uint32_t d = 0; d < g_split.maxDepth; d++) {
+    level *= std::max(g_split.factor, 1u);
+    heapSize += level;
+  }
+  AssignAllStreams(c_cloneStreamOffset * int64_t(g_split.root * heapSize + g_split.heapIndex));
+}
+
+/**
+ * Fork a child process continuing the current trajectory.
+ * \return true in the child
+ */
+static bool SplitForkChild() {
+  std::cout.flush();
+  std::clog.flush();
+  g_split.shared->trajectories.fetch_add(1);
+  pid_t pid = fork();
+  NS_ABORT_MSG_IF(pid < 0, "fork() failed while splitting");
+  if (pid == 0) {
+    close(g_split.pipeFd[0]);
+    g_split.isTop = false;
+    g_split.children.clear();
+    return true;
+  }
+  g_split.children.push_back(pid);
+  return false;
+}
+
+static void SplitStartRoots() {
+  for (uint32_t r = 1; r < g_split.roots; r++) {
+    if (SplitForkChild()) {
+      g_split.root = r;
+      SplitReseed();
+      return;
+    }
+  }
+}
+
+static void SplitCheck() {
+  uint64_t score = g_macRetries + g_macDrops;
+  uint64_t window = score - g_split.lastScore;
+  g_split.lastScore = score;
+  if (window >= g_split.threshold && g_split.depth < g_split.maxDepth &&
+      g_split.shared->trajectories.load() + g_split.factor - 1 <= g_split.maxClones) {
+    NS_LOG_INFO(Simulator::Now().As(Time::S) << " splitting trajectory " << g_split.root << "/" << g_split.heapIndex
+                                             << " (score " << window << ", depth " << g_split.depth << ")");
+    uint32_t parent = g_split.heapIndex;
+    g_split.weight /= g_split.factor;
+    g_split.depth++;
+    // The parent continues as the first child on its current streams
+    g_split.heapIndex = parent * g_split.factor + 1;
+    for (uint32_t k = 2; k <= g_split.factor; k++) {
+      if (SplitForkChild()) {
+        g_split.heapIndex = parent * g_split.factor + k;
+        SplitReseed();
+        break;
+      }
+    }
+  }
+  Simulator::Schedule(Seconds(g_split.interval), &SplitCheck);
+}
+
+static void SplitCollect() {
+  uint64_t sent = 0;
+  uint64_t recv = 0;
+  for (const auto& kv : qosMap) {
+    sent += kv.second.sentPackets;
+    recv += kv.second.recvPackets;
+  }
+  SplitRecord own{g_split.root, g_split.heapIndex, g_split.depth, g_split.weight, sent, recv, ProcessCpuSeconds()};
+  NS_ABORT_MSG_IF(write(g_split.pipeFd[1], &own, sizeof(own)) != sizeof(own), "Unable to report split trajectory");
+  close(g_split.pipeFd[1]);
+
+  if (!g_split.isTop) {
+    for (pid_t pid : g_split.children) {
+      waitpid(pid, nullptr, 0);
+    }
+    _exit(0);
+  }
+
+  std::vector<SplitRecord> records;
+  SplitRecord rec;
+  while (read(g_split.pipeFd[0], &rec, sizeof(rec)) == sizeof(rec)) {
+    records.push_back(rec);
+  }
+  close(g_split.pipeFd[0]);
+  for (pid_t pid : g_split.children) {
+    waitpid(pid, nullptr, 0);
+  }
+
+  // Weighted loss estimate per independent root, then across roots
+  std::map<uint32_t, std::pair<double, double>> perRoot; // weighted lost, weighted sent
+  double cpuTotal = 0.0;
+  uint32_t maxDepth = 0;
+  for (const auto& r : records) {
+    perRoot[r.root].first += r.weight * double(r.sent - std::min(r.recv, r.sent));
+    perRoot[r.root].second += r.weight * double(r.sent);
+    cpuTotal += r.cpuSeconds;
+    maxDepth = std::max(maxDepth, r.depth);
+  }
+  double lost = 0.0;
+  double sentW = 0.0;
+  for (const auto& kv : perRoot) {
+    lost += kv.second.first;
+    sentW += kv.second.second;
+  }
+  double p = sentW > 0.0 ? lost / sentW : 0.0;
+
+  NS_LOG_UNCOND("=== Rare-event splitting estimate ===");
+  NS_LOG_UNCOND("  trajectories  = " << records.size() << " (" << perRoot.size() << " roots, max depth " << maxDepth
+                                     << ")");
+  NS_LOG_UNCOND("  loss rate     = " << std::scientific << std::setprecision(3) << p << std::defaultfloat);
+  NS_LOG_UNCOND("  cpu (all)     = " << std::fixed << std::setprecision(2) << cpuTotal << " s");
+  AddResult("split.trajectories", records.size());
+  AddResult("split.lossRate", p);
+  AddResult("split.cpuSeconds", cpuTotal);
+
+  if (perRoot.size() >= 2) {
+    // Standard error of the pooled ratio p = sum(lost) / sum(sent) over the
+    // roots (ratio estimator), so that the interval belongs to p itself
+    double n = double(perRoot.size());
+    double meanSent = sentW / n;
+    double ss = 0.0;
+    for (const auto& kv : perRoot) {
+      double residual = kv.second.first - p * kv.second.second;
+      ss += residual * residual;
+    }
+    double halfWidth = meanSent > 0.0 ? 1.96 * std::sqrt(ss / (n * (n - 1.0))) / meanSent : 0.0;
+    // Plain Monte Carlo needs z^2 p (1 - p) / hw^2 packets for the same half width;
+    // one unsplit trajectory costs about as much CPU as the top process did.
+    double perTrajectorySent = double(own.sent);
+    double cpuPerTrajectory = own.cpuSeconds;
+    double naiveRuns = (halfWidth > 0.0 && perTrajectorySent > 0.0)
+                           ? 1.96 * 1.96 * p * (1.0 - p) / (halfWidth * halfWidth) / perTrajectorySent
+                           : 0.0;
+    NS_LOG_UNCOND("  95% CI        = +/- " << std::scientific << std::setprecision(3) << halfWidth
+                                           << std::defaultfloat);
+    NS_LOG_UNCOND("  naive runs    = " << std::fixed << std::setprecision(1) << naiveRuns << " for the same CI ("
+                                       << naiveRuns * cpuPerTrajectory << " s cpu vs " << cpuTotal << " s)");
+    AddResult("split.ciHalfWidth", halfWidth);
+    AddResult("split.naiveCpuSeconds", naiveRuns * cpuPerTrajectory);
+  }
+}
+
+/**
+ * The top process's own results describe one unweighted trajectory, not the
+ * run: keep them under split.top so that no consumer of the results file
+ * takes e.g. zigbee.pdr for the estimate.
+ */
+static void SplitRenameTopResults() {
+  for (auto& kv : g_results) {
+    if (kv.first.rfind("split.", 0) != 0 && kv.first.rfind("sim.", 0) != 0) {
+      kv.first = "split.top." + kv.first;
+    }
+  }
+}
+
+// Association warm-up of the Wi-Fi STAs (not traced with --wifiStaticAssoc,
+// where every device is associated from time zero)
+static uint32_t g_staAssociations = 0;
+static double g_lastAssocTime = 0.0;
+
+static void StaAssociated(Mac48Address bssid) {
+  g_staAssociations++;
+  g_lastAssocTime = Simulator::Now().GetSeconds();
+}
+
 static void NwkNetworkFormationConfirm(Ptr<ZigbeeStack> stack, NlmeNetworkFormationConfirmParams params) {
   NS_LOG_INFO("NlmeNetworkFormationConfirmStatus = " << params.m_status << "\n");
 }
@@ -129,8 +773,9 @@ static void NwkJoinConfirm(Ptr<ZigbeeStack> stack, NlmeJoinConfirmParams params)
 
     // Iterate joined devices
     ++g_joinedCount;
-    if (g_joinedCount == (g_totalDevices - 1)) {
+    if (g_joinedCount == g_expectedJoins) {
       g_networkReady = true;
+      PerfMark("measurement");
       NS_LOG_INFO(Simulator::Now().As(Time::S) << " | All Zigbee nodes joined the network" << std::endl);
     }
 
@@ -147,88 +792,2759 @@ static void NwkRouteDiscoveryConfirm(Ptr<ZigbeeStack> stack, NlmeRouteDiscoveryC
   NS_LOG_INFO("NlmeRouteDiscoveryConfirmStatus = " << params.m_status << "\n");
 }
 
-static void SendDataPeriod(Ptr<ZigbeeStack> stackSrc, Ptr<ZigbeeStack> stackDst, double interval) {
-  if (!g_networkReady) {
-    return;
-  }
+/**
+ * Hand a raw NWK data frame to the NWK layer now.
+ */
+static void NwkDataRequest(Ptr<ZigbeeStack> stackSrc, Mac16Address dst, const std::vector<uint8_t>& buf) {
+  Ptr<Packet> p = Create<Packet>(buf.data(), buf.size());
+  NldeDataRequestParams dataReqParams;
+  dataReqParams.m_dstAddrMode = UCST_BCST;
+  dataReqParams.m_dstAddr = dst;
+  dataReqParams.m_nsduHandle = 1;
+  dataReqParams.m_nsduLength = p->GetSize();
+  dataReqParams.m_discoverRoute = ENABLE_ROUTE_DISCOVERY;
+  Simulator::ScheduleNow(&ZigbeeNwk::NldeDataRequest, stackSrc->GetNwk(), dataReqParams, p);
+}
 
-  if (c_zigbeeBufferSize < 16) {
-    NS_ABORT_MSG("c_zigbeeBufferSize must be >= 16");
-  }
+// Node processing delay (--procDelay). Every Zigbee device has one CPU, a
+// FIFO single server that handles each frame before it goes on: frames the
+// scenario sends wait procTxUs before the NLDE-DATA.request, frames received
+// wait between the MAC and the NWK layer for procDataUs (NWK data for this
+// device or a broadcast), procRelayUs (NWK data to forward) or procCommandUs
+// (NWK commands). The MAC still acknowledges at once, as its hardware would.
+// With --procSecurity the frames are secured with NWK-level AES-CCM*
+// (security level 5, MIC-32): the sender encrypts, relays decrypt and
+// re-encrypt with their own frame counter, the destination decrypts, each at
+// procAesBlockUs per AES-128 block of CBC-MAC and CTR. The scenario's frames
+// also carry the auxiliary header and MIC on the air; they are appended to
+// the payload, which leaves less room for it (frames longer than the PHY
+// allows are dropped by the MAC). Frames the stack makes itself (route
+// requests and replies) get the processing time but not the extra bytes.
+// The processing time a heartbeat collects along its path (queueing and
+// service) is compared with its end-to-end delay.
+static const uint32_t c_nwkAuxHeader = 14; // security control, frame counter, source address, key sequence
+static const uint32_t c_nwkMic = 4;        // MIC-32
 
-  uint32_t srcNodeId = stackSrc->GetNode()->GetId();
-  uint32_t destNodeId = stackDst->GetNode()->GetId();
+struct ProcNode {
+  double busyUntil = 0.0;
+  double busy = 0.0;
+  double wait = 0.0;
+  uint64_t frames = 0;
+};
 
-  uint8_t buf[c_zigbeeBufferSize];
-  double nowSeconds = Simulator::Now().GetSeconds();
-  memcpy(buf + 0, &srcNodeId, 4);
-  memcpy(buf + 4, &g_seqNo, 4);
-  memcpy(buf + 8, &nowSeconds, 8);
+struct ProcState {
+  bool enabled = false;
+  double txUs = 500.0;
+  double dataUs = 1000.0;
+  double relayUs = 800.0;
+  double commandUs = 1500.0;
+  bool security = false;
+  double aesBlockUs = 30.0;
+  std::map<uint32_t, ProcNode> nodes;
+  std::map<uint32_t, double> pathDelay; // heartbeat seq -> processing time so far
+  std::array<uint64_t, 4> kinds{0, 0, 0, 0}; // tx, data, relay, command frames
+  double procSum = 0.0;  // over delivered heartbeats in the window
+  double delaySum = 0.0;
+  uint64_t delivered = 0;
+};
+static ProcState g_proc;
 
-  g_seqNo++;
+static uint32_t ProcSecurityBytes() {
+  return g_proc.enabled && g_proc.security ? c_nwkAuxHeader + c_nwkMic : 0;
+}
 
-  qosMap[destNodeId].sentPackets += 1;
+/**
+ * AES-CCM* time of one frame: CBC-MAC over B0, the length-prefixed
+ * authenticated header and the payload, CTR over A0 (the MIC) and the payload.
+ */
+static double ProcCcmUs(uint32_t authBytes, uint32_t payloadBytes) {
+  if (!g_proc.security) {
+    return 0.0;
+  }
+  uint32_t payloadBlocks = (payloadBytes + 15) / 16;
+  return g_proc.aesBlockUs * (1 + (2 + authBytes + 15) / 16 + payloadBlocks + 1 + payloadBlocks);
+}
 
-  Ptr<Packet> p = Create<Packet>(buf, c_zigbeeBufferSize);
-  NldeDataRequestParams dataReqParams;
-  dataReqParams.m_dstAddrMode = UCST_BCST;
-  dataReqParams.m_dstAddr = stackDst->GetNwk()->GetNetworkAddress();
-  dataReqParams.m_nsduHandle = 1;
-  dataReqParams.m_nsduLength = p->GetSize();
-  dataReqParams.m_discoverRoute = ENABLE_ROUTE_DISCOVERY;
+/**
+ * Queue a job of serviceUs on the node's CPU.
+ * \return the time from now until it is done
+ */
+static double ProcServe(uint32_t node, double serviceUs) {
+  ProcNode& cpu = g_proc.nodes[node];
+  double now = Simulator::Now().GetSeconds();
+  double start = std::max(now, cpu.busyUntil);
+  double service = serviceUs * 1e-6;
+  cpu.busyUntil = start + service;
+  cpu.busy += service;
+  cpu.wait += start - now;
+  cpu.frames++;
+  return cpu.busyUntil - now;
+}
 
-  Simulator::ScheduleNow(&ZigbeeNwk::NldeDataRequest, stackSrc->GetNwk(), dataReqParams, p);
+static void ProcAddPath(FrameKind kind, uint32_t seq, double seconds) {
+  // Poll frames number their own sequence from zero, only heartbeats count
+  if (kind == FRAME_DATA && g_outstanding.count(seq)) {
+    g_proc.pathDelay[seq] += seconds;
+  }
+}
 
-  NS_LOG_DEBUG(Simulator::Now().GetSeconds()
-               << "s Node" << srcNodeId << " sent packet seq=" << (g_seqNo - 1) << " size=" << p->GetSize() << " bytes"
-               << " to " << dataReqParams.m_dstAddr << " totalSent =" << qosMap[srcNodeId].sentPackets);
+static void ProcTransmit(Ptr<ZigbeeStack> stackSrc, Mac16Address dst, std::vector<uint8_t> buf) {
+  uint32_t node = stackSrc->GetNode()->GetId();
+  double seconds = ProcServe(node, g_proc.txUs + ProcCcmUs(8 + c_nwkAuxHeader, buf.size()));
+  buf.resize(buf.size() + ProcSecurityBytes(), 0);
+  g_proc.kinds[0]++;
+  FrameKind kind;
+  uint32_t seq;
+  if (PayloadFrameInfo(buf.data(), buf.size(), kind, seq)) {
+    ProcAddPath(kind, seq, seconds);
+  }
+  Simulator::Schedule(Seconds(seconds), &NwkDataRequest, stackSrc, dst, buf);
+}
 
-  // Every interval
-  Simulator::Schedule(Seconds(interval), &SendDataPeriod, stackSrc, stackDst, interval);
+/**
+ * A frame the MAC of node received: delivered to the NWK layer once the
+ * node's CPU has processed it.
+ */
+static void ProcReceive(uint32_t node, Ptr<ZigbeeNwk> nwk, McpsDataIndicationParams params, Ptr<Packet> msdu) {
+  Ptr<Packet> copy = msdu->Copy();
+  ZigbeeNwkHeader nwkHdr;
+  copy->RemoveHeader(nwkHdr);
+  uint32_t authBytes = nwkHdr.GetSerializedSize() + c_nwkAuxHeader;
+  uint32_t payloadBytes = copy->GetSize();
+  // Data frames of the scenario carry the auxiliary header and MIC at the end
+  uint32_t trailer = nwkHdr.GetFrameType() == DATA ? std::min(payloadBytes, ProcSecurityBytes()) : 0;
+  uint32_t plainBytes = payloadBytes - trailer;
+  double serviceUs = ProcCcmUs(authBytes, plainBytes);
+  if (nwkHdr.GetFrameType() != DATA) {
+    serviceUs += g_proc.commandUs;
+    g_proc.kinds[3]++;
+  } else if (nwkHdr.GetDstAddr() == nwk->GetNetworkAddress() || !(nwkHdr.GetDstAddr() < Mac16Address("ff:fb"))) {
+    // For this device, or one of the broadcast addresses 0xfffb-0xffff
+    serviceUs += g_proc.dataUs;
+    g_proc.kinds[1]++;
+  } else {
+    serviceUs += g_proc.relayUs + ProcCcmUs(authBytes, plainBytes);
+    g_proc.kinds[2]++;
+  }
+  double seconds = ProcServe(node, serviceUs);
+  FrameKind kind;
+  uint32_t seq;
+  if (PacketFrameInfo(msdu, false, kind, seq)) {
+    ProcAddPath(kind, seq, seconds);
+  }
+  Simulator::Schedule(Seconds(seconds), &ZigbeeNwk::McpsDataIndication, nwk, params, msdu);
 }
 
-static void NwkDataIndication(Ptr<ZigbeeStack> stack, NldeDataIndicationParams params, Ptr<Packet> p) {
-  if (p->GetSize() < 16) {
-    NS_LOG_WARN("NwkDataIndication: packet too small (" << p->GetSize() << " bytes)");
+/**
+ * A heartbeat reached its destination after delay seconds.
+ */
+static void ProcDelivered(uint32_t seq, double delay, bool inWindow) {
+  auto it = g_proc.pathDelay.find(seq);
+  if (it == g_proc.pathDelay.end()) {
     return;
   }
+  if (inWindow) {
+    g_proc.procSum += it->second;
+    g_proc.delaySum += delay;
+    g_proc.delivered++;
+  }
+  g_proc.pathDelay.erase(it);
+}
 
-  uint8_t header[16];
-  p->CopyData(header, 16);
-
-  uint32_t srcNodeId;
-  uint32_t seqNo;
-  double sendTime;
-  memcpy(&srcNodeId, header + 0, 4);
-  memcpy(&seqNo, header + 4, 4);
-  memcpy(&sendTime, header + 8, 8);
+static void PrintProcessing(uint32_t coordinatorNode) {
+  double elapsed = Simulator::Now().GetSeconds();
+  std::vector<std::pair<double, uint32_t>> byUtil;
+  double utilSum = 0.0;
+  for (const auto& kv : g_proc.nodes) {
+    double util = elapsed > 0.0 ? kv.second.busy / elapsed : 0.0;
+    byUtil.emplace_back(util, kv.first);
+    utilSum += util;
+  }
+  std::sort(byUtil.rbegin(), byUtil.rend());
+  NS_LOG_UNCOND("=== Node processing (" << (g_proc.security ? "AES-CCM* secured" : "unsecured") << ") ===");
+  NS_LOG_UNCOND("Node | Frames  | Utilization | Mean wait(ms) | Mean service(ms)");
+  for (size_t i = 0; i < byUtil.size() && i < 10; i++) {
+    const ProcNode& cpu = g_proc.nodes[byUtil[i].second];
+    NS_LOG_UNCOND(std::setw(4) << byUtil[i].second << " | " << std::setw(7) << cpu.frames << " | " << std::fixed
+                               << std::setprecision(2) << std::setw(10) << 100.0 * byUtil[i].first << "% | "
+                               << std::setprecision(3) << std::setw(13) << 1e3 * cpu.wait / double(cpu.frames)
+                               << " | " << std::setw(16) << 1e3 * cpu.busy / double(cpu.frames)
+                               << std::defaultfloat);
+  }
+  if (byUtil.size() > 10) {
+    NS_LOG_UNCOND("  (" << byUtil.size() - 10 << " less busy nodes not shown)");
+  }
+  double share = g_proc.delaySum > 0.0 ? g_proc.procSum / g_proc.delaySum : 0.0;
+  double coordinatorUtil = elapsed > 0.0 && g_proc.nodes.count(coordinatorNode)
+                               ? g_proc.nodes[coordinatorNode].busy / elapsed
+                               : 0.0;
+  NS_LOG_UNCOND("  frames: tx=" << g_proc.kinds[0] << " data=" << g_proc.kinds[1] << " relay=" << g_proc.kinds[2]
+                                << " command=" << g_proc.kinds[3] << ", coordinator utilization = " << std::fixed
+                                << std::setprecision(2) << 100.0 * coordinatorUtil
+                                << "%, processing share of the heartbeat delay = " << 100.0 * share << "%"
+                                << std::defaultfloat);
+  AddResult("proc.coordinatorUtil", coordinatorUtil);
+  AddResult("proc.maxUtil", byUtil.empty() ? 0.0 : byUtil[0].first);
+  AddResult("proc.maxUtilNode", byUtil.empty() ? 0 : byUtil[0].second);
+  AddResult("proc.meanUtil", byUtil.empty() ? 0.0 : utilSum / double(byUtil.size()));
+  AddResult("proc.delayShare", share);
+  AddResult("proc.meanProcMs", g_proc.delivered > 0 ? 1e3 * g_proc.procSum / double(g_proc.delivered) : 0.0);
+  AddResult("proc.relayFrames", g_proc.kinds[2]);
+  AddResult("proc.securityBytes", ProcSecurityBytes());
+}
 
-  uint32_t destNodeId = stack->GetNode()->GetId();
+static bool NwkTablesAdmit(Ptr<ZigbeeStack> stack, Mac16Address dst, const std::vector<uint8_t>& buf);
 
-  // Duplicate check
-  auto& srcMap = receivedTracker[destNodeId];
-  auto& seqSet = srcMap[srcNodeId];
-  if (seqSet.count(seqNo) > 0) {
-    NS_LOG_WARN("Duplicate packet at Node" << destNodeId << " from Node" << srcNodeId << " [seq=" << seqNo
-                                           << "] ignored");
+/**
+ * Send a raw NWK data frame; buf already carries the header.
+ */
+static void NwkSendFrame(Ptr<ZigbeeStack> stackSrc, Mac16Address dst, const std::vector<uint8_t>& buf) {
+  if (!NwkTablesAdmit(stackSrc, dst, buf)) {
     return;
   }
-  seqSet.insert(seqNo);
+  if (g_proc.enabled) {
+    ProcTransmit(stackSrc, dst, buf);
+  } else {
+    NwkDataRequest(stackSrc, dst, buf);
+  }
+}
 
-  double recvTime = Simulator::Now().GetSeconds();
-  double delay = recvTime - sendTime;
+// Passive observers of the spectrum channel: the probe grid, gap sensing,
+// the channel manager, TPC and the Zigbee power footprint all evaluate every
+// transmitted signal at a set of receivers, from the mean log-distance loss,
+// in a Zigbee channel. The conversion to the LR-WPAN spectrum model and the
+// in-band power of a signal are computed once for all of them, the link gains
+// once per transmitter and receiver set, from a loss cache shared by the sets.
+struct ObservedSignal {
+  Ptr<MobilityModel> txMobility;
+  Ptr<const SpectrumValue> psd;  // in the LR-WPAN spectrum model
+  std::array<double, 27> powerW; // in-band transmit power per Zigbee channel, < 0 = not computed
+};
+
+struct ObserverState {
+  Ptr<PropagationLossModel> loss;
+  Ptr<const SpectrumModel> lrwpanModel;
+  std::map<SpectrumModelUid_t, std::shared_ptr<SpectrumConverter>> converters;
+  std::map<std::pair<const MobilityModel*, const MobilityModel*>, double> linkGain; // linear
+  std::vector<std::vector<Ptr<MobilityModel>>> sets;                               // receivers
+  std::vector<std::map<const MobilityModel*, std::vector<double>>> gains;          // per set, by transmitter
+  Ptr<SpectrumSignalParameters> current; // signal being dispatched to the observers
+  ObservedSignal signal;
+};
+static ObserverState g_observers;
+
+/**
+ * Register a set of receivers.
+ * \return the set id to pass to ObservedGains
+ */
+static uint32_t ObserverSet(Ptr<PropagationLossModel> loss, std::vector<Ptr<MobilityModel>> receivers) {
+  if (!g_observers.lrwpanModel) {
+    LrWpanSpectrumValueHelper psdHelper;
+    g_observers.lrwpanModel = psdHelper.CreateTxPowerSpectralDensity(0.0, 11)->GetSpectrumModel();
+  }
+  g_observers.loss = loss;
+  g_observers.sets.push_back(std::move(receivers));
+  g_observers.gains.emplace_back();
+  return g_observers.sets.size() - 1;
+}
+
+/**
+ * The signal of params as seen by the observers; every observer connected to
+ * the trace gets the same, computed on first use.
+ * \return nullptr if the transmitter has no position
+ */
+static ObservedSignal* ObserveSignal(Ptr<SpectrumSignalParameters> params) {
+  ObservedSignal& sig = g_observers.signal;
+  if (params == g_observers.current) {
+    return sig.txMobility ? &sig : nullptr;
+  }
+  g_observers.current = params;
+  sig.txMobility = params->txPhy ? params->txPhy->GetMobility() : nullptr;
+  sig.psd = params->psd;
+  sig.powerW.fill(-1.0);
+  if (sig.psd->GetSpectrumModelUid() != g_observers.lrwpanModel->GetUid()) {
+    auto& conv = g_observers.converters[sig.psd->GetSpectrumModelUid()];
+    if (!conv) {
+      conv = std::make_shared<SpectrumConverter>(sig.psd->GetSpectrumModel(), g_observers.lrwpanModel);
+    }
+    sig.psd = conv->Convert(sig.psd);
+  }
+  return sig.txMobility ? &sig : nullptr;
+}
+
+static double ObservedPowerW(ObservedSignal& sig, uint8_t channel) {
+  if (sig.powerW[channel] < 0.0) {
+    sig.powerW[channel] = LrWpanSpectrumValueHelper::TotalAvgPower(sig.psd, channel);
+  }
+  return sig.powerW[channel];
+}
+
+/**
+ * \return the linear gains from the transmitter of sig to the receivers of set, in their order
+ */
+static const std::vector<double>& ObservedGains(const ObservedSignal& sig, uint32_t set) {
+  auto& gains = g_observers.gains[set][PeekPointer(sig.txMobility)];
+  if (gains.empty()) {
+    for (const auto& rx : g_observers.sets[set]) {
+      auto key = std::make_pair(PeekPointer(sig.txMobility), PeekPointer(rx));
+      auto it = g_observers.linkGain.find(key);
+      if (it == g_observers.linkGain.end()) {
+        double gainDb = g_observers.loss->CalcRxPower(0.0, sig.txMobility, rx);
+        it = g_observers.linkGain.emplace(key, std::pow(10.0, gainDb / 10.0)).first;
+      }
+      gains.push_back(it->second);
+    }
+  }
+  return gains;
+}
+
+// Idle-gap-aware transmission (--gapAware). Every Zigbee node senses the
+// Wi-Fi energy in its own PHY's current channel, as an ED-based CCA would: a
+// Wi-Fi signal whose mean received power reaches gapBusyDbm makes the channel
+// busy while it is on air. The energy is not sampled through PLME-ED or CCA,
+// which the MAC owns (ED scans, CSMA/CA), but taken from the channel's TX
+// trace at mean path loss, as an idealized detector without fading or
+// sensing delay. Nodes only learn of a busy period's end when the last signal stops;
+// an idle gap starts then. The lengths of the last gapHistory idle gaps form
+// the node's gap history. A heartbeat is handed to the NWK layer only when,
+// given how long the channel has already been idle, the history says the gap
+// will last at least as long as the frame plus one backoff period with
+// probability gapThreshold. Else it senses again at the earliest idle age at
+// which the history predicts that, or when the current busy period ends; at
+// gapMaxDefer after the request it is sent regardless. Only the source's
+// first transmission is timed; relays use plain CSMA/CA.
+static const double c_lrwpanByteSeconds = 8.0 / 250e3;
+static const uint32_t c_lrwpanFrameOverhead = 6 + 11 + 8; // PHY, MAC (short addresses, FCS), NWK
+static const double c_lrwpanBackoffPeriod = 20 * 16e-6;
+
+struct GapFrame {
+  Ptr<ZigbeeStack> stack;
+  Mac16Address dst;
+  std::vector<uint8_t> buf;
+  double requested;
+};
+
+struct GapNode {
+  Ptr<LrWpanPhy> phy;
+  uint32_t busySignals = 0; // Wi-Fi signals on air above gapBusyDbm
+  double idleSince = 0.0;
+  std::deque<double> gaps;             // completed idle gaps (s), oldest first
+  std::map<uint64_t, GapFrame> waiting; // deferred heartbeats, by frame id
+};
+
+struct GapState {
+  bool enabled = false;
+  double busyDbm = -85.0;
+  uint32_t history = 64;
+  double threshold = 0.8;
+  double maxDefer = 0.05;
+  std::map<uint32_t, GapNode> nodes; // by node id
+  uint32_t observers = 0;            // ObserverSet of the nodes, in nodes order
+  uint64_t nextFrame = 0;
+  uint64_t immediate = 0;
+  uint64_t deferred = 0;
+  uint64_t forced = 0;
+  double deferSeconds = 0.0;
+};
+static GapState g_gap;
+
+static void GapSense(uint32_t nodeId, uint64_t frame);
+
+// A Wi-Fi signal sensed by the nodes stopped
+static void GapSignalEnd(std::vector<uint32_t> nodeIds) {
+  double now = Simulator::Now().GetSeconds();
+  for (uint32_t id : nodeIds) {
+    GapNode& node = g_gap.nodes[id];
+    if (--node.busySignals > 0) {
+      continue;
+    }
+    node.idleSince = now;
+    std::vector<uint64_t> frames;
+    for (const auto& kv : node.waiting) {
+      frames.push_back(kv.first);
+    }
+    for (uint64_t frame : frames) {
+      GapSense(id, frame);
+    }
+  }
+}
+
+static void GapTxSignal(Ptr<SpectrumSignalParameters> params) {
+  if (!DynamicCast<WifiSpectrumSignalParameters>(params) || g_gap.nodes.empty()) {
+    return;
+  }
+  ObservedSignal* sig = ObserveSignal(params);
+  if (!sig) {
+    return;
+  }
+  const std::vector<double>& gains = ObservedGains(*sig, g_gap.observers);
+  double now = Simulator::Now().GetSeconds();
+  double busyW = 1e-3 * std::pow(10.0, g_gap.busyDbm / 10.0);
+  std::vector<uint32_t> sensed;
+  size_t i = 0;
+  for (auto& kv : g_gap.nodes) {
+    GapNode& node = kv.second;
+    if (ObservedPowerW(*sig, node.phy->GetCurrentChannelNum()) * gains[i++] < busyW) {
+      continue;
+    }
+    if (node.busySignals++ == 0 && now > node.idleSince) {
+      node.gaps.push_back(now - node.idleSince);
+      if (node.gaps.size() > g_gap.history) {
+        node.gaps.pop_front();
+      }
+    }
+    sensed.push_back(kv.first);
+  }
+  if (!sensed.empty()) {
+    // The end is not used before it happens: the nodes sense it when it comes
+    Simulator::Schedule(params->duration, &GapSignalEnd, sensed);
+  }
+}
+
+/**
+ * \return the smallest idle age >= age at which a gap is predicted to last
+ *         another `needed` seconds, or a negative value if none is
+ */
+static double GapReadyAge(const GapNode& node, double age, double needed) {
+  if (node.gaps.size() < 8) {
+    return age; // too little history to predict anything
+  }
+  std::vector<double> gaps(node.gaps.begin(), node.gaps.end());
+  std::sort(gaps.begin(), gaps.end());
+  // Candidate ages: now, and just before each longer gap ends (minus the frame)
+  std::vector<double> ages{age};
+  for (double g : gaps) {
+    if (g - needed > age) {
+      ages.push_back(g - needed);
+    }
+  }
+  for (double a : ages) {
+    auto survive = gaps.end() - std::lower_bound(gaps.begin(), gaps.end(), a);
+    auto fit = gaps.end() - std::lower_bound(gaps.begin(), gaps.end(), a + needed);
+    // A gap longer than every one seen so far is taken as a long gap
+    if (survive == 0 || double(fit) >= g_gap.threshold * double(survive)) {
+      return a;
+    }
+  }
+  return -1.0;
+}
+
+/**
+ * Hand a waiting heartbeat to the NWK layer.
+ * \param forced true when it is sent because gapMaxDefer has passed
+ */
+static void GapRelease(uint32_t nodeId, uint64_t frame, bool forced) {
+  GapNode& node = g_gap.nodes[nodeId];
+  auto it = node.waiting.find(frame);
+  if (it == node.waiting.end()) {
+    return; // already sent
+  }
+  GapFrame f = std::move(it->second);
+  node.waiting.erase(it);
+  if (g_downNodes.count(nodeId)) {
+    return;
+  }
+  double now = Simulator::Now().GetSeconds();
+  if (forced) {
+    g_gap.forced++;
+  } else if (now > f.requested) {
+    g_gap.deferred++;
+  } else {
+    g_gap.immediate++;
+  }
+  g_gap.deferSeconds += now - f.requested;
+  NwkSendFrame(f.stack, f.dst, f.buf);
+}
+
+// Sense the channel for a waiting heartbeat: send it if the current gap is
+// predicted to fit it, else look again later
+static void GapSense(uint32_t nodeId, uint64_t frame) {
+  GapNode& node = g_gap.nodes[nodeId];
+  auto it = node.waiting.find(frame);
+  if (it == node.waiting.end() || node.busySignals > 0) {
+    return; // sent, or woken again by GapSignalEnd
+  }
+  double now = Simulator::Now().GetSeconds();
+  double needed = double(it->second.buf.size() + c_lrwpanFrameOverhead) * c_lrwpanByteSeconds + c_lrwpanBackoffPeriod;
+  double age = now - node.idleSince;
+  double ready = GapReadyAge(node, age, needed);
+  if (ready >= 0.0 && ready <= age) {
+    GapRelease(nodeId, frame, false);
+  } else if (ready >= 0.0 && now + ready - age < it->second.requested + g_gap.maxDefer) {
+    Simulator::Schedule(Seconds(ready - age), &GapSense, nodeId, frame);
+  }
+  // Else the next signal end or the deadline wakes it
+}
+
+static void GapSend(Ptr<ZigbeeStack> stackSrc, Mac16Address dst, std::vector<uint8_t> buf, double requested) {
+  uint32_t nodeId = stackSrc->GetNode()->GetId();
+  if (g_downNodes.count(nodeId)) {
+    return;
+  }
+  uint64_t frame = g_gap.nextFrame++;
+  g_gap.nodes[nodeId].waiting[frame] = {stackSrc, dst, std::move(buf), requested};
+  Simulator::Schedule(Seconds(g_gap.maxDefer), &GapRelease, nodeId, frame, true);
+  GapSense(nodeId, frame);
+}
+
+static void SetupGapSensing(Ptr<SpectrumChannel> channel, Ptr<PropagationLossModel> loss,
+                            const NetDeviceContainer& lrwpanDevices) {
+  for (uint32_t i = 0; i < lrwpanDevices.GetN(); i++) {
+    Ptr<LrWpanNetDevice> dev = DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(i));
+    g_gap.nodes[dev->GetNode()->GetId()].phy = dev->GetPhy();
+  }
+  std::vector<Ptr<MobilityModel>> receivers;
+  for (const auto& kv : g_gap.nodes) {
+    receivers.push_back(kv.second.phy->GetMobility());
+  }
+  g_gap.observers = ObserverSet(loss, receivers);
+  channel->TraceConnectWithoutContext("TxSigParams", MakeCallback(&GapTxSignal));
+}
+
+static void PrintGapScheduling() {
+  uint64_t sent = g_gap.immediate + g_gap.deferred + g_gap.forced;
+  double meanDefer = sent > 0 ? g_gap.deferSeconds / double(sent) : 0.0;
+  NS_LOG_UNCOND("=== Idle-gap-aware transmission ===");
+  NS_LOG_UNCOND("  immediate = " << g_gap.immediate << ", deferred into a gap = " << g_gap.deferred
+                                 << ", sent at gapMaxDefer = " << g_gap.forced);
+  NS_LOG_UNCOND("  mean deferral = " << std::fixed << std::setprecision(3) << meanDefer * 1e3 << " ms"
+                                     << std::defaultfloat);
+  AddResult("gap.immediate", g_gap.immediate);
+  AddResult("gap.deferred", g_gap.deferred);
+  AddResult("gap.forced", g_gap.forced);
+  AddResult("gap.deferMean", meanDefer);
+}
+
+// TSCH-like slotted channel hopping (--tsch). Emulates an 802.15.4e
+// slotframe on top of the unmodified LR-WPAN MAC: heartbeats travel hop by
+// hop along the routing tree, each hop as a one-hop NWK frame sent in the
+// dedicated cell of its directed link. A centralized scheduler reads every
+// router's parent from its neighbor table once the network has formed and
+// gives each directed tree link one cell: upward links deepest first, then
+// downward links in breadth-first order, so that a packet can cross the
+// tree, up and down again, within one slotframe. Slot 0 is left to the NWK maintenance traffic.
+// In a cell both ends tune to c_tschHopping[(ASN + channelOffset) % 16] and
+// the sender transmits the head of the link's queue; outside their cells
+// nodes listen on the PAN channel. The frame kind FRAME_TSCH marks hop
+// frames, bytes [17, 21) carry the final destination.
+static const std::array<uint8_t, 16> c_tschHopping{16, 17, 23, 18, 26, 15, 25, 22,
+                                                   19, 11, 12, 13, 24, 14, 20, 21};
+static const uint32_t c_tschHeader = 21;
+static const double c_tschTxOffset = 0.00212; // macTsTxOffset
+
+struct TschCell {
+  uint32_t from = 0; // node ids
+  uint32_t to = 0;
+  uint32_t channelOffset = 0;
+  std::deque<std::vector<uint8_t>> queue;
+};
+
+struct TschState {
+  bool enabled = false;
+  double slot = 0.015;
+  uint32_t slotframe = 0; // 0 = one slot per cell plus the shared slot
+  uint32_t queueLimit = 16;
+  bool running = false;
+  uint64_t asn = 0;
+  uint8_t panChannel = 11;
+  std::map<uint32_t, Ptr<ZigbeeStack>> stacks; // by node id
+  std::map<uint32_t, Ptr<LrWpanNetDevice>> devices;
+  std::map<uint32_t, uint32_t> parent;         // node id -> parent node id
+  std::vector<TschCell> cells;                 // cells[i] is in slot i + 1
+  std::map<std::pair<uint32_t, uint32_t>, uint32_t> cellOf;
+  std::vector<uint32_t> tuned; // nodes off the PAN channel
+  uint64_t transmissions = 0;
+  uint64_t idleCells = 0;
+  uint64_t queueDrops = 0;
+  uint64_t unroutable = 0;
+  std::array<uint64_t, 27> channelUse{};
+};
+static TschState g_tsch;
+
+static void TschTune(uint32_t node, uint8_t channel) {
+  Ptr<PhyPibAttributes> attr = Create<PhyPibAttributes>();
+  attr->phyCurrentChannel = channel;
+  g_tsch.devices[node]->GetPhy()->PlmeSetAttributeRequest(pCurrentChannel, attr);
+}
+
+/**
+ * \return the next tree hop from node towards dst, or node itself if there is none
+ */
+static uint32_t TschNextHop(uint32_t node, uint32_t dst) {
+  // Walk up from dst: if node is an ancestor, go down towards dst
+  uint32_t n = dst;
+  for (size_t depth = 0; depth < g_tsch.parent.size() && g_tsch.parent.count(n); depth++) {
+    if (g_tsch.parent[n] == node) {
+      return n;
+    }
+    n = g_tsch.parent[n];
+  }
+  return g_tsch.parent.count(node) ? g_tsch.parent[node] : node;
+}
+
+static bool TschEnqueue(uint32_t node, uint32_t dst, std::vector<uint8_t> buf) {
+  uint32_t next = TschNextHop(node, dst);
+  auto it = g_tsch.cellOf.find({node, next});
+  if (next == node || it == g_tsch.cellOf.end()) {
+    g_tsch.unroutable++;
+    return false;
+  }
+  TschCell& cell = g_tsch.cells[it->second];
+  if (cell.queue.size() >= g_tsch.queueLimit) {
+    g_tsch.queueDrops++;
+    return true;
+  }
+  buf.resize(std::max<size_t>(buf.size(), c_tschHeader), 0);
+  buf[16] = FRAME_TSCH;
+  memcpy(buf.data() + 17, &dst, 4);
+  cell.queue.push_back(std::move(buf));
+  return true;
+}
+
+static void TschSlot() {
+  for (uint32_t node : g_tsch.tuned) {
+    TschTune(node, g_tsch.panChannel);
+  }
+  g_tsch.tuned.clear();
+
+  uint32_t length = std::max<uint32_t>(g_tsch.slotframe, g_tsch.cells.size() + 1);
+  uint32_t slot = uint32_t(g_tsch.asn % length);
+  if (slot >= 1 && slot <= g_tsch.cells.size()) {
+    TschCell& cell = g_tsch.cells[slot - 1];
+    uint8_t channel = c_tschHopping[(g_tsch.asn + cell.channelOffset) % c_tschHopping.size()];
+    if (cell.queue.empty()) {
+      g_tsch.idleCells++;
+    } else if (!g_downNodes.count(cell.from)) {
+      TschTune(cell.from, channel);
+      TschTune(cell.to, channel);
+      g_tsch.tuned = {cell.from, cell.to};
+      Simulator::Schedule(Seconds(c_tschTxOffset), &NwkSendFrame, g_tsch.stacks[cell.from],
+                          g_tsch.stacks[cell.to]->GetNwk()->GetNetworkAddress(), cell.queue.front());
+      cell.queue.pop_front();
+      g_tsch.transmissions++;
+      g_tsch.channelUse[channel]++;
+    }
+  }
+  g_tsch.asn++;
+  Simulator::Schedule(Seconds(g_tsch.slot), &TschSlot);
+}
+
+/**
+ * Parent of a router: the PARENT entry of its neighbor table.
+ */
+static bool TschReadParent(Ptr<ZigbeeStack> stack, const std::map<Mac64Address, uint32_t>& byExt, uint32_t& parent) {
+  std::ostringstream table;
+  stack->GetNwk()->PrintNeighborTable(Create<OutputStreamWrapper>(&table));
+  std::istringstream lines(table.str());
+  std::string line;
+  while (std::getline(lines, line)) {
+    std::istringstream tokens(line);
+    std::string ext;
+    std::string token;
+    tokens >> ext;
+    while (tokens >> token) {
+      if (token != "PARENT" || std::count(ext.begin(), ext.end(), ':') != 7) {
+        continue;
+      }
+      auto it = byExt.find(Mac64Address(ext.c_str()));
+      if (it != byExt.end()) {
+        parent = it->second;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void TschStart() {
+  if (!g_networkReady) {
+    Simulator::Schedule(Seconds(1), &TschStart);
+    return;
+  }
+  std::map<Mac64Address, uint32_t> byExt;
+  uint32_t root = 0;
+  for (const auto& kv : g_tsch.stacks) {
+    Ptr<LrWpanNetDevice> dev = g_tsch.devices[kv.first];
+    byExt[dev->GetMac()->GetExtendedAddress()] = kv.first;
+    if (kv.second->GetNwk()->GetNetworkAddress() == Mac16Address("00:00")) {
+      root = kv.first;
+      g_tsch.panChannel = dev->GetPhy()->GetCurrentChannelNum();
+    }
+  }
+  std::map<uint32_t, std::vector<uint32_t>> children;
+  for (const auto& kv : g_tsch.stacks) {
+    uint32_t parent;
+    if (kv.first == root || !NodeActive(kv.first) || g_downNodes.count(kv.first)) {
+      continue;
+    }
+    if (!TschReadParent(kv.second, byExt, parent)) {
+      NS_LOG_WARN("TSCH: no parent found for node " << kv.first << ", it gets no cells");
+      continue;
+    }
+    g_tsch.parent[kv.first] = parent;
+    children[parent].push_back(kv.first);
+  }
+
+  // Breadth-first order of the tree
+  std::vector<uint32_t> order{root};
+  for (size_t i = 0; i < order.size(); i++) {
+    for (uint32_t child : children[order[i]]) {
+      order.push_back(child);
+    }
+  }
+  auto addCell = [](uint32_t from, uint32_t to) {
+    TschCell cell;
+    cell.from = from;
+    cell.to = to;
+    cell.channelOffset = uint32_t(g_tsch.cells.size() % c_tschHopping.size());
+    g_tsch.cellOf[{from, to}] = g_tsch.cells.size();
+    g_tsch.cells.push_back(cell);
+  };
+  for (size_t i = order.size(); i-- > 1;) {
+    addCell(order[i], g_tsch.parent[order[i]]);
+  }
+  for (size_t i = 1; i < order.size(); i++) {
+    addCell(g_tsch.parent[order[i]], order[i]);
+  }
+  g_tsch.running = true;
+  NS_LOG_INFO(Simulator::Now().As(Time::S) << " TSCH: " << g_tsch.cells.size() << " cells, slotframe of "
+                                           << std::max<uint32_t>(g_tsch.slotframe, g_tsch.cells.size() + 1)
+                                           << " slots");
+  TschSlot();
+}
+
+/**
+ * A TSCH hop frame received by stack: queue it for the next hop.
+ * \return false if stack is its final destination
+ */
+static bool TschForward(Ptr<ZigbeeStack> stack, Ptr<Packet> p) {
+  if (p->GetSize() < c_tschHeader) {
+    return false;
+  }
+  std::vector<uint8_t> buf(p->GetSize());
+  p->CopyData(buf.data(), buf.size());
+  uint32_t dst;
+  memcpy(&dst, buf.data() + 17, 4);
+  uint32_t node = stack->GetNode()->GetId();
+  if (buf[16] != FRAME_TSCH || dst == node) {
+    return false;
+  }
+  TschEnqueue(node, dst, std::move(buf));
+  return true;
+}
+
+static void PrintTsch() {
+  uint32_t length = std::max<uint32_t>(g_tsch.slotframe, g_tsch.cells.size() + 1);
+  uint64_t queued = 0;
+  for (const auto& cell : g_tsch.cells) {
+    queued += cell.queue.size();
+  }
+  NS_LOG_UNCOND("=== TSCH (" << g_tsch.cells.size() << " cells, slotframe " << length << " x " << g_tsch.slot * 1e3
+                              << " ms = " << length * g_tsch.slot << " s) ===");
+  NS_LOG_UNCOND("  transmissions = " << g_tsch.transmissions << ", idle cells = " << g_tsch.idleCells
+                                     << ", queue drops = " << g_tsch.queueDrops << ", unroutable = "
+                                     << g_tsch.unroutable << ", still queued = " << queued);
+  std::ostringstream use;
+  for (uint8_t ch = 11; ch <= 26; ch++) {
+    use << " " << uint32_t(ch) << ":" << g_tsch.channelUse[ch];
+  }
+  NS_LOG_UNCOND("  transmissions per channel:" << use.str());
+  AddResult("tsch.cells", g_tsch.cells.size());
+  AddResult("tsch.slotframeSeconds", length * g_tsch.slot);
+  AddResult("tsch.transmissions", g_tsch.transmissions);
+  AddResult("tsch.queueDrops", g_tsch.queueDrops);
+  AddResult("tsch.unroutable", g_tsch.unroutable);
+}
+
+static void SendZigbeePacket(Ptr<ZigbeeStack> stackSrc, Ptr<ZigbeeStack> stackDst, uint32_t size) {
+  uint32_t srcNodeId = stackSrc->GetNode()->GetId();
+  uint32_t destNodeId = stackDst->GetNode()->GetId();
+  if (g_downNodes.count(srcNodeId)) {
+    return;
+  }
+
+  // The first 16 bytes carry the source, sequence number and send time
+  std::vector<uint8_t> buf(std::max<uint32_t>(size, 16), 0);
+  double nowSeconds = Simulator::Now().GetSeconds();
+  memcpy(buf.data() + 0, &srcNodeId, 4);
+  memcpy(buf.data() + 4, &g_seqNo, 4);
+  memcpy(buf.data() + 8, &nowSeconds, 8);
+
+  g_outstanding[g_seqNo] = nowSeconds;
+  g_seqNo++;
+
+  if (g_scenario.InWindow(nowSeconds)) {
+    qosMap[destNodeId].sentPackets += 1;
+  }
+  if (RampPhase* phase = RampPhaseAt(nowSeconds)) {
+    phase->zigbeeSent++;
+  }
+
+  if (g_gap.enabled) {
+    GapSend(stackSrc, stackDst->GetNwk()->GetNetworkAddress(), buf, nowSeconds);
+  } else if (g_tsch.running && TschEnqueue(srcNodeId, destNodeId, buf)) {
+    // sent in the link's cell
+  } else {
+    NwkSendFrame(stackSrc, stackDst->GetNwk()->GetNetworkAddress(), buf);
+  }
+
+  NS_LOG_DEBUG(Simulator::Now().GetSeconds()
+               << "s Node" << srcNodeId << " sent packet seq=" << (g_seqNo - 1) << " size=" << buf.size() << " bytes"
+               << " to " << stackDst->GetNwk()->GetNetworkAddress() << " totalSent =" << qosMap[srcNodeId].sentPackets);
+}
+
+static void SendDataPeriod(Ptr<ZigbeeStack> stackSrc, Ptr<ZigbeeStack> stackDst, double interval, uint32_t size,
+                           double stop) {
+  if (!g_networkReady || Simulator::Now().GetSeconds() >= stop) {
+    return;
+  }
+
+  if (size < 16) {
+    NS_ABORT_MSG("Heartbeat size must be >= 16");
+  }
+
+  SendZigbeePacket(stackSrc, stackDst, size);
+
+  // Every interval
+  Simulator::Schedule(Seconds(interval), &SendDataPeriod, stackSrc, stackDst, interval, size, stop);
+}
+
+// Adaptive heartbeat rate (--adaptiveRate): every heartbeat flow adjusts its
+// own rate AIMD-style between 1/adaptiveMaxInterval and 1/adaptiveMinInterval.
+// A delivery within adaptiveDelayTarget adds adaptiveIncrease/rate, i.e. the
+// rate grows by adaptiveIncrease packets/s per second of good feedback. A late
+// delivery, a channel-access failure or retry drop of one of the flow's frames
+// on any hop (MacTxDrop) and a packet outstanding for longer than
+// adaptiveLossTimeout are congestion signals; they multiply the rate by
+// adaptiveDecrease, at most once per hold-off (the new interval plus the delay
+// target). Delivery feedback is taken at the receiver, without an
+// acknowledgement frame on the air.
+struct AdaptiveFlow {
+  Ptr<ZigbeeStack> src;
+  Ptr<ZigbeeStack> dst;
+  uint32_t size = 0;
+  double stop = 0.0;
+  double rate = 0.0; // packets/s
+  double holdUntil = 0.0;
+  uint64_t sent = 0;
+  uint64_t decreases = 0;
+  double intervalSum = 0.0; // of the intervals actually used, for the mean
+};
+
+struct AdaptiveInFlight {
+  uint32_t flow = 0;
+  double sent = 0.0;
+};
+
+struct AdaptiveState {
+  bool enabled = false;
+  double minInterval = 0.05;
+  double maxInterval = 5.0;
+  double increase = 0.5;
+  double decrease = 0.5;
+  double delayTarget = 0.25;
+  double lossTimeout = 2.0;
+  std::vector<AdaptiveFlow> flows;
+  std::map<uint32_t, AdaptiveInFlight> inFlight; // heartbeat seq -> flow; seq grows with time
+  uint64_t delaySignals = 0;
+  uint64_t macSignals = 0;
+  uint64_t lossSignals = 0;
+};
+static AdaptiveState g_adaptive;
+
+static void AdaptiveCongestion(uint32_t flow) {
+  AdaptiveFlow& f = g_adaptive.flows[flow];
+  double now = Simulator::Now().GetSeconds();
+  if (now < f.holdUntil) {
+    return;
+  }
+  f.rate = std::max(f.rate * g_adaptive.decrease, 1.0 / g_adaptive.maxInterval);
+  f.holdUntil = now + 1.0 / f.rate + g_adaptive.delayTarget;
+  f.decreases++;
+}
+
+static void AdaptiveDelivered(uint32_t seq, double delay) {
+  auto it = g_adaptive.inFlight.find(seq);
+  if (it == g_adaptive.inFlight.end()) {
+    return;
+  }
+  uint32_t flow = it->second.flow;
+  g_adaptive.inFlight.erase(it);
+  if (delay > g_adaptive.delayTarget) {
+    g_adaptive.delaySignals++;
+    AdaptiveCongestion(flow);
+    return;
+  }
+  AdaptiveFlow& f = g_adaptive.flows[flow];
+  f.rate = std::min(f.rate + g_adaptive.increase / f.rate, 1.0 / g_adaptive.minInterval);
+}
+
+/**
+ * MacTxDrop of any LR-WPAN device: find the heartbeat in the dropped frame.
+ */
+static void AdaptiveMacDrop(Ptr<const Packet> p) {
+  FrameKind kind;
+  uint32_t seq;
+  // Poll and TSCH frames carry their own counters in the sequence field
+  if (!PacketFrameInfo(p, true, kind, seq) || kind != FRAME_DATA) {
+    return;
+  }
+  auto it = g_adaptive.inFlight.find(seq);
+  if (it != g_adaptive.inFlight.end()) {
+    g_adaptive.macSignals++;
+    AdaptiveCongestion(it->second.flow);
+  }
+}
+
+static void AdaptiveSend(uint32_t flow) {
+  AdaptiveFlow& f = g_adaptive.flows[flow];
+  double now = Simulator::Now().GetSeconds();
+  if (!g_networkReady || now >= f.stop) {
+    return;
+  }
+
+  // Heartbeats outstanding for too long are lost
+  while (!g_adaptive.inFlight.empty() &&
+         g_adaptive.inFlight.begin()->second.sent < now - g_adaptive.lossTimeout) {
+    g_adaptive.lossSignals++;
+    AdaptiveCongestion(g_adaptive.inFlight.begin()->second.flow);
+    g_adaptive.inFlight.erase(g_adaptive.inFlight.begin());
+  }
+
+  if (!g_downNodes.count(f.src->GetNode()->GetId())) {
+    g_adaptive.inFlight[g_seqNo] = {flow, now};
+    SendZigbeePacket(f.src, f.dst, f.size);
+    f.sent++;
+    f.intervalSum += 1.0 / f.rate;
+  }
+  Simulator::Schedule(Seconds(1.0 / f.rate), &AdaptiveSend, flow);
+}
+
+// Delivered heartbeat bytes per (source, destination) node pair inside the
+// measurement window, in both fixed and adaptive mode, for the goodput and
+// Jain's fairness index over the flows
+struct HeartbeatFlows {
+  std::map<std::pair<uint32_t, uint32_t>, uint64_t> bytes;
+  double start = std::numeric_limits<double>::max();
+  double stop = 0.0;
+};
+static HeartbeatFlows g_heartbeatFlows;
+
+// Polling (--pollMode): the coordinator requests a reply from each of
+// pollDevices routers per cycle and measures the round trip. The concurrency
+// of a cycle is one request at a time (round-robin), every device at once
+// (all) or at most pollWindow outstanding requests (window). A request
+// without reply within pollTimeout counts as timed out; a cycle completes
+// once every device answered or timed out, and the next one starts
+// pollPeriod after the previous start (or at once if the cycle overran).
+// Frames carry the usual 16 byte header followed by the frame kind.
+struct PollRequest {
+  uint32_t device = 0; // index into PollState::devices
+  double sent = 0.0;
+  EventId timeout;
+};
+
+struct PollState {
+  std::string mode;
+  uint32_t window = 4;
+  uint32_t devicesLimit = 0; // 0 = every router
+  double period = 5.0;
+  double timeout = 1.0;
+  double start = 16.0;
+  double stop = 0.0;
+  uint32_t size = 32;
+  Ptr<ZigbeeStack> coordinator;
+  std::vector<Ptr<ZigbeeStack>> devices;
+  uint32_t concurrency = 1;
+  uint32_t nextSeq = 0;
+  std::map<uint32_t, PollRequest> pending; // request seq -> request
+  // Current cycle
+  double cycleStart = 0.0;
+  uint32_t nextDevice = 0;
+  uint32_t cycleTimeouts = 0;
+  // Results
+  uint64_t requests = 0;
+  uint64_t responses = 0;
+  uint64_t timeouts = 0;
+  uint64_t lateResponses = 0;
+  uint64_t cycles = 0;
+  uint64_t incompleteCycles = 0;
+  std::vector<double> rtts;
+  std::vector<double> cycleTimes;
+};
+static PollState g_poll;
+
+static std::vector<uint8_t> PollFrameBuffer(uint32_t srcNodeId, uint32_t seq, double time, FrameKind kind) {
+  std::vector<uint8_t> buf(std::max<uint32_t>(g_poll.size, 17), 0);
+  memcpy(buf.data() + 0, &srcNodeId, 4);
+  memcpy(buf.data() + 4, &seq, 4);
+  memcpy(buf.data() + 8, &time, 8);
+  buf[16] = kind;
+  return buf;
+}
+
+static void PollCycle();
+
+static void PollFinishCycle() {
+  double now = Simulator::Now().GetSeconds();
+  g_poll.cycles++;
+  g_poll.incompleteCycles += g_poll.cycleTimeouts > 0 ? 1 : 0;
+  g_poll.cycleTimes.push_back(now - g_poll.cycleStart);
+  double next = std::max(now, g_poll.cycleStart + g_poll.period);
+  Simulator::Schedule(Seconds(next - now), &PollCycle);
+}
+
+static void PollTimeout(uint32_t seq);
+
+/**
+ * Send requests until the cycle's concurrency is used up.
+ */
+static void PollSendNext() {
+  double now = Simulator::Now().GetSeconds();
+  while (g_poll.pending.size() < g_poll.concurrency && g_poll.nextDevice < g_poll.devices.size()) {
+    uint32_t device = g_poll.nextDevice++;
+    uint32_t seq = g_poll.nextSeq++;
+    PollRequest& req = g_poll.pending[seq];
+    req.device = device;
+    req.sent = now;
+    req.timeout = Simulator::Schedule(Seconds(g_poll.timeout), &PollTimeout, seq);
+    g_poll.requests++;
+    NwkSendFrame(g_poll.coordinator, g_poll.devices[device]->GetNwk()->GetNetworkAddress(),
+                 PollFrameBuffer(g_poll.coordinator->GetNode()->GetId(), seq, now, FRAME_POLL_REQUEST));
+  }
+  if (g_poll.pending.empty() && g_poll.nextDevice >= g_poll.devices.size()) {
+    PollFinishCycle();
+  }
+}
+
+static void PollTimeout(uint32_t seq) {
+  g_poll.pending.erase(seq);
+  g_poll.timeouts++;
+  g_poll.cycleTimeouts++;
+  PollSendNext();
+}
+
+static void PollCycle() {
+  if (Simulator::Now().GetSeconds() >= g_poll.stop) {
+    return;
+  }
+  if (!g_networkReady || g_downNodes.count(g_poll.coordinator->GetNode()->GetId())) {
+    Simulator::Schedule(Seconds(g_poll.period), &PollCycle);
+    return;
+  }
+  g_poll.cycleStart = Simulator::Now().GetSeconds();
+  g_poll.nextDevice = 0;
+  g_poll.cycleTimeouts = 0;
+  PollSendNext();
+}
+
+/**
+ * Handle a polling frame received by stack.
+ * \return false if the frame is ordinary data
+ */
+static bool PollReceive(Ptr<ZigbeeStack> stack, Ptr<Packet> p, uint32_t seq, double time) {
+  uint8_t kind = FRAME_DATA;
+  if (p->GetSize() > 16) {
+    uint8_t header[17];
+    p->CopyData(header, 17);
+    kind = header[16];
+  }
+  if (kind == FRAME_POLL_REQUEST) {
+    // Answer at once, echoing the request's sequence number and send time
+    NwkSendFrame(stack, g_poll.coordinator->GetNwk()->GetNetworkAddress(),
+                 PollFrameBuffer(stack->GetNode()->GetId(), seq, time, FRAME_POLL_RESPONSE));
+  } else if (kind == FRAME_POLL_RESPONSE) {
+    auto it = g_poll.pending.find(seq);
+    if (it == g_poll.pending.end()) {
+      g_poll.lateResponses++;
+      return true;
+    }
+    Simulator::Cancel(it->second.timeout);
+    if (g_scenario.InWindow(it->second.sent)) {
+      g_poll.rtts.push_back(Simulator::Now().GetSeconds() - it->second.sent);
+    }
+    g_poll.responses++;
+    g_poll.pending.erase(it);
+    PollSendNext();
+  }
+  return kind == FRAME_POLL_REQUEST || kind == FRAME_POLL_RESPONSE;
+}
+
+static void NwkDataIndication(Ptr<ZigbeeStack> stack, NldeDataIndicationParams params, Ptr<Packet> p) {
+  if (p->GetSize() < 16) {
+    NS_LOG_WARN("NwkDataIndication: packet too small (" << p->GetSize() << " bytes)");
+    return;
+  }
+
+  uint8_t header[16];
+  p->CopyData(header, 16);
+
+  uint32_t srcNodeId;
+  uint32_t seqNo;
+  double sendTime;
+  memcpy(&srcNodeId, header + 0, 4);
+  memcpy(&seqNo, header + 4, 4);
+  memcpy(&sendTime, header + 8, 8);
+
+  if (g_tsch.running && TschForward(stack, p)) {
+    return;
+  }
+  if (PollReceive(stack, p, seqNo, sendTime)) {
+    return;
+  }
+
+  uint32_t destNodeId = stack->GetNode()->GetId();
+
+  // Duplicate check
+  auto& srcMap = receivedTracker[destNodeId];
+  auto& seqSet = srcMap[srcNodeId];
+  if (seqSet.count(seqNo) > 0) {
+    NS_LOG_WARN("Duplicate packet at Node" << destNodeId << " from Node" << srcNodeId << " [seq=" << seqNo
+                                           << "] ignored");
+    return;
+  }
+  seqSet.insert(seqNo);
+
+  double recvTime = Simulator::Now().GetSeconds();
+  double delay = recvTime - sendTime;
+
+  double lqi = params.m_linkQuality; // 0..255
+
+  g_outstanding.erase(seqNo);
+  if (g_proc.enabled) {
+    ProcDelivered(seqNo, delay, g_scenario.InWindow(sendTime));
+  }
+  if (g_adaptive.enabled) {
+    AdaptiveDelivered(seqNo, delay);
+  }
+  if (RampPhase* phase = RampPhaseAt(sendTime)) {
+    phase->zigbeeRecv++;
+    phase->delays.push_back(delay);
+  }
+  g_progress.dropped.erase(seqNo);
+  if (!g_scenario.InWindow(sendTime)) {
+    return;
+  }
+  if (delay > g_progress.delayBound) {
+    g_progress.lateRecv++;
+  }
+
+  g_heartbeatFlows.bytes[{srcNodeId, destNodeId}] += p->GetSize() - std::min(p->GetSize(), ProcSecurityBytes());
+  auto& info = qosMap[destNodeId];
+  info.recvPackets += 1;
+  info.sumDelays += delay;
+  info.sumLqi += lqi;
+  g_delays.push_back(delay);
+
+  NS_LOG_DEBUG(Simulator::Now().GetSeconds()
+               << "s Node" << stack->GetNode()->GetId() << " <- Node" << srcNodeId << " [seq=" << seqNo << "]"
+               << "  delay=" << std::fixed << std::setprecision(3) << delay << "s"
+               << "  LQI=" << lqi << "  totalRecv=" << info.recvPackets);
+}
+
+/**
+ * Scenario fault: take every radio of a node down, or bring it back up. A
+ * Zigbee node that is down neither sends its flows nor receives or relays.
+ */
+static void ScenarioFault(Ptr<Node> node, bool up) {
+  NS_LOG_INFO(Simulator::Now().As(Time::S) << " Node " << node->GetId() << " goes " << (up ? "up" : "down"));
+  for (uint32_t d = 0; d < node->GetNDevices(); d++) {
+    if (Ptr<LrWpanNetDevice> lrwpan = DynamicCast<LrWpanNetDevice>(node->GetDevice(d))) {
+      lrwpan->GetMac()->SetRxOnWhenIdle(up);
+      if (!up) {
+        lrwpan->GetPhy()->PlmeSetTRXStateRequest(IEEE_802_15_4_PHY_FORCE_TRX_OFF);
+      }
+    } else if (Ptr<WifiNetDevice> wifi = DynamicCast<WifiNetDevice>(node->GetDevice(d))) {
+      if (up) {
+        wifi->GetPhy()->ResumeFromOff();
+      } else {
+        wifi->GetPhy()->SetOffMode();
+      }
+    }
+  }
+  if (up) {
+    g_downNodes.erase(node->GetId());
+  } else {
+    g_downNodes.insert(node->GetId());
+  }
+}
+
+// Trace replay (--replayTrace, see wifi-zigbee-trace.h). Records are read one
+// at a time and at most replayLookahead of them are scheduled at once, so
+// memory does not grow with the trace. Production device ids are mapped to
+// simulated endpoints by --replayMap lines "<id> <endpoint>", the endpoint
+// being zigbee:<i>, ap:<i>, sta:<i>, node:<nodeId> or a scenario node name;
+// ids without a mapping are tried as endpoint names. Zigbee records become
+// NWK data requests with the usual QoS header, Wi-Fi records UDP datagrams to
+// the destination's sink. Records between the two technologies are counted
+// and dropped.
+static const uint32_t c_replayMaxNsdu = 100;
+static const uint32_t c_replayMaxDatagram = 65507;
+
+struct ReplayEndpoint {
+  Ptr<Node> node;
+  Ptr<ZigbeeStack> stack; // null for Wi-Fi endpoints
+  Ipv4Address address;
+};
+
+struct ReplayState {
+  std::string trace;
+  std::string map;
+  uint32_t lookahead = 256;
+  double start = 16.0;
+  bool replaces = true;
+  uint16_t port = 5000;
+  replay::TraceReader reader;
+  std::map<std::string, std::string> ids;          // production id -> endpoint name
+  std::map<std::string, ReplayEndpoint> endpoints; // endpoint name -> endpoint
+  std::map<uint32_t, Ptr<Socket>> sockets;         // node id -> UDP socket
+  uint64_t zigbee = 0;
+  uint64_t wifi = 0;
+  uint64_t unmapped = 0;
+  uint64_t mixed = 0;
+  uint64_t notReady = 0;
+  uint64_t late = 0;
+};
+static ReplayState g_replay;
+
+static const ReplayEndpoint* ReplayResolve(const std::string& id) {
+  auto mapped = g_replay.ids.find(id);
+  const std::string& name = mapped != g_replay.ids.end() ? mapped->second : id;
+  auto it = g_replay.endpoints.find(name);
+  if (it == g_replay.endpoints.end()) {
+    it = g_replay.endpoints.find("node:" + name);
+  }
+  return it != g_replay.endpoints.end() ? &it->second : nullptr;
+}
+
+static void ReplaySend(replay::TraceRecord rec);
+
+static void ReplayScheduleNext() {
+  replay::TraceRecord rec;
+  if (!g_replay.reader.Next(rec)) {
+    return;
+  }
+  double now = Simulator::Now().GetSeconds();
+  double at = g_replay.start + rec.time;
+  if (at < now) {
+    g_replay.late++; // out of order in the trace
+    at = now;
+  }
+  Simulator::Schedule(Seconds(at - now), &ReplaySend, rec);
+}
+
+static void ReplaySend(replay::TraceRecord rec) {
+  ReplayScheduleNext();
+
+  const ReplayEndpoint* src = ReplayResolve(rec.src);
+  const ReplayEndpoint* dst = ReplayResolve(rec.dst);
+  if (!src || !dst) {
+    g_replay.unmapped++;
+    return;
+  }
+  if (bool(src->stack) != bool(dst->stack)) {
+    g_replay.mixed++;
+    return;
+  }
+  if (!NodeActive(src->node->GetId()) || !NodeActive(dst->node->GetId())) {
+    return; // replayed by the process of another partition
+  }
+  if (src->stack) {
+    if (!g_networkReady) {
+      g_replay.notReady++;
+      return;
+    }
+    SendZigbeePacket(src->stack, dst->stack, std::min(rec.size, c_replayMaxNsdu));
+    g_replay.zigbee++;
+    return;
+  }
+  Ptr<Socket>& socket = g_replay.sockets[src->node->GetId()];
+  if (!socket) {
+    socket = Socket::CreateSocket(src->node, UdpSocketFactory::GetTypeId());
+    socket->Bind();
+  }
+  socket->SendTo(Create<Packet>(std::min(rec.size, c_replayMaxDatagram)), 0,
+                 InetSocketAddress(dst->address, g_replay.port));
+  g_replay.wifi++;
+}
+
+static void ReplayStart() {
+  if (!g_replay.map.empty()) {
+    std::ifstream in(g_replay.map);
+    NS_ABORT_MSG_IF(!in, "Unable to open replay map " << g_replay.map);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::replace(line.begin(), line.end(), ',', ' ');
+      std::istringstream fields(line);
+      std::string id;
+      std::string endpoint;
+      if (!(fields >> id >> endpoint) || id[0] == '#') {
+        continue;
+      }
+      NS_ABORT_MSG_IF(!g_replay.endpoints.count(endpoint),
+                      "Unknown endpoint " << endpoint << " for device " << id << " in " << g_replay.map);
+      g_replay.ids[id] = endpoint;
+    }
+  }
+  NS_ABORT_MSG_IF(!g_replay.reader.Open(g_replay.trace), "Unable to open replay trace " << g_replay.trace);
+  for (uint32_t i = 0; i < std::max(g_replay.lookahead, 1u); i++) {
+    ReplayScheduleNext();
+  }
+}
+
+static void PrintReplay() {
+  NS_LOG_UNCOND("=== Trace replay (" << (g_replay.reader.IsBinary() ? "binary" : "csv") << ", "
+                                     << g_replay.reader.GetRecords() << " records read) ===");
+  NS_LOG_UNCOND("  zigbee sent   = " << g_replay.zigbee << " (" << g_replay.notReady << " before join)");
+  NS_LOG_UNCOND("  wifi sent     = " << g_replay.wifi);
+  NS_LOG_UNCOND("  dropped       = " << g_replay.unmapped << " unmapped, " << g_replay.mixed
+                                     << " Zigbee<->Wi-Fi, " << g_replay.reader.GetMalformed() << " malformed");
+  NS_LOG_UNCOND("  out of order  = " << g_replay.late);
+  AddResult("replay.records", g_replay.reader.GetRecords());
+  AddResult("replay.zigbeeSent", g_replay.zigbee);
+  AddResult("replay.wifiSent", g_replay.wifi);
+  AddResult("replay.dropped", g_replay.unmapped + g_replay.mixed + g_replay.notReady);
+}
+
+static double Percentile(std::vector<double> values, double q) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  std::sort(values.begin(), values.end());
+  size_t rank = static_cast<size_t>(std::ceil(q * double(values.size())));
+  return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+static void PrintPolling() {
+  double sum = 0.0;
+  for (double rtt : g_poll.rtts) {
+    sum += rtt;
+  }
+  double timeoutRate = g_poll.requests > 0 ? double(g_poll.timeouts) / double(g_poll.requests) : 0.0;
+  double cycleMean = 0.0;
+  for (double c : g_poll.cycleTimes) {
+    cycleMean += c / double(g_poll.cycleTimes.size());
+  }
+  NS_LOG_UNCOND("=== Polling (" << g_poll.mode << ", " << g_poll.devices.size() << " devices, concurrency "
+                                << g_poll.concurrency << ") ===");
+  NS_LOG_UNCOND("  requests = " << g_poll.requests << ", responses = " << g_poll.responses
+                                << ", timeouts = " << g_poll.timeouts << " (" << std::fixed << std::setprecision(2)
+                                << 100.0 * timeoutRate << "%), late = " << g_poll.lateResponses);
+  NS_LOG_UNCOND("  RTT mean/p50/p90/p99 = " << std::setprecision(4)
+                                            << (g_poll.rtts.empty() ? 0.0 : sum / g_poll.rtts.size()) << " / "
+                                            << Percentile(g_poll.rtts, 0.50) << " / " << Percentile(g_poll.rtts, 0.90)
+                                            << " / " << Percentile(g_poll.rtts, 0.99) << " s");
+  NS_LOG_UNCOND("  cycles = " << g_poll.cycles << " (" << g_poll.incompleteCycles
+                              << " with timeouts), completion mean/p99 = " << cycleMean << " / "
+                              << Percentile(g_poll.cycleTimes, 0.99) << " s" << std::defaultfloat);
+  AddResult("poll.devices", g_poll.devices.size());
+  AddResult("poll.requests", g_poll.requests);
+  AddResult("poll.responses", g_poll.responses);
+  AddResult("poll.timeouts", g_poll.timeouts);
+  AddResult("poll.timeoutRate", timeoutRate);
+  AddResult("poll.lateResponses", g_poll.lateResponses);
+  AddResult("poll.rttMean", g_poll.rtts.empty() ? 0.0 : sum / g_poll.rtts.size());
+  AddResult("poll.rttP50", Percentile(g_poll.rtts, 0.50));
+  AddResult("poll.rttP90", Percentile(g_poll.rtts, 0.90));
+  AddResult("poll.rttP99", Percentile(g_poll.rtts, 0.99));
+  AddResult("poll.cycles", g_poll.cycles);
+  AddResult("poll.cyclesWithTimeouts", g_poll.incompleteCycles);
+  AddResult("poll.cycleMean", cycleMean);
+  AddResult("poll.cycleP99", Percentile(g_poll.cycleTimes, 0.99));
+}
+
+static uint64_t ExpectedHeartbeats(double start, double interval, double stop) {
+  if (start >= stop || interval <= 0.0) {
+    return 0;
+  }
+  return static_cast<uint64_t>(std::ceil((stop - start) / interval)) + 1;
+}
+
+static void PrintProgress() {
+  double now = Simulator::Now().GetSeconds();
+  uint64_t lost = 0;
+  for (const auto& kv : g_outstanding) {
+    if (kv.second < now - g_progress.lossTimeout) {
+      lost++;
+    }
+  }
+  uint64_t sent = 0;
+  uint64_t recv = 0;
+  for (const auto& kv : qosMap) {
+    sent += kv.second.sentPackets;
+    recv += kv.second.recvPackets;
+  }
+  NS_LOG_UNCOND("PROGRESS t=" << now << " sent=" << sent << " recv=" << recv << " lost=" << lost
+                              << " dropped=" << g_progress.dropped.size() << " late=" << g_progress.lateRecv
+                              << " expected=" << g_progress.expected);
+  Simulator::Schedule(Seconds(g_progress.interval), &PrintProgress);
+}
+
+// Passive probes (--probeGrid) for coexistence heatmaps. Instead of adding
+// receivers to the channel, which would run the fading model for every probe
+// and shift the random streams of the real network, the probes hook the
+// channel's TxSigParams trace: every transmission is seen once and its power
+// at all probes is derived from the mean (log-distance) path loss, cached per
+// transmitter since all nodes are static. Per probe they record:
+//  - the expected success of every Zigbee frame on the PAN channel (LR-WPAN
+//    error model at the SINR against all signals overlapping the frame),
+//  - the mean SINR of those frames,
+//  - the fraction of time Wi-Fi puts more than probeBusyDbm into the band.
+struct Probe {
+  Ptr<MobilityModel> mobility;
+  uint64_t zigbeeFrames = 0;
+  double zigbeeSuccess = 0.0; // sum of frame success probabilities
+  double sumSinrDb = 0.0;
+  double wifiBusy = 0.0;      // seconds
+  double wifiBusyUntil = 0.0;
+};
+
+struct ProbeSignal {
+  bool zigbee;
+  double end;
+  uint32_t bits;
+  std::vector<double> powerW;  // in-band power at each probe
+  std::vector<double> interfW; // zigbee frames: overlapping power at each probe
+};
+
+struct ProbeState {
+  std::string grid;
+  std::string file = "output/probes.csv";
+  double busyDbm = -85.0;
+  std::vector<Probe> probes;
+  std::vector<double> xs;
+  std::vector<double> ys;
+  Ptr<LrWpanPhy> panPhy; // tells the PAN channel
+  Ptr<LrWpanErrorModel> errorModel;
+  uint32_t observers = 0; // ObserverSet of the probes
+  std::list<ProbeSignal> active;
+};
+static ProbeState g_probes;
+
+static void ProbeFinish(ProbeSignal& sig) {
+  if (!sig.zigbee) {
+    return;
+  }
+  const double noiseW = 1e-3 * std::pow(10.0, -111.0 / 10.0); // kTB over 2 MHz
+  const double sensitivityW = 1e-3 * std::pow(10.0, -106.58 / 10.0);
+  for (size_t i = 0; i < g_probes.probes.size(); i++) {
+    Probe& probe = g_probes.probes[i];
+    double sinr = sig.powerW[i] / (noiseW + sig.interfW[i]);
+    probe.zigbeeFrames++;
+    probe.sumSinrDb += 10.0 * std::log10(sinr);
+    if (sig.powerW[i] >= sensitivityW) {
+      probe.zigbeeSuccess += g_probes.errorModel->GetChunkSuccessRate(sinr, sig.bits);
+    }
+  }
+}
+
+static void ProbeTxSignal(Ptr<SpectrumSignalParameters> params) {
+  Ptr<LrWpanSpectrumSignalParameters> lrwpan = DynamicCast<LrWpanSpectrumSignalParameters>(params);
+  bool wifi = DynamicCast<WifiSpectrumSignalParameters>(params) != nullptr;
+  ObservedSignal* observed = (lrwpan || wifi) ? ObserveSignal(params) : nullptr;
+  if (!observed) {
+    return;
+  }
+  double now = Simulator::Now().GetSeconds();
+  while (!g_probes.active.empty() && g_probes.active.front().end <= now) {
+    ProbeFinish(g_probes.active.front());
+    g_probes.active.pop_front();
+  }
+
+  // Transmit power in the PAN channel
+  double txW = ObservedPowerW(*observed, g_probes.panPhy->GetCurrentChannelNum());
+  const std::vector<double>& gains = ObservedGains(*observed, g_probes.observers);
+
+  ProbeSignal sig;
+  sig.zigbee = lrwpan != nullptr;
+  sig.end = now + params->duration.GetSeconds();
+  sig.bits = sig.zigbee && lrwpan->packetBurst ? lrwpan->packetBurst->GetSize() * 8 : 0;
+  sig.powerW.resize(gains.size());
+  sig.interfW.assign(sig.zigbee ? gains.size() : 0, 0.0);
+  double busyW = 1e-3 * std::pow(10.0, g_probes.busyDbm / 10.0);
+  for (size_t i = 0; i < gains.size(); i++) {
+    sig.powerW[i] = txW * gains[i];
+    Probe& probe = g_probes.probes[i];
+    if (wifi && sig.powerW[i] >= busyW) {
+      probe.wifiBusy += sig.end - std::max(now, std::min(probe.wifiBusyUntil, sig.end));
+      probe.wifiBusyUntil = std::max(probe.wifiBusyUntil, sig.end);
+    }
+  }
+
+  // Every signal overlapping a Zigbee frame interferes with it (conservative:
+  // the overlap may be partial)
+  for (auto& other : g_probes.active) {
+    for (size_t i = 0; i < gains.size(); i++) {
+      if (other.zigbee) {
+        other.interfW[i] += sig.powerW[i];
+      }
+      if (sig.zigbee) {
+        sig.interfW[i] += other.powerW[i];
+      }
+    }
+  }
+  auto pos = std::find_if(g_probes.active.begin(), g_probes.active.end(),
+                          [&](const ProbeSignal& other) { return other.end > sig.end; });
+  g_probes.active.insert(pos, std::move(sig));
+}
+
+static void SetupProbes(Ptr<SpectrumChannel> channel, Ptr<PropagationLossModel> loss, Ptr<LrWpanPhy> panPhy) {
+  // "x0:x1:dx,y0:y1:dy"
+  std::vector<std::vector<double>> axes;
+  std::istringstream spec(g_probes.grid);
+  std::string axis;
+  while (std::getline(spec, axis, ',')) {
+    double from = 0;
+    double to = 0;
+    double step = 0;
+    char sep1 = 0;
+    char sep2 = 0;
+    std::istringstream range(axis);
+    range >> from >> sep1 >> to >> sep2 >> step;
+    NS_ABORT_MSG_IF(!range || sep1 != ':' || sep2 != ':' || step <= 0.0 || to < from,
+                    "Malformed probeGrid axis '" << axis << "', expected from:to:step");
+    axes.emplace_back();
+    for (double v = from; v <= to + 1e-9; v += step) {
+      axes.back().push_back(v);
+    }
+  }
+  NS_ABORT_MSG_IF(axes.size() != 2, "probeGrid needs an x and a y axis");
+  g_probes.xs = axes[0];
+  g_probes.ys = axes[1];
+  for (double y : g_probes.ys) {
+    for (double x : g_probes.xs) {
+      Probe probe;
+      probe.mobility = CreateObject<ConstantPositionMobilityModel>();
+      probe.mobility->SetPosition(Vector(x, y, 0));
+      g_probes.probes.push_back(probe);
+    }
+  }
+  std::vector<Ptr<MobilityModel>> receivers;
+  for (const auto& probe : g_probes.probes) {
+    receivers.push_back(probe.mobility);
+  }
+  g_probes.observers = ObserverSet(loss, receivers);
+  g_probes.panPhy = panPhy;
+  g_probes.errorModel = CreateObject<LrWpanErrorModel>();
+  channel->TraceConnectWithoutContext("TxSigParams", MakeCallback(&ProbeTxSignal));
+}
+
+static void PrintProbes() {
+  for (auto& sig : g_probes.active) {
+    ProbeFinish(sig);
+  }
+  g_probes.active.clear();
+
+  std::filesystem::path parent = std::filesystem::path(g_probes.file).parent_path();
+  if (!parent.empty()) {
+    std::filesystem::create_directories(parent);
+  }
+  std::ofstream out(g_probes.file);
+  out << "x,y,zigbeeFrames,zigbeePdr,meanSinrDb,wifiOccupancy\n";
+  double duration = Simulator::Now().GetSeconds();
+  uint32_t safe = 0;
+  for (const auto& probe : g_probes.probes) {
+    Vector pos = probe.mobility->GetPosition();
+    double pdr = probe.zigbeeFrames > 0 ? probe.zigbeeSuccess / double(probe.zigbeeFrames) : 0.0;
+    double sinr = probe.zigbeeFrames > 0 ? probe.sumSinrDb / double(probe.zigbeeFrames) : 0.0;
+    out << pos.x << "," << pos.y << "," << probe.zigbeeFrames << "," << pdr << "," << sinr << ","
+        << (duration > 0.0 ? probe.wifiBusy / duration : 0.0) << "\n";
+    safe += pdr >= 0.99 ? 1 : 0;
+  }
+
+  // Coarse map of the expected Zigbee PDR: '#' >= 0.99, digits are tenths
+  NS_LOG_UNCOND("=== Probe Zigbee PDR map (" << g_probes.xs.size() << "x" << g_probes.ys.size()
+                                           << ", '#' >= 0.99, digit = PDR tenths) ===");
+  for (size_t row = g_probes.ys.size(); row-- > 0;) {
+    std::string line;
+    for (size_t col = 0; col < g_probes.xs.size(); col++) {
+      const Probe& probe = g_probes.probes[row * g_probes.xs.size() + col];
+      double pdr = probe.zigbeeFrames > 0 ? probe.zigbeeSuccess / double(probe.zigbeeFrames) : 0.0;
+      line += pdr >= 0.99 ? '#' : char('0' + std::min(9, int(pdr * 10.0)));
+    }
+    NS_LOG_UNCOND(std::setw(8) << g_probes.ys[row] << " " << line);
+  }
+  NS_LOG_UNCOND("Probes: " << g_probes.probes.size() << ", safe (PDR >= 0.99): " << safe << ", written to "
+                           << g_probes.file);
+  AddResult("probe.count", g_probes.probes.size());
+  AddResult("probe.safeFraction", g_probes.probes.empty() ? 0.0 : double(safe) / g_probes.probes.size());
+}
+
+// Dynamic AP channel selection (--channelManager). Every chanInterval the
+// manager looks at what the first AP heard from 802.15.4 devices: the airtime
+// of every LR-WPAN signal whose mean power at the AP reaches chanSenseDbm,
+// per Zigbee channel. Each 2.4 GHz Wi-Fi channel and width up to
+// wifiChannelWidth is scored by the busy fraction of the Zigbee channels it
+// overlaps plus chanCapacityWeight times the capacity given up against the
+// widest channel; the best one replaces the current channel if it scores
+// chanHysteresis better. The switch is announced for chanCsaCount beacon
+// intervals, as a channel switch announcement would be, and then every Wi-Fi
+// device of the network retunes at once. The cost of a switch is the time
+// until the AP receives again and, with associating STAs, until every STA has
+// re-associated.
+static const double c_beaconInterval = 0.1024;
+
+struct ChannelOption {
+  uint32_t channel = 0;
+  uint32_t width = 0;
+};
+
+struct ChannelManager {
+  bool enabled = false;
+  double interval = 5.0;
+  double senseDbm = -95.0;
+  double capacityWeight = 0.2;
+  double hysteresis = 0.05;
+  uint32_t csaCount = 3;
+  ChannelOption current;
+  uint32_t maxWidth = 20;
+  Ptr<WifiPhy> apPhy;
+  std::vector<Ptr<WifiPhy>> phys;
+  uint32_t observers = 0;        // ObserverSet of the AP
+  std::array<double, 27> busy{}; // seconds per Zigbee channel in this interval
+  double intervalStart = 0.0;
+  bool switching = false;
+  // Cost of the last switch
+  double lastSwitch = 0.0;
+  bool awaitingRx = false;
+  uint32_t stas = 0;
+  uint32_t reassociated = 0;
+  // Results
+  uint32_t switches = 0;
+  double outageSeconds = 0.0;
+  double reassocSeconds = 0.0;
+  std::vector<std::string> history;
+};
+static ChannelManager g_chan;
+
+static double WifiCenterMhz(uint32_t channel) {
+  return 2407.0 + 5.0 * channel;
+}
+
+static double ZigbeeCenterMhz(uint32_t channel) {
+  return 2405.0 + 5.0 * (channel - 11);
+}
+
+static void ChanTxSignal(Ptr<SpectrumSignalParameters> params) {
+  Ptr<LrWpanPhy> txPhy = DynamicCast<LrWpanPhy>(params->txPhy);
+  ObservedSignal* sig =
+      txPhy && DynamicCast<LrWpanSpectrumSignalParameters>(params) ? ObserveSignal(params) : nullptr;
+  if (!sig) {
+    return;
+  }
+  uint8_t zigbeeChannel = txPhy->GetCurrentChannelNum();
+  double txW = ObservedPowerW(*sig, zigbeeChannel);
+  if (txW * ObservedGains(*sig, g_chan.observers)[0] >= 1e-3 * std::pow(10.0, g_chan.senseDbm / 10.0)) {
+    g_chan.busy[zigbeeChannel] += params->duration.GetSeconds();
+  }
+}
+
+/**
+ * \return busy fraction of the Zigbee channels overlapping the option plus the capacity penalty
+ */
+static double ChanScore(const ChannelOption& option, double span) {
+  double overlap = 0.0;
+  for (uint32_t z = 11; z <= 26; z++) {
+    if (std::abs(ZigbeeCenterMhz(z) - WifiCenterMhz(option.channel)) < option.width / 2.0 + 1.0) {
+      overlap += g_chan.busy[z] / span;
+    }
+  }
+  return overlap + g_chan.capacityWeight * (1.0 - double(option.width) / double(g_chan.maxWidth));
+}
+
+static void ChanSwitch(ChannelOption option) {
+  std::string settings =
+      "{" + std::to_string(option.channel) + ", " + std::to_string(option.width) + ", BAND_2_4GHZ, 0}";
+  for (const auto& phy : g_chan.phys) {
+    phy->SetAttribute("ChannelSettings", StringValue(settings));
+  }
+  g_chan.current = option;
+  g_chan.switching = false;
+  g_chan.switches++;
+  g_chan.lastSwitch = Simulator::Now().GetSeconds();
+  g_chan.awaitingRx = true;
+  g_chan.reassociated = 0;
+  std::ostringstream entry;
+  entry << option.channel << "/" << option.width << "@" << g_chan.lastSwitch;
+  g_chan.history.push_back(entry.str());
+  NS_LOG_INFO(Simulator::Now().As(Time::S) << " Wi-Fi switches to channel " << option.channel << " ("
+                                           << option.width << " MHz)");
+}
+
+static void ChanEvaluate() {
+  double now = Simulator::Now().GetSeconds();
+  double span = now - g_chan.intervalStart;
+  if (!g_chan.switching && span > 0.0) {
+    std::vector<ChannelOption> options;
+    for (uint32_t width = 20; width <= g_chan.maxWidth; width *= 2) {
+      // 40 MHz channels in 2.4 GHz are numbered by their center, 3..11
+      for (uint32_t ch = width == 20 ? 1 : 3; ch <= (width == 20 ? 13u : 11u); ch++) {
+        options.push_back({ch, width});
+      }
+    }
+    ChannelOption best = g_chan.current;
+    double bestScore = ChanScore(g_chan.current, span);
+    double currentScore = bestScore;
+    for (const auto& option : options) {
+      double score = ChanScore(option, span);
+      if (score < bestScore) {
+        best = option;
+        bestScore = score;
+      }
+    }
+    if (currentScore - bestScore > g_chan.hysteresis) {
+      g_chan.switching = true;
+      Simulator::Schedule(Seconds(g_chan.csaCount * c_beaconInterval), &ChanSwitch, best);
+    }
+  }
+  g_chan.busy.fill(0.0);
+  g_chan.intervalStart = now;
+  Simulator::Schedule(Seconds(g_chan.interval), &ChanEvaluate);
+}
+
+static void ChanApRx(Ptr<const Packet> p) {
+  if (g_chan.awaitingRx) {
+    g_chan.outageSeconds += Simulator::Now().GetSeconds() - g_chan.lastSwitch;
+    g_chan.awaitingRx = false;
+  }
+}
+
+static void ChanStaAssociated(Mac48Address bssid) {
+  if (g_chan.reassociated < g_chan.stas && ++g_chan.reassociated == g_chan.stas) {
+    g_chan.reassocSeconds += Simulator::Now().GetSeconds() - g_chan.lastSwitch;
+  }
+}
+
+static void SetupChannelManager(Ptr<SpectrumChannel> channel, Ptr<PropagationLossModel> loss,
+                                const NetDeviceContainer& apDev, const NetDeviceContainer& staDev,
+                                uint32_t wifiChannel, uint32_t width, bool staticAssoc) {
+  g_chan.current = {wifiChannel, width};
+  g_chan.maxWidth = width;
+  g_chan.apPhy = DynamicCast<WifiNetDevice>(apDev.Get(0))->GetPhy();
+  g_chan.observers = ObserverSet(loss, {g_chan.apPhy->GetMobility()});
+  for (uint32_t i = 0; i < apDev.GetN(); i++) {
+    g_chan.phys.push_back(DynamicCast<WifiNetDevice>(apDev.Get(i))->GetPhy());
+  }
+  for (uint32_t i = 0; i < staDev.GetN(); i++) {
+    Ptr<WifiNetDevice> dev = DynamicCast<WifiNetDevice>(staDev.Get(i));
+    g_chan.phys.push_back(dev->GetPhy());
+    if (!staticAssoc) {
+      dev->GetMac()->TraceConnectWithoutContext("Assoc", MakeCallback(&ChanStaAssociated));
+    }
+  }
+  g_chan.stas = staticAssoc ? 0 : staDev.GetN();
+  g_chan.reassociated = g_chan.stas;
+  g_chan.apPhy->TraceConnectWithoutContext("PhyRxEnd", MakeCallback(&ChanApRx));
+  channel->TraceConnectWithoutContext("TxSigParams", MakeCallback(&ChanTxSignal));
+  Simulator::Schedule(Seconds(g_chan.interval), &ChanEvaluate);
+}
+
+static void PrintChannelManager() {
+  NS_LOG_UNCOND("=== Wi-Fi channel manager ===");
+  std::ostringstream history;
+  for (const auto& h : g_chan.history) {
+    history << " " << h;
+  }
+  NS_LOG_UNCOND("  switches = " << g_chan.switches << " (channel/width@time:" << history.str() << ")");
+  NS_LOG_UNCOND("  final channel = " << g_chan.current.channel << " (" << g_chan.current.width << " MHz)");
+  NS_LOG_UNCOND("  switch cost: AP receive outage = " << std::fixed << std::setprecision(3) << g_chan.outageSeconds
+                                                      << " s, STA re-association = " << g_chan.reassocSeconds << " s"
+                                                      << std::defaultfloat);
+  AddResult("chan.switches", g_chan.switches);
+  AddResult("chan.finalChannel", g_chan.current.channel);
+  AddResult("chan.finalWidth", g_chan.current.width);
+  AddResult("chan.outageSeconds", g_chan.outageSeconds);
+  AddResult("chan.reassocSeconds", g_chan.reassocSeconds);
+}
+
+// Wi-Fi transmit power control (--tpc=link). Every link is given the lowest
+// power at which its mean received power still reaches the SNR of
+// tpcTargetMcs plus tpcMarginDb over the thermal noise of the channel width
+// (noise figure 7 dB, the WifiPhy default), between tpcMinDbm and the PHY's
+// default maximum. A STA only talks to its AP, so its power is that of its
+// own link. MinstrelHt has no per-station power level, so an AP uses the
+// power of its weakest link. With --tpc=measure the powers stay at their
+// default and only the interference is reported, as the baseline.
+// The interference delivered to a Zigbee receiver is the mean Wi-Fi power in
+// its channel over the run, from the mean path loss as for the probes.
+static const std::array<double, 8> c_htMcsSnrDb{2.0, 5.0, 9.0, 11.0, 15.0, 18.0, 20.0, 25.0};
+
+struct TpcState {
+  std::string mode;
+  uint32_t targetMcs = 7;
+  double marginDb = 6.0;
+  double minDbm = 0.0;
+  double maxDbm = 16.0206; // WifiPhy TxPowerStart/End default
+  std::map<uint32_t, double> txDbm; // by Wi-Fi node id
+  // Interference at the Zigbee receivers
+  Ptr<PropagationLossModel> loss;
+  std::vector<Ptr<LrWpanPhy>> zigbeePhys;
+  std::vector<uint32_t> zigbeeNodes;
+  std::vector<double> energy; // W s per Zigbee receiver
+  uint32_t observers = 0;     // ObserverSet of zigbeePhys
+};
+static TpcState g_tpc;
+
+static void TpcTxSignal(Ptr<SpectrumSignalParameters> params) {
+  ObservedSignal* sig = DynamicCast<WifiSpectrumSignalParameters>(params) ? ObserveSignal(params) : nullptr;
+  if (!sig) {
+    return;
+  }
+  const std::vector<double>& gains = ObservedGains(*sig, g_tpc.observers);
+  double duration = params->duration.GetSeconds();
+  for (size_t i = 0; i < g_tpc.zigbeePhys.size(); i++) {
+    double txW = ObservedPowerW(*sig, g_tpc.zigbeePhys[i]->GetCurrentChannelNum());
+    g_tpc.energy[i] += txW * gains[i] * duration;
+  }
+}
+
+/**
+ * Lowest power (dBm) at which rx still sees tx at the target MCS.
+ */
+static double TpcLinkPower(Ptr<WifiPhy> tx, Ptr<WifiPhy> rx, uint32_t width) {
+  double noiseDbm = -174.0 + 10.0 * std::log10(width * 1e6) + 7.0;
+  double neededDbm = noiseDbm + c_htMcsSnrDb[g_tpc.targetMcs] + g_tpc.marginDb;
+  double gainDb = g_tpc.loss->CalcRxPower(0.0, tx->GetMobility(), rx->GetMobility());
+  return std::clamp(neededDbm - gainDb, g_tpc.minDbm, g_tpc.maxDbm);
+}
+
+static void TpcSetPower(Ptr<WifiPhy> phy, double dbm) {
+  phy->SetTxPowerStart(dbm);
+  phy->SetTxPowerEnd(dbm);
+  phy->SetNTxPower(1);
+}
+
+static void SetupTpc(Ptr<SpectrumChannel> channel, Ptr<PropagationLossModel> loss, const NetDeviceContainer& apDev,
+                     const NetDeviceContainer& staDev, const NetDeviceContainer& lrwpanDevices, uint32_t width) {
+  g_tpc.loss = loss;
+  if (g_tpc.mode == "link" && apDev.GetN() > 0) {
+    std::map<uint32_t, double> apDbm;
+    for (uint32_t i = 0; i < staDev.GetN(); i++) {
+      Ptr<WifiPhy> sta = DynamicCast<WifiNetDevice>(staDev.Get(i))->GetPhy();
+      // The AP a STA associates with is not known up front: take the strongest
+      uint32_t best = 0;
+      double bestDbm = g_tpc.maxDbm + 1.0;
+      for (uint32_t a = 0; a < apDev.GetN(); a++) {
+        double dbm = TpcLinkPower(sta, DynamicCast<WifiNetDevice>(apDev.Get(a))->GetPhy(), width);
+        if (dbm < bestDbm) {
+          best = a;
+          bestDbm = dbm;
+        }
+      }
+      TpcSetPower(sta, bestDbm);
+      g_tpc.txDbm[staDev.Get(i)->GetNode()->GetId()] = bestDbm;
+      apDbm[best] = std::max(apDbm.count(best) ? apDbm[best] : g_tpc.minDbm, bestDbm);
+    }
+    for (uint32_t a = 0; a < apDev.GetN(); a++) {
+      double dbm = apDbm.count(a) ? apDbm[a] : g_tpc.maxDbm;
+      TpcSetPower(DynamicCast<WifiNetDevice>(apDev.Get(a))->GetPhy(), dbm);
+      g_tpc.txDbm[apDev.Get(a)->GetNode()->GetId()] = dbm;
+    }
+  }
+  for (uint32_t i = 0; i < lrwpanDevices.GetN(); i++) {
+    g_tpc.zigbeePhys.push_back(DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(i))->GetPhy());
+    g_tpc.zigbeeNodes.push_back(lrwpanDevices.Get(i)->GetNode()->GetId());
+  }
+  g_tpc.energy.assign(g_tpc.zigbeePhys.size(), 0.0);
+  std::vector<Ptr<MobilityModel>> receivers;
+  for (const auto& phy : g_tpc.zigbeePhys) {
+    receivers.push_back(phy->GetMobility());
+  }
+  g_tpc.observers = ObserverSet(loss, receivers);
+  channel->TraceConnectWithoutContext("TxSigParams", MakeCallback(&TpcTxSignal));
+}
+
+static void PrintTpc() {
+  double span = Simulator::Now().GetSeconds();
+  NS_LOG_UNCOND("=== Wi-Fi transmit power (" << g_tpc.mode << ") ===");
+  for (const auto& kv : g_tpc.txDbm) {
+    NS_LOG_UNCOND("  node " << kv.first << " tx = " << std::fixed << std::setprecision(1) << kv.second << " dBm"
+                            << std::defaultfloat);
+    AddResult("tpc.node." + std::to_string(kv.first) + ".txDbm", kv.second);
+  }
+  NS_LOG_UNCOND("NodeId | Mean Wi-Fi interference (dBm)");
+  double sumW = 0.0;
+  for (size_t i = 0; i < g_tpc.zigbeePhys.size(); i++) {
+    double meanW = span > 0.0 ? g_tpc.energy[i] / span : 0.0;
+    double dbm = meanW > 0.0 ? 10.0 * std::log10(meanW * 1e3) : -200.0;
+    uint32_t id = g_tpc.zigbeeNodes[i];
+    NS_LOG_UNCOND(std::setw(6) << id << " | " << std::fixed << std::setprecision(1) << std::setw(8) << dbm
+                               << std::defaultfloat);
+    AddResult("tpc.node." + std::to_string(id) + ".interferenceDbm", dbm);
+    sumW += meanW;
+  }
+  double meanW = g_tpc.zigbeePhys.empty() ? 0.0 : sumW / double(g_tpc.zigbeePhys.size());
+  AddResult("tpc.interferenceMeanDbm", meanW > 0.0 ? 10.0 * std::log10(meanW * 1e3) : -200.0);
+}
+
+// Zigbee link-margin power control (--zigbeePower=link). Every directed link
+// keeps its own transmit power in whole dBm between zpMinDbm and zpMaxDbm.
+// The receiver's LQI of each frame on the link (the m_linkQuality the NWK
+// layer sees, taken per hop from the MCPS-DATA.indication) is averaged; the
+// ACK outcome of each frame comes back to the sender through MacSentPkt and
+// MacTxDrop. A frame acknowledged at the first attempt over a link whose LQI
+// is above zpLqiHigh lowers the power by one step; a retry or an LQI below
+// zpLqiLow raises it by one step, a drop goes back to zpMaxDbm. The MAC keeps
+// no per-destination power, so the scenario mirrors each MAC's transmit queue
+// and sets the PHY power (phyTransmitPower) whenever the MAC starts CSMA/CA
+// for the head frame. Broadcasts go out at zpMaxDbm, ACKs at the current
+// power.
+// With --zigbeePower=measure every device stays at zpMaxDbm (the baseline).
+// Both modes report the footprint of each frame: the number of other Zigbee
+// nodes that receive it above the sensitivity from the mean path loss, i.e.
+// how many nodes it keeps from reusing the channel.
+static const double c_lrwpanSensitivityDbm = -106.58;
+
+struct ZigbeeLinkPower {
+  int32_t dbm = 0;
+  double lqi = -1.0; // moving average, -1 = no frame yet
+  uint64_t frames = 0;
+  uint64_t lowered = 0;
+  uint64_t raised = 0;
+};
+
+struct ZigbeePowerState {
+  std::string mode;
+  int32_t minDbm = -20;
+  int32_t maxDbm = 0;
+  double lqiLow = 180.0;
+  double lqiHigh = 230.0;
+  std::map<uint32_t, Ptr<LrWpanNetDevice>> devices; // by node id
+  std::map<uint32_t, int32_t> phyDbm;                // current PHY power by node id
+  std::map<std::pair<uint32_t, uint32_t>, ZigbeeLinkPower> links;
+  std::map<uint32_t, std::deque<std::pair<uint64_t, uint32_t>>> queues; // node -> (packet uid, destination)
+  // Footprint
+  std::vector<Ptr<LrWpanPhy>> phys;
+  uint32_t observers = 0; // ObserverSet of phys
+  uint64_t frames = 0;
+  uint64_t heard = 0;
+  double dbmSum = 0.0;
+};
+static ZigbeePowerState g_zpower;
+
+static uint32_t ZpowerNode(Mac16Address shortAddr) {
+  for (const auto& kv : g_zpower.devices) {
+    if (kv.second->GetMac()->GetShortAddress() == shortAddr) {
+      return kv.first;
+    }
+  }
+  return UINT32_MAX;
+}
+
+static void ZpowerApply(uint32_t node, int32_t dbm) {
+  if (g_zpower.phyDbm.count(node) && g_zpower.phyDbm[node] == dbm) {
+    return;
+  }
+  g_zpower.phyDbm[node] = dbm;
+  Ptr<PhyPibAttributes> attr = Create<PhyPibAttributes>();
+  attr->phyTransmitPower = uint8_t(dbm) & 0x3F; // 6 bit two's complement, no tolerance bits
+  g_zpower.devices[node]->GetPhy()->PlmeSetAttributeRequest(phyTransmitPower, attr);
+}
+
+static ZigbeeLinkPower& ZpowerLink(uint32_t from, uint32_t to) {
+  auto it = g_zpower.links.find({from, to});
+  if (it == g_zpower.links.end()) {
+    it = g_zpower.links.emplace(std::make_pair(from, to), ZigbeeLinkPower()).first;
+    it->second.dbm = g_zpower.maxDbm;
+  }
+  return it->second;
+}
+
+static void ZpowerMacTxEnqueue(uint32_t node, Ptr<const Packet> p) {
+  LrWpanMacHeader hdr;
+  p->PeekHeader(hdr);
+  uint32_t dst = UINT32_MAX;
+  if (hdr.GetDstAddrMode() == LrWpanMacHeader::SHORTADDR && hdr.GetShortDstAddr() != Mac16Address("ff:ff")) {
+    dst = ZpowerNode(hdr.GetShortDstAddr());
+  }
+  g_zpower.queues[node].emplace_back(p->GetUid(), dst);
+}
+
+static void ZpowerMacState(uint32_t node, MacState oldState, MacState newState) {
+  auto& queue = g_zpower.queues[node];
+  if (newState == MAC_CSMA && !queue.empty()) {
+    uint32_t dst = queue.front().second;
+    ZpowerApply(node, dst == UINT32_MAX ? g_zpower.maxDbm : ZpowerLink(node, dst).dbm);
+  }
+}
+
+/**
+ * ACK outcome of a frame: retries, or -1 if it was dropped.
+ */
+static void ZpowerOutcome(uint32_t node, Ptr<const Packet> p, int32_t retries) {
+  auto& queue = g_zpower.queues[node];
+  auto it = std::find_if(queue.begin(), queue.end(), [&](const auto& e) { return e.first == p->GetUid(); });
+  if (it == queue.end()) {
+    return;
+  }
+  uint32_t dst = it->second;
+  queue.erase(it);
+  if (dst == UINT32_MAX) {
+    return;
+  }
+  ZigbeeLinkPower& link = ZpowerLink(node, dst);
+  link.frames++;
+  int32_t before = link.dbm;
+  if (retries < 0) {
+    link.dbm = g_zpower.maxDbm;
+  } else if (retries > 0 || (link.lqi >= 0.0 && link.lqi < g_zpower.lqiLow)) {
+    link.dbm = std::min(link.dbm + 1, g_zpower.maxDbm);
+  } else if (link.lqi > g_zpower.lqiHigh) {
+    link.dbm = std::max(link.dbm - 1, g_zpower.minDbm);
+  }
+  link.raised += link.dbm > before ? 1 : 0;
+  link.lowered += link.dbm < before ? 1 : 0;
+}
+
+static void ZpowerSentPkt(uint32_t node, Ptr<const Packet> p, uint8_t retries, uint8_t csmaBackoffs) {
+  ZpowerOutcome(node, p, retries);
+}
+
+static void ZpowerTxDrop(uint32_t node, Ptr<const Packet> p) {
+  ZpowerOutcome(node, p, -1);
+}
+
+/**
+ * Per hop LQI of a frame received by node (see MacDataIndication()).
+ */
+static void ZpowerLinkQuality(uint32_t node, const McpsDataIndicationParams& params) {
+  uint32_t from = ZpowerNode(params.m_srcAddr);
+  if (from != UINT32_MAX) {
+    ZigbeeLinkPower& link = ZpowerLink(from, node);
+    double lqi = params.m_mpduLinkQuality;
+    link.lqi = link.lqi < 0.0 ? lqi : 0.8 * link.lqi + 0.2 * lqi;
+  }
+}
+
+static void ZpowerTxSignal(Ptr<SpectrumSignalParameters> params) {
+  Ptr<LrWpanPhy> txPhy = DynamicCast<LrWpanPhy>(params->txPhy);
+  ObservedSignal* sig = txPhy ? ObserveSignal(params) : nullptr;
+  if (!sig) {
+    return;
+  }
+  const std::vector<double>& gains = ObservedGains(*sig, g_zpower.observers);
+  double txW = ObservedPowerW(*sig, txPhy->GetCurrentChannelNum());
+  double sensitivityW = 1e-3 * std::pow(10.0, c_lrwpanSensitivityDbm / 10.0);
+  g_zpower.frames++;
+  g_zpower.dbmSum += 10.0 * std::log10(txW * 1e3);
+  for (size_t i = 0; i < g_zpower.phys.size(); i++) {
+    // The intended receiver is counted too; it is the same for both modes
+    if (g_zpower.phys[i] != txPhy && txW * gains[i] >= sensitivityW) {
+      g_zpower.heard++;
+    }
+  }
+}
+
+static void SetupZigbeePower(Ptr<SpectrumChannel> channel, Ptr<PropagationLossModel> loss,
+                             const NetDeviceContainer& lrwpanDevices) {
+  for (uint32_t i = 0; i < lrwpanDevices.GetN(); i++) {
+    Ptr<LrWpanNetDevice> dev = DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(i));
+    uint32_t node = dev->GetNode()->GetId();
+    g_zpower.devices[node] = dev;
+    g_zpower.phys.push_back(dev->GetPhy());
+    ZpowerApply(node, g_zpower.maxDbm);
+    if (g_zpower.mode != "link") {
+      continue;
+    }
+    Ptr<LrWpanMac> mac = dev->GetMac();
+    mac->TraceConnectWithoutContext("MacTxEnqueue", MakeBoundCallback(&ZpowerMacTxEnqueue, node));
+    mac->TraceConnectWithoutContext("MacStateValue", MakeBoundCallback(&ZpowerMacState, node));
+    mac->TraceConnectWithoutContext("MacSentPkt", MakeBoundCallback(&ZpowerSentPkt, node));
+    mac->TraceConnectWithoutContext("MacTxDrop", MakeBoundCallback(&ZpowerTxDrop, node));
+  }
+  std::vector<Ptr<MobilityModel>> receivers;
+  for (const auto& phy : g_zpower.phys) {
+    receivers.push_back(phy->GetMobility());
+  }
+  g_zpower.observers = ObserverSet(loss, receivers);
+  channel->TraceConnectWithoutContext("TxSigParams", MakeCallback(&ZpowerTxSignal));
+}
+
+static void PrintZigbeePower() {
+  NS_LOG_UNCOND("=== Zigbee transmit power (" << g_zpower.mode << ") ===");
+  if (g_zpower.mode == "link") {
+    NS_LOG_UNCOND("Link       | Frames | LQI   | Power(dBm) | Lowered | Raised");
+    for (const auto& kv : g_zpower.links) {
+      const ZigbeeLinkPower& link = kv.second;
+      if (link.frames == 0) {
+        continue;
+      }
+      NS_LOG_UNCOND(std::setw(3) << kv.first.first << " -> " << std::setw(3) << kv.first.second << " | "
+                                 << std::setw(6) << link.frames << " | " << std::fixed << std::setprecision(1)
+                                 << std::setw(5) << link.lqi << " | " << std::setw(10) << link.dbm << " | "
+                                 << std::setw(7) << link.lowered << " | " << std::setw(6) << link.raised
+                                 << std::defaultfloat);
+      AddResult("zpower.link." + std::to_string(kv.first.first) + "-" + std::to_string(kv.first.second) + ".dbm",
+                link.dbm);
+    }
+  }
+  double footprint = g_zpower.frames > 0 ? double(g_zpower.heard) / double(g_zpower.frames) : 0.0;
+  double meanDbm = g_zpower.frames > 0 ? g_zpower.dbmSum / double(g_zpower.frames) : 0.0;
+  NS_LOG_UNCOND("  frames = " << g_zpower.frames << ", mean power = " << std::fixed << std::setprecision(2) << meanDbm
+                              << " dBm, nodes reached per frame = " << footprint << std::defaultfloat);
+  AddResult("zpower.frames", g_zpower.frames);
+  AddResult("zpower.txDbmMean", meanDbm);
+  AddResult("zpower.footprint", footprint);
+}
+
+// Bounded NWK tables (--nwkTables). The stack keeps its neighbor, routing and
+// route discovery tables private and lets them grow, so the scenario models
+// every device's tables with the capacities of a small router and enforces
+// them where frames enter the NWK layer. The neighbor table learns the
+// source and LQI of every frame received (MCPS-DATA.indication). The routing
+// table holds one entry per destination that is not a neighbor, at the
+// originator and at every relay (MacTxEnqueue of a data frame whose NWK
+// destination is not the MAC destination). The route discovery table holds
+// every RREQ (broadcast NWK command) a device sends for
+// nwkcRouteDiscoveryTime. A full table evicts according to nwkEvict: lru
+// (least recently used), lqi (the neighbor with the lowest LQI, or the route
+// over it) or none (the new entry is refused). Evicting a neighbor also
+// evicts the routes through it. At the originator a refused route is a
+// table-full route failure and the frame is dropped; a route that was
+// evicted is rediscovered with an NLME-ROUTE-DISCOVERY.request, and the
+// frames to its destination wait for the confirm (at most
+// nwkcRouteDiscoveryTime, one discovery at a time). Relays cannot be stopped
+// from forwarding, so their refused and evicted routes are only counted.
+static const double c_routeDiscoveryTime = 10.0; // nwkcRouteDiscoveryTime (s)
+
+enum NwkTable { NWK_NEIGHBORS = 0, NWK_ROUTES, NWK_DISCOVERIES };
+
+enum RouteLookup { ROUTE_HIT, ROUTE_NEW, ROUTE_EVICTED, ROUTE_REFUSED };
+
+struct NwkTableEntry {
+  double used = 0.0;             // last use, or last frame heard from a neighbor
+  double lqi = -1.0;             // neighbors: moving average, -1 = unknown
+  uint32_t nextHop = UINT32_MAX; // routes: node id of the next hop
+};
+
+struct NwkPendingDiscovery {
+  uint32_t id = 0;
+  Mac16Address dst;
+  std::vector<std::vector<uint8_t>> frames;
+};
+
+struct NwkNodeTables {
+  std::map<uint32_t, NwkTableEntry> neighbors; // by node id
+  std::map<uint32_t, NwkTableEntry> routes;    // by destination node id
+  std::map<std::pair<uint32_t, uint8_t>, double> discoveries; // (RREQ source, NWK seq) -> expiry
+  std::set<uint32_t> evicted;                  // destinations whose route was evicted
+  std::deque<NwkPendingDiscovery> pending;     // rediscoveries, the front one in progress
+  std::array<size_t, 3> peak{0, 0, 0};
+};
+
+struct NwkTablesState {
+  bool enabled = false;
+  uint32_t neighborCap = 24;
+  uint32_t routeCap = 16;
+  uint32_t discoveryCap = 8;
+  std::string evict = "lru";
+  std::map<uint32_t, Ptr<ZigbeeStack>> stacks; // by node id
+  std::map<Mac16Address, uint32_t> byShort;
+  std::map<uint32_t, NwkNodeTables> nodes;
+  uint32_t nextDiscovery = 0;
+  std::array<uint64_t, 3> evictions{0, 0, 0};
+  std::array<uint64_t, 3> refused{0, 0, 0};
+  uint64_t routeFailures = 0; // frames dropped at the originator
+  uint64_t rediscoveries = 0;
+  uint64_t discoveryFailures = 0;
+  uint64_t relayMisses = 0;
+};
+static NwkTablesState g_nwkTables;
+
+static uint32_t NwkTablesNode(Mac16Address addr) {
+  auto it = g_nwkTables.byShort.find(addr);
+  if (it != g_nwkTables.byShort.end()) {
+    return it->second;
+  }
+  for (const auto& kv : g_nwkTables.stacks) {
+    if (kv.second->GetNwk()->GetNetworkAddress() == addr) {
+      g_nwkTables.byShort[addr] = kv.first;
+      return kv.first;
+    }
+  }
+  return UINT32_MAX;
+}
+
+static void NwkTablesPeak(NwkNodeTables& tables) {
+  tables.peak[NWK_NEIGHBORS] = std::max(tables.peak[NWK_NEIGHBORS], tables.neighbors.size());
+  tables.peak[NWK_ROUTES] = std::max(tables.peak[NWK_ROUTES], tables.routes.size());
+  tables.peak[NWK_DISCOVERIES] = std::max(tables.peak[NWK_DISCOVERIES], tables.discoveries.size());
+}
+
+static void NwkTablesPurge(NwkNodeTables& tables) {
+  double now = Simulator::Now().GetSeconds();
+  for (auto it = tables.discoveries.begin(); it != tables.discoveries.end();) {
+    it = it->second <= now ? tables.discoveries.erase(it) : std::next(it);
+  }
+}
+
+/**
+ * Make room for one more neighbor or route entry.
+ * \return false if the table is full and nothing may be evicted
+ */
+static bool NwkTablesMakeRoom(NwkNodeTables& tables, NwkTable t) {
+  auto& table = t == NWK_NEIGHBORS ? tables.neighbors : tables.routes;
+  if (table.size() < (t == NWK_NEIGHBORS ? g_nwkTables.neighborCap : g_nwkTables.routeCap)) {
+    return true;
+  }
+  if (g_nwkTables.evict == "none") {
+    g_nwkTables.refused[t]++;
+    return false;
+  }
+  auto score = [&](const NwkTableEntry& e) {
+    if (g_nwkTables.evict == "lru") {
+      return e.used;
+    }
+    if (t == NWK_NEIGHBORS) {
+      return e.lqi;
+    }
+    auto nb = tables.neighbors.find(e.nextHop);
+    return nb != tables.neighbors.end() ? nb->second.lqi : -1.0;
+  };
+  auto victim = std::min_element(table.begin(), table.end(),
+                                 [&](const auto& a, const auto& b) { return score(a.second) < score(b.second); });
+  uint32_t key = victim->first;
+  table.erase(victim);
+  g_nwkTables.evictions[t]++;
+  if (t == NWK_ROUTES) {
+    tables.evicted.insert(key);
+    return true;
+  }
+  for (auto it = tables.routes.begin(); it != tables.routes.end();) {
+    if (it->second.nextHop == key) {
+      tables.evicted.insert(it->first);
+      g_nwkTables.evictions[NWK_ROUTES]++;
+      it = tables.routes.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return true;
+}
+
+static RouteLookup NwkTablesRoute(NwkNodeTables& tables, uint32_t dst) {
+  double now = Simulator::Now().GetSeconds();
+  auto it = tables.routes.find(dst);
+  if (it != tables.routes.end()) {
+    it->second.used = now;
+    return ROUTE_HIT;
+  }
+  if (!NwkTablesMakeRoom(tables, NWK_ROUTES)) {
+    return ROUTE_REFUSED;
+  }
+  tables.routes[dst].used = now;
+  NwkTablesPeak(tables);
+  return tables.evicted.erase(dst) ? ROUTE_EVICTED : ROUTE_NEW;
+}
+
+static void NwkTablesDiscoveryDone(uint32_t node, uint32_t id, bool success);
+
+static void NwkTablesDiscover(uint32_t node) {
+  NwkNodeTables& tables = g_nwkTables.nodes[node];
+  if (tables.pending.empty()) {
+    return;
+  }
+  NlmeRouteDiscoveryRequestParams params;
+  params.m_dstAddrMode = UCST_BCST;
+  params.m_dstAddr = tables.pending.front().dst;
+  Simulator::ScheduleNow(&ZigbeeNwk::NlmeRouteDiscoveryRequest, g_nwkTables.stacks[node]->GetNwk(), params);
+  Simulator::Schedule(Seconds(c_routeDiscoveryTime), &NwkTablesDiscoveryDone, node, tables.pending.front().id,
+                      false);
+}
+
+/**
+ * End of the rediscovery id: its frames are sent, or dropped on failure.
+ */
+static void NwkTablesDiscoveryDone(uint32_t node, uint32_t id, bool success) {
+  NwkNodeTables& tables = g_nwkTables.nodes[node];
+  if (tables.pending.empty() || tables.pending.front().id != id) {
+    return;
+  }
+  NwkPendingDiscovery done = tables.pending.front();
+  tables.pending.pop_front();
+  if (success) {
+    for (const auto& buf : done.frames) {
+      NwkSendFrame(g_nwkTables.stacks[node], done.dst, buf);
+    }
+  } else {
+    uint32_t dst = NwkTablesNode(done.dst);
+    tables.routes.erase(dst);
+    tables.evicted.insert(dst);
+    g_nwkTables.discoveryFailures++;
+    g_nwkTables.routeFailures += done.frames.size();
+  }
+  NwkTablesDiscover(node);
+}
+
+static void NwkTablesDiscoveryConfirm(Ptr<ZigbeeStack> stack, NlmeRouteDiscoveryConfirmParams params) {
+  NwkRouteDiscoveryConfirm(stack, params);
+  uint32_t node = stack->GetNode()->GetId();
+  NwkNodeTables& tables = g_nwkTables.nodes[node];
+  if (!tables.pending.empty()) {
+    NwkTablesDiscoveryDone(node, tables.pending.front().id, params.m_status == NwkStatus::SUCCESS);
+  }
+}
+
+/**
+ * Originator side: whether a frame may go to the NWK layer now.
+ */
+static bool NwkTablesAdmit(Ptr<ZigbeeStack> stack, Mac16Address dst, const std::vector<uint8_t>& buf) {
+  if (!g_nwkTables.enabled) {
+    return true;
+  }
+  uint32_t node = stack->GetNode()->GetId();
+  uint32_t to = NwkTablesNode(dst);
+  if (to == UINT32_MAX) {
+    return true;
+  }
+  NwkNodeTables& tables = g_nwkTables.nodes[node];
+  auto nb = tables.neighbors.find(to);
+  if (nb != tables.neighbors.end()) {
+    nb->second.used = Simulator::Now().GetSeconds();
+    return true;
+  }
+  for (auto& pending : tables.pending) {
+    if (pending.dst == dst) {
+      pending.frames.push_back(buf);
+      return false;
+    }
+  }
+  if (!tables.routes.count(to) && tables.evicted.count(to)) {
+    // The rediscovery needs an entry of its own (counting those still waiting)
+    NwkTablesPurge(tables);
+    if (tables.discoveries.size() + tables.pending.size() >= g_nwkTables.discoveryCap) {
+      g_nwkTables.refused[NWK_DISCOVERIES]++;
+      g_nwkTables.routeFailures++;
+      return false;
+    }
+  }
+  RouteLookup lookup = NwkTablesRoute(tables, to);
+  if (lookup == ROUTE_REFUSED) {
+    g_nwkTables.routeFailures++;
+    return false;
+  }
+  if (lookup != ROUTE_EVICTED) {
+    return true;
+  }
+  g_nwkTables.rediscoveries++;
+  NwkPendingDiscovery pending;
+  pending.id = g_nwkTables.nextDiscovery++;
+  pending.dst = dst;
+  pending.frames.push_back(buf);
+  tables.pending.push_back(pending);
+  if (tables.pending.size() == 1) {
+    NwkTablesDiscover(node);
+  }
+  return false;
+}
+
+static void NwkTablesHeard(uint32_t node, const McpsDataIndicationParams& params) {
+  uint32_t from = params.m_srcAddrMode == SHORT_ADDR ? NwkTablesNode(params.m_srcAddr) : UINT32_MAX;
+  if (from == UINT32_MAX) {
+    return;
+  }
+  NwkNodeTables& tables = g_nwkTables.nodes[node];
+  auto it = tables.neighbors.find(from);
+  if (it == tables.neighbors.end()) {
+    if (!NwkTablesMakeRoom(tables, NWK_NEIGHBORS)) {
+      return;
+    }
+    it = tables.neighbors.emplace(from, NwkTableEntry()).first;
+    NwkTablesPeak(tables);
+  }
+  double lqi = params.m_mpduLinkQuality;
+  it->second.lqi = it->second.lqi < 0.0 ? lqi : 0.8 * it->second.lqi + 0.2 * lqi;
+  it->second.used = Simulator::Now().GetSeconds();
+}
+
+static void NwkTablesMacTxEnqueue(uint32_t node, Ptr<const Packet> p) {
+  Ptr<Packet> copy = p->Copy();
+  LrWpanMacHeader macHdr;
+  copy->RemoveHeader(macHdr);
+  if (!macHdr.IsData() || macHdr.GetDstAddrMode() != LrWpanMacHeader::SHORTADDR) {
+    return;
+  }
+  ZigbeeNwkHeader nwkHdr;
+  copy->RemoveHeader(nwkHdr);
+  NwkNodeTables& tables = g_nwkTables.nodes[node];
+  if (nwkHdr.GetFrameType() == NWK_COMMAND && macHdr.GetShortDstAddr() == Mac16Address("ff:ff")) {
+    NwkTablesPurge(tables);
+    auto key = std::make_pair(NwkTablesNode(nwkHdr.GetSrcAddr()), nwkHdr.GetSeqNum());
+    if (tables.discoveries.count(key)) {
+      return;
+    }
+    if (tables.discoveries.size() >= g_nwkTables.discoveryCap) {
+      g_nwkTables.refused[NWK_DISCOVERIES]++;
+      return;
+    }
+    tables.discoveries[key] = Simulator::Now().GetSeconds() + c_routeDiscoveryTime;
+    NwkTablesPeak(tables);
+    return;
+  }
+  uint32_t dst = NwkTablesNode(nwkHdr.GetDstAddr());
+  if (nwkHdr.GetFrameType() != DATA || nwkHdr.GetDstAddr() == macHdr.GetShortDstAddr() || dst == UINT32_MAX) {
+    return;
+  }
+  if (nwkHdr.GetSrcAddr() != g_nwkTables.stacks[node]->GetNwk()->GetNetworkAddress()) {
+    RouteLookup lookup = NwkTablesRoute(tables, dst);
+    g_nwkTables.relayMisses += lookup == ROUTE_EVICTED || lookup == ROUTE_REFUSED ? 1 : 0;
+  }
+  auto it = tables.routes.find(dst);
+  if (it != tables.routes.end()) {
+    it->second.nextHop = NwkTablesNode(macHdr.GetShortDstAddr());
+  }
+}
+
+static void SetupNwkTables(const NetDeviceContainer& lrwpanDevices) {
+  for (uint32_t k = 0; k < zigbeeStacks.GetN(); k++) {
+    Ptr<ZigbeeStack> stack = zigbeeStacks.Get(k);
+    g_nwkTables.stacks[stack->GetNode()->GetId()] = stack;
+    stack->GetNwk()->SetNlmeRouteDiscoveryConfirmCallback(MakeBoundCallback(&NwkTablesDiscoveryConfirm, stack));
+  }
+  for (uint32_t i = 0; i < lrwpanDevices.GetN(); i++) {
+    Ptr<LrWpanNetDevice> dev = DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(i));
+    dev->GetMac()->TraceConnectWithoutContext("MacTxEnqueue",
+                                              MakeBoundCallback(&NwkTablesMacTxEnqueue, dev->GetNode()->GetId()));
+  }
+}
+
+static void PrintNwkTables() {
+  static const char* c_names[3] = {"neighbor", "route", "discovery"};
+  const uint32_t caps[3] = {g_nwkTables.neighborCap, g_nwkTables.routeCap, g_nwkTables.discoveryCap};
+  NS_LOG_UNCOND("=== Bounded NWK tables (evict=" << g_nwkTables.evict << ") ===");
+  NS_LOG_UNCOND("Table     | Capacity | Peak | Full nodes | Evictions | Refused");
+  for (int t = 0; t < 3; t++) {
+    size_t peak = 0;
+    uint32_t full = 0;
+    for (const auto& kv : g_nwkTables.nodes) {
+      peak = std::max(peak, kv.second.peak[t]);
+      full += kv.second.peak[t] >= caps[t] ? 1 : 0;
+    }
+    NS_LOG_UNCOND(std::left << std::setw(9) << c_names[t] << std::right << " | " << std::setw(8) << caps[t] << " | "
+                            << std::setw(4) << peak << " | " << std::setw(10) << full << " | " << std::setw(9)
+                            << g_nwkTables.evictions[t] << " | " << std::setw(7) << g_nwkTables.refused[t]);
+    AddResult(std::string("nwkTables.") + c_names[t] + ".peak", peak);
+    AddResult(std::string("nwkTables.") + c_names[t] + ".fullNodes", full);
+    AddResult(std::string("nwkTables.") + c_names[t] + ".evictions", g_nwkTables.evictions[t]);
+    AddResult(std::string("nwkTables.") + c_names[t] + ".refused", g_nwkTables.refused[t]);
+  }
+  NS_LOG_UNCOND("  route failures (frames dropped) = "
+                << g_nwkTables.routeFailures << ", rediscoveries = " << g_nwkTables.rediscoveries << " ("
+                << g_nwkTables.discoveryFailures << " failed), relay misses = " << g_nwkTables.relayMisses);
+  AddResult("nwkTables.routeFailures", g_nwkTables.routeFailures);
+  AddResult("nwkTables.rediscoveries", g_nwkTables.rediscoveries);
+  AddResult("nwkTables.discoveryFailures", g_nwkTables.discoveryFailures);
+  AddResult("nwkTables.relayMisses", g_nwkTables.relayMisses);
+}
+
+/**
+ * Sits between the MAC and the NWK layer of every Zigbee device, for the
+ * features that need the per hop source and LQI of received frames.
+ */
+static void MacDataIndication(uint32_t node, Ptr<ZigbeeNwk> nwk, McpsDataIndicationParams params, Ptr<Packet> msdu) {
+  if (g_zpower.mode == "link") {
+    ZpowerLinkQuality(node, params);
+  }
+  if (g_nwkTables.enabled) {
+    NwkTablesHeard(node, params);
+  }
+  if (g_proc.enabled) {
+    ProcReceive(node, nwk, params, msdu);
+  } else {
+    nwk->McpsDataIndication(params, msdu);
+  }
+}
+
+static void HookMacIndications(const NetDeviceContainer& lrwpanDevices) {
+  std::map<uint32_t, Ptr<ZigbeeNwk>> nwks;
+  for (uint32_t k = 0; k < zigbeeStacks.GetN(); k++) {
+    nwks[zigbeeStacks.Get(k)->GetNode()->GetId()] = zigbeeStacks.Get(k)->GetNwk();
+  }
+  for (uint32_t i = 0; i < lrwpanDevices.GetN(); i++) {
+    Ptr<LrWpanNetDevice> dev = DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(i));
+    uint32_t node = dev->GetNode()->GetId();
+    // The stack connects the MAC to the NWK layer when it is initialized, at time zero
+    Simulator::Schedule(Seconds(0), &LrWpanMac::SetMcpsDataIndicationCallback, dev->GetMac(),
+                        McpsDataIndicationCallback(MakeBoundCallback(&MacDataIndication, node, nwks[node])));
+  }
+}
+
+// Interference-graph partitioning (--partition). Before the run, every pair
+// of radios is linked when the stronger direction, at mean log-distance loss
+// plus partitionMarginDb of fading headroom, reaches partitionThresholdDbm
+// (far below any receiver sensitivity, so the graph is conservative). Each
+// connected component is then simulated in its own fork()ed process with
+// the nodes of all other components kept silent, and the parent merges the
+// results; delay percentiles are recomputed from the pooled samples.
+// Components holding Zigbee routers without the coordinator, or STAs without
+// the AP, cannot carry traffic and stay silent as well.
+//
+// The partition processes are not independent sub-simulations: each still
+// builds the whole topology on the shared channel, only the foreign nodes do
+// not join, send or run their Wi-Fi PHY. The speedup is measured against
+// that, not against simulating the partition alone.
+static const double c_lrwpanTxPowerDbm = 0.0; // LR-WPAN PHY default phyTransmitPower
+
+struct PartitionState {
+  bool enabled = false;
+  double thresholdDbm = -110.0;
+  double marginDb = 10.0;
+  std::vector<uint32_t> component; // node id -> component
+  std::vector<bool> usable;        // component -> can carry traffic
+  uint32_t count = 0;
+  int32_t active = -1; // component simulated by this process, -1 = all
+  int pipeFd[2] = {-1, -1};
+};
+static PartitionState g_partition;
+static const uint32_t c_orphanComponent = UINT32_MAX;
+
+static bool NodeActive(uint32_t nodeId) {
+  if (nodeId >= g_partition.component.size()) {
+    return true;
+  }
+  uint32_t c = g_partition.component[nodeId];
+  if (c == c_orphanComponent) {
+    return false;
+  }
+  return g_partition.active < 0 || c == uint32_t(g_partition.active);
+}
+
+static uint32_t PartitionFind(std::vector<uint32_t>& parent, uint32_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+static void AnalyzeInterference(Ptr<PropagationLossModel> loss, Ptr<Node> coordinator, Ptr<Node> ap) {
+  struct Radio {
+    uint32_t node;
+    Ptr<MobilityModel> mobility;
+    double txDbm;
+    bool zigbee;
+  };
+  std::vector<Radio> radios;
+  for (uint32_t n = 0; n < NodeList::GetNNodes(); n++) {
+    Ptr<Node> node = NodeList::GetNode(n);
+    for (uint32_t d = 0; d < node->GetNDevices(); d++) {
+      if (Ptr<LrWpanNetDevice> lrwpan = DynamicCast<LrWpanNetDevice>(node->GetDevice(d))) {
+        radios.push_back({n, lrwpan->GetPhy()->GetMobility(), c_lrwpanTxPowerDbm, true});
+      } else if (Ptr<WifiNetDevice> wifi = DynamicCast<WifiNetDevice>(node->GetDevice(d))) {
+        radios.push_back({n, wifi->GetPhy()->GetMobility(), wifi->GetPhy()->GetTxPowerEnd(), false});
+      }
+    }
+  }
+
+  std::vector<uint32_t> parent(NodeList::GetNNodes());
+  for (uint32_t i = 0; i < parent.size(); i++) {
+    parent[i] = i;
+  }
+  uint32_t links = 0;
+  for (size_t a = 0; a < radios.size(); a++) {
+    for (size_t b = a + 1; b < radios.size(); b++) {
+      if (!radios[a].mobility || !radios[b].mobility) {
+        continue;
+      }
+      double rx = std::max(loss->CalcRxPower(radios[a].txDbm, radios[a].mobility, radios[b].mobility),
+                           loss->CalcRxPower(radios[b].txDbm, radios[b].mobility, radios[a].mobility));
+      if (rx + g_partition.marginDb >= g_partition.thresholdDbm) {
+        parent[PartitionFind(parent, radios[a].node)] = PartitionFind(parent, radios[b].node);
+        links++;
+      }
+    }
+  }
+
+  // Number the components of the nodes that have a radio
+  std::map<uint32_t, uint32_t> ids;
+  g_partition.component.assign(parent.size(), c_orphanComponent);
+  for (const auto& r : radios) {
+    uint32_t root = PartitionFind(parent, r.node);
+    if (!ids.count(root)) {
+      ids[root] = ids.size();
+    }
+    g_partition.component[r.node] = ids[root];
+  }
+  g_partition.count = ids.size();
+  g_partition.usable.assign(g_partition.count, false);
+  uint32_t coordinatorComponent = g_partition.component[coordinator->GetId()];
+  uint32_t apComponent = ap ? g_partition.component[ap->GetId()] : c_orphanComponent;
+
+  NS_LOG_UNCOND("=== Interference graph (threshold " << g_partition.thresholdDbm << " dBm, margin "
+                                                    << g_partition.marginDb << " dB) ===");
+  NS_LOG_UNCOND("  radios = " << radios.size() << ", links = " << links << ", partitions = " << g_partition.count);
+  for (uint32_t c = 0; c < g_partition.count; c++) {
+    uint32_t zigbee = 0;
+    uint32_t wifi = 0;
+    std::ostringstream nodes;
+    for (const auto& r : radios) {
+      if (g_partition.component[r.node] == c) {
+        (r.zigbee ? zigbee : wifi)++;
+        nodes << " " << r.node;
+      }
+    }
+    bool hasCoordinator = c == coordinatorComponent;
+    bool hasAp = ap && c == apComponent;
+    g_partition.usable[c] = hasCoordinator || hasAp;
+    NS_LOG_UNCOND("  partition " << c << ": " << zigbee << " Zigbee, " << wifi << " Wi-Fi"
+                                 << (hasCoordinator ? " [coordinator]" : "") << (hasAp ? " [AP]" : "")
+                                 << (g_partition.usable[c] ? "" : " [no coordinator/AP, silent]")
+                                 << " nodes:" << nodes.str());
+  }
+  // Zigbee routers cut off from the coordinator and STAs cut off from the AP are silent
+  for (const auto& r : radios) {
+    uint32_t c = g_partition.component[r.node];
+    if (c != c_orphanComponent && (r.zigbee ? c != coordinatorComponent : c != apComponent)) {
+      g_partition.component[r.node] = c_orphanComponent;
+    }
+  }
+  AddResult("partition.count", g_partition.count);
+  AddResult("partition.links", links);
+}
+
+// Result key prefix under which a partition process passes its delay
+// samples, c_partitionDelayChunk per line so that every write to the shared
+// pipe stays below PIPE_BUF and is not interleaved with another partition's
+static const std::string c_partitionDelayKey = "partition.delaySamples.";
+static const size_t c_partitionDelayChunk = 128;
+
+/**
+ * Fork one process per usable partition.
+ * \return true in the parent, which only waits for and merges the results
+ */
+static bool PartitionFork() {
+  NS_ABORT_MSG_IF(pipe(g_partition.pipeFd) != 0, "Unable to set up partitioned run");
+  std::cout.flush();
+  std::clog.flush();
+  std::vector<pid_t> children;
+  for (uint32_t c = 0; c < g_partition.count; c++) {
+    if (!g_partition.usable[c]) {
+      continue;
+    }
+    pid_t pid = fork();
+    NS_ABORT_MSG_IF(pid < 0, "fork() failed for partition " << c);
+    if (pid == 0) {
+      close(g_partition.pipeFd[0]);
+      g_partition.active = int32_t(c);
+      g_results.clear();
+      NS_LOG_UNCOND("=== Partition " << c << " (pid " << getpid() << ") ===");
+      return false;
+    }
+    children.push_back(pid);
+  }
+  close(g_partition.pipeFd[1]);
+  auto wallStart = std::chrono::steady_clock::now();
+
+  // Lines are "<partition> <key>=<value>"
+  std::map<uint32_t, std::map<std::string, std::string>> parts;
+  std::string buffer;
+  char chunk[4096];
+  ssize_t n;
+  while ((n = read(g_partition.pipeFd[0], chunk, sizeof(chunk))) > 0) {
+    buffer.append(chunk, n);
+  }
+  close(g_partition.pipeFd[0]);
+  for (pid_t pid : children) {
+    waitpid(pid, nullptr, 0);
+  }
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  std::istringstream lines(buffer);
+  std::string line;
+  while (std::getline(lines, line)) {
+    size_t space = line.find(' ');
+    size_t eq = line.find('=');
+    if (space != std::string::npos && eq != std::string::npos && eq > space) {
+      parts[std::stoul(line.substr(0, space))][line.substr(space + 1, eq - space - 1)] = line.substr(eq + 1);
+    }
+  }
 
-  double lqi = params.m_linkQuality; // 0..255
+  // Counters add up, ratios and delay percentiles are recomputed
+  const std::set<std::string> sums{"zigbee.sentPackets", "zigbee.recvPackets", "wifi.txPackets",
+                                   "wifi.rxPackets",     "wifi.throughputKbps", "sim.events"};
+  std::map<std::string, double> totals;
+  std::vector<double> delays;
+  double delaySum = 0.0;
+  double serialSeconds = 0.0;
+  for (const auto& part : parts) {
+    std::string k = std::to_string(part.first);
+    auto get = [&](const std::string& key) {
+      auto it = part.second.find(key);
+      return it != part.second.end() ? std::stod(it->second) : 0.0;
+    };
+    delaySum += get("zigbee.delayMean") * get("zigbee.recvPackets");
+    serialSeconds += get("sim.runWallSeconds");
+    for (const auto& kv : part.second) {
+      const std::string& key = kv.first;
+      if (sums.count(key)) {
+        totals[key] += std::stod(kv.second);
+      } else if (key.rfind(c_partitionDelayKey, 0) == 0) {
+        std::istringstream samples(kv.second);
+        double d;
+        while (samples >> d) {
+          delays.push_back(d);
+        }
+      } else if (key == "zigbee.delayP50" || key == "zigbee.delayP99") {
+        // Recomputed below from the pooled samples
+      } else if (key.rfind("zigbee.node.", 0) == 0) {
+        AddResult(key, kv.second);
+      } else if (key.rfind("wifi.flow.", 0) == 0) {
+        AddResult("wifi.flow." + k + "-" + key.substr(10), kv.second);
+      } else if (key != "zigbee.pdr" && key != "wifi.pdr" && key != "zigbee.delayMean" &&
+                 key != "sim.runWallSeconds" && key.rfind("partition.", 0) != 0) {
+        AddResult("partition." + k + "." + key, kv.second);
+      }
+    }
+  }
+  for (const auto& kv : totals) {
+    AddResult(kv.first, kv.second);
+  }
+  double sent = totals["zigbee.sentPackets"];
+  double recv = totals["zigbee.recvPackets"];
+  AddResult("zigbee.pdr", sent > 0.0 ? recv / sent : 0.0);
+  AddResult("zigbee.delayMean", recv > 0.0 ? delaySum / recv : 0.0);
+  AddResult("zigbee.delayP50", Percentile(delays, 0.50));
+  AddResult("zigbee.delayP99", Percentile(delays, 0.99));
+  AddResult("wifi.pdr", totals["wifi.txPackets"] > 0.0 ? totals["wifi.rxPackets"] / totals["wifi.txPackets"] : 0.0);
+  AddResult("sim.runWallSeconds", wallSeconds);
+  NS_ABORT_MSG_IF(parts.size() != children.size(),
+                  "Only " << parts.size() << " of " << children.size() << " partitions reported results");
+  AddResult("partition.simulated", parts.size());
+  AddResult("partition.serialSeconds", serialSeconds);
+  AddResult("partition.speedup", wallSeconds > 0.0 ? serialSeconds / wallSeconds : 0.0);
 
-  auto& info = qosMap[destNodeId];
-  info.recvPackets += 1;
-  info.sumDelays += delay;
-  info.sumLqi += lqi;
+  NS_LOG_UNCOND("=== Partitioned run ===");
+  NS_LOG_UNCOND("  partitions    = " << g_partition.count << " (" << parts.size() << " simulated)");
+  NS_LOG_UNCOND("  note          = every partition process builds the full topology, foreign nodes silenced");
+  NS_LOG_UNCOND("  zigbee pdr    = " << std::fixed << std::setprecision(4) << (sent > 0.0 ? recv / sent : 0.0));
+  NS_LOG_UNCOND("  wifi kbps     = " << std::setprecision(2) << totals["wifi.throughputKbps"]);
+  NS_LOG_UNCOND("  wall          = " << std::setprecision(2) << wallSeconds << " s (sum of partitions "
+                                     << serialSeconds << " s, speedup "
+                                     << (wallSeconds > 0.0 ? serialSeconds / wallSeconds : 0.0) << "x)"
+                                     << std::defaultfloat);
+  return true;
+}
 
-  NS_LOG_DEBUG(Simulator::Now().GetSeconds()
-               << "s Node" << stack->GetNode()->GetId() << " <- Node" << srcNodeId << " [seq=" << seqNo << "]"
-               << "  delay=" << std::fixed << std::setprecision(3) << delay << "s"
-               << "  LQI=" << lqi << "  totalRecv=" << info.recvPackets);
+/**
+ * In a partition process: hand the results to the parent and exit.
+ */
+static void PartitionCollect() {
+  for (size_t i = 0; i < g_delays.size(); i += c_partitionDelayChunk) {
+    std::ostringstream delays;
+    delays << std::setprecision(17);
+    for (size_t j = i; j < std::min(g_delays.size(), i + c_partitionDelayChunk); j++) {
+      delays << g_delays[j] << " ";
+    }
+    g_results.emplace_back(c_partitionDelayKey + std::to_string(i / c_partitionDelayChunk), delays.str());
+  }
+  for (const auto& kv : g_results) {
+    std::string line = std::to_string(g_partition.active) + " " + kv.first + "=" + kv.second + "\n";
+    NS_ABORT_MSG_IF(write(g_partition.pipeFd[1], line.data(), line.size()) != ssize_t(line.size()),
+                    "Unable to report partition results");
+  }
+  close(g_partition.pipeFd[1]);
+  std::cout.flush();
+  std::clog.flush();
+  _exit(0);
 }
 
 static void PrintWifiFlowStats(FlowMonitorHelper& flowHelper, Ptr<FlowMonitor> flowMonitor) {
@@ -248,6 +3564,9 @@ static void PrintWifiFlowStats(FlowMonitorHelper& flowHelper, Ptr<FlowMonitor> f
   NS_LOG_UNCOND("-----------------------------------------------------------------------------------------------");
 
   // 5) Loop over each flow and print metrics
+  uint64_t totalTx = 0;
+  uint64_t totalRx = 0;
+  double totalThroughput = 0.0;
   for (auto& flow : stats) {
     FlowId flowId = flow.first;
     const FlowMonitor::FlowStats& fs = flow.second;
@@ -277,8 +3596,19 @@ static void PrintWifiFlowStats(FlowMonitorHelper& flowHelper, Ptr<FlowMonitor> f
                                << rxPackets << " | " << std::fixed << std::setprecision(2) << std::setw(5) << pdr
                                << " | " << std::setw(8) << lostPackets << " | " << std::fixed << std::setprecision(2)
                                << std::setw(14) << throughput);
+
+    AddResult("wifi.flow." + std::to_string(flowId) + ".pdr", pdr);
+    AddResult("wifi.flow." + std::to_string(flowId) + ".throughputKbps", throughput);
+    totalTx += txPackets;
+    totalRx += rxPackets;
+    totalThroughput += throughput;
   }
   NS_LOG_UNCOND("-----------------------------------------------------------------------------------------------");
+
+  AddResult("wifi.txPackets", totalTx);
+  AddResult("wifi.rxPackets", totalRx);
+  AddResult("wifi.pdr", totalTx > 0 ? double(totalRx) / double(totalTx) : 0.0);
+  AddResult("wifi.throughputKbps", totalThroughput);
 }
 
 static void PrintZigbeeQoS() {
@@ -288,6 +3618,9 @@ static void PrintZigbeeQoS() {
   NS_LOG_UNCOND("NodeId | SentPkts | RecvPkts |  PDR   | AvgDelay(s) | AvgLQI");
   NS_LOG_UNCOND("-------------------------------------------------------------");
 
+  uint32_t totalSent = 0;
+  uint32_t totalRecv = 0;
+  double totalDelays = 0.0;
   for (auto& kv : qosMap) {
     uint32_t nid = kv.first;
     const QoSInfo& info = kv.second;
@@ -310,7 +3643,536 @@ static void PrintZigbeeQoS() {
                                << std::fixed << std::setprecision(2) << std::setw(5) << pdr << " | " << std::fixed
                                << std::setprecision(3) << std::setw(11) << avgDelay << " | " << std::fixed
                                << std::setprecision(1) << std::setw(6) << avgLqi);
+
+    AddResult("zigbee.node." + std::to_string(nid) + ".pdr", pdr);
+    AddResult("zigbee.node." + std::to_string(nid) + ".delayMean", avgDelay);
+    totalSent += sent;
+    totalRecv += recv;
+    totalDelays += info.sumDelays;
+  }
+
+  AddResult("zigbee.sentPackets", totalSent);
+  AddResult("zigbee.recvPackets", totalRecv);
+  AddResult("zigbee.pdr", totalSent > 0 ? double(totalRecv) / double(totalSent) : 0.0);
+  AddResult("zigbee.delayMean", totalRecv > 0 ? totalDelays / double(totalRecv) : 0.0);
+  AddResult("zigbee.delayP50", Percentile(g_delays, 0.50));
+  AddResult("zigbee.delayP99", Percentile(g_delays, 0.99));
+  NS_LOG_UNCOND("Delay percentiles: p50=" << std::setprecision(4) << Percentile(g_delays, 0.50)
+                                          << "s p99=" << Percentile(g_delays, 0.99) << "s");
+
+  // Goodput and Jain's fairness index over the heartbeat flows
+  double span = g_scenario.windowStart >= 0.0 ? g_scenario.windowStop - g_scenario.windowStart
+                                              : g_heartbeatFlows.stop - g_heartbeatFlows.start;
+  double sum = 0.0;
+  double sumSquares = 0.0;
+  for (const auto& kv : g_heartbeatFlows.bytes) {
+    sum += double(kv.second);
+    sumSquares += double(kv.second) * double(kv.second);
+  }
+  double goodputKbps = span > 0.0 ? sum * 8.0 / span / 1000.0 : 0.0;
+  double fairness = sumSquares > 0.0 ? sum * sum / (double(g_heartbeatFlows.bytes.size()) * sumSquares) : 0.0;
+  NS_LOG_UNCOND("Goodput: " << std::setprecision(3) << goodputKbps << " kbps over " << g_heartbeatFlows.bytes.size()
+                            << " flows, fairness=" << fairness << std::defaultfloat);
+  NS_LOG_UNCOND("MAC: " << g_macSent << " frames sent, " << g_macRetries << " retries, " << g_macBackoffs
+                        << " CSMA backoffs, " << g_macDrops << " dropped");
+  AddResult("zigbee.macRetries", g_macRetries);
+  AddResult("zigbee.macBackoffs", g_macBackoffs);
+  AddResult("zigbee.macDrops", g_macDrops);
+  AddResult("zigbee.goodputKbps", goodputKbps);
+  AddResult("zigbee.fairness", fairness);
+}
+
+static void PrintAdaptiveRate() {
+  NS_LOG_UNCOND("=== Adaptive heartbeat rate (" << g_adaptive.flows.size() << " flows) ===");
+  NS_LOG_UNCOND("Flow | Src -> Dst | Sent | Decreases | MeanInterval(s) | FinalInterval(s)");
+  double intervalSum = 0.0;
+  uint64_t sent = 0;
+  uint64_t decreases = 0;
+  for (uint32_t i = 0; i < g_adaptive.flows.size(); i++) {
+    const AdaptiveFlow& f = g_adaptive.flows[i];
+    double mean = f.sent > 0 ? f.intervalSum / double(f.sent) : 0.0;
+    NS_LOG_UNCOND(std::setw(4) << i << " | " << std::setw(3) << f.src->GetNode()->GetId() << " -> " << std::setw(3)
+                               << f.dst->GetNode()->GetId() << " | " << std::setw(4) << f.sent << " | "
+                               << std::setw(9) << f.decreases << " | " << std::fixed << std::setprecision(3)
+                               << std::setw(15) << mean << " | " << std::setw(16) << 1.0 / f.rate
+                               << std::defaultfloat);
+    intervalSum += f.intervalSum;
+    sent += f.sent;
+    decreases += f.decreases;
+  }
+  NS_LOG_UNCOND("Congestion signals: delay=" << g_adaptive.delaySignals << " macDrop=" << g_adaptive.macSignals
+                                             << " loss=" << g_adaptive.lossSignals);
+  AddResult("adaptive.sent", sent);
+  AddResult("adaptive.decreases", decreases);
+  AddResult("adaptive.meanInterval", sent > 0 ? intervalSum / double(sent) : 0.0);
+  AddResult("adaptive.delaySignals", g_adaptive.delaySignals);
+  AddResult("adaptive.macDropSignals", g_adaptive.macSignals);
+  AddResult("adaptive.lossSignals", g_adaptive.lossSignals);
+}
+
+static void RampSetRate(ApplicationContainer apps, std::string rate) {
+  NS_LOG_INFO(Simulator::Now().As(Time::S) << " | Load ramp: Wi-Fi DataRate " << rate);
+  for (uint32_t i = 0; i < apps.GetN(); i++) {
+    apps.Get(i)->SetAttribute("DataRate", DataRateValue(DataRate(rate)));
+  }
+}
+
+static void RampSnapshot(Ptr<FlowMonitor> flowMonitor, RampPhase* phase, int edge) {
+  for (const auto& flow : flowMonitor->GetFlowStats()) {
+    phase->wifiTx[edge] += flow.second.txPackets;
+    phase->wifiRx[edge] += flow.second.rxPackets;
+    phase->wifiRxBytes[edge] += flow.second.rxBytes;
+  }
+}
+
+static void PrintLoadRamp() {
+  NS_LOG_UNCOND("=== Load ramp (settle " << g_ramp.settle << "s, window " << g_ramp.window << "s) ===");
+  NS_LOG_UNCOND("Phase | DataRate   | WiFi Kbps  | WiFi PDR | ZB Sent | ZB Recv | ZB PDR | p50(s) | p99(s)");
+  NS_LOG_UNCOND("-------------------------------------------------------------------------------------");
+  for (uint32_t k = 0; k < g_ramp.phases.size(); k++) {
+    const RampPhase& phase = g_ramp.phases[k];
+    uint64_t tx = phase.wifiTx[1] - phase.wifiTx[0];
+    uint64_t rx = phase.wifiRx[1] - phase.wifiRx[0];
+    double throughput = (phase.wifiRxBytes[1] - phase.wifiRxBytes[0]) * 8.0 / (1000.0 * g_ramp.window);
+    double wifiPdr = tx > 0 ? std::min(1.0, double(rx) / double(tx)) : 0.0;
+    double zigbeePdr = phase.zigbeeSent > 0 ? double(phase.zigbeeRecv) / double(phase.zigbeeSent) : 0.0;
+    double p50 = Percentile(phase.delays, 0.50);
+    double p99 = Percentile(phase.delays, 0.99);
+
+    NS_LOG_UNCOND(std::setw(5) << k << " | " << std::setw(10) << phase.rate << " | " << std::fixed
+                               << std::setprecision(2) << std::setw(10) << throughput << " | " << std::setw(8)
+                               << wifiPdr << " | " << std::setw(7) << phase.zigbeeSent << " | " << std::setw(7)
+                               << phase.zigbeeRecv << " | " << std::setw(6) << zigbeePdr << " | "
+                               << std::setprecision(4) << std::setw(6) << p50 << " | " << std::setw(6) << p99);
+
+    std::string prefix = "ramp." + std::to_string(k) + ".";
+    AddResult(prefix + "wifiDataRate", phase.rate);
+    AddResult(prefix + "wifi.throughputKbps", throughput);
+    AddResult(prefix + "wifi.pdr", wifiPdr);
+    AddResult(prefix + "zigbee.sentPackets", phase.zigbeeSent);
+    AddResult(prefix + "zigbee.recvPackets", phase.zigbeeRecv);
+    AddResult(prefix + "zigbee.pdr", zigbeePdr);
+    AddResult(prefix + "zigbee.delayP50", p50);
+    AddResult(prefix + "zigbee.delayP99", p99);
+  }
+  NS_LOG_UNCOND("-------------------------------------------------------------------------------------");
+}
+
+// Event profiler (--profileEvents). Every executed event is attributed to the
+// type that owns its callback, taken from the dynamic type of the EventImpl:
+// member function events name their class, free function events (the
+// scenario functions of this file, such as SendDataPeriod) only their
+// signature. The wall time of an event is measured from its removal from the
+// scheduler to the next removal, so it includes the simulator's own
+// bookkeeping and the profiler's clock reads.
+struct EventGroup {
+  std::string key;
+  std::string label;
+  std::vector<std::string> owners; // substrings of the owning class name
+};
+
+static const std::vector<EventGroup> c_eventGroups{
+    {"spectrum", "Spectrum channel", {"SpectrumChannel", "SpectrumPropagation"}},
+    {"wifiPhy",
+     "Wi-Fi PHY",
+     {"WifiPhy", "PhyEntity", "HtPhy", "OfdmPhy", "DsssPhy", "ErpOfdmPhy", "InterferenceHelper",
+      "WifiSpectrumPhyInterface", "WifiPpdu"}},
+    {"wifiMac",
+     "Wi-Fi MAC",
+     {"Txop", "WifiMac", "FrameExchangeManager", "ChannelAccessManager", "RemoteStationManager", "BlockAck",
+      "MacRxMiddle", "MacTxMiddle", "WifiNetDevice", "WifiMacQueue", "WifiDefault"}},
+    {"lrwpanPhy", "LR-WPAN PHY", {"LrWpanPhy"}},
+    {"lrwpanMac", "LR-WPAN MAC", {"LrWpanMac", "LrWpanCsmaCa", "LrWpanNetDevice"}},
+    {"zigbeeNwk", "Zigbee NWK", {"ZigbeeNwk", "ZigbeeStack"}},
+    {"apps",
+     "Applications / IP",
+     {"Application", "Socket", "Udp", "Ipv4", "Arp", "Icmp", "TrafficControl", "QueueDisc"}},
+    {"flowMonitor", "FlowMonitor", {"FlowMonitor", "FlowProbe"}},
+    {"scenario", "Scenario functions", {}},
+    {"other", "Other", {}},
+};
+
+struct EventProfile {
+  bool enabled = false;
+  std::vector<uint64_t> events;
+  std::vector<double> seconds;
+  std::unordered_map<std::type_index, size_t> groupOf; // EventImpl type -> group
+  std::unordered_map<std::type_index, std::string> ownerOf;
+  std::map<std::string, std::pair<uint64_t, double>> owners; // per owning type
+  // The event running since start, classified before it was invoked (it may
+  // be freed by the time it is closed). The owner points into ownerOf, whose
+  // elements are stable; nullptr when no event is open.
+  size_t currentGroup = 0;
+  const std::string* currentOwner = nullptr;
+  std::chrono::steady_clock::time_point start;
+};
+static EventProfile g_profile;
+
+/**
+ * Owning class of a member function event ("ns3::WifiPhy" from
+ * "...MakeEvent<void (ns3::WifiPhy::*)(...)...") or the signature of a free
+ * function event.
+ */
+static std::string EventOwner(const std::string& type) {
+  size_t member = type.find("::*)");
+  if (member != std::string::npos) {
+    size_t open = type.rfind('(', member);
+    return type.substr(open + 1, member - open - 1);
+  }
+  size_t function = type.find("(*)");
+  if (function != std::string::npos) {
+    size_t close = type.find(')', function + 3);
+    size_t ret = type.rfind('<', function);
+    ret = ret == std::string::npos ? 0 : ret + 1;
+    return "function " + type.substr(ret, close == std::string::npos ? std::string::npos : close + 1 - ret);
+  }
+  return type;
+}
+
+static size_t EventClassify(const EventImpl* impl, const std::string** ownerOut) {
+  std::type_index type(typeid(*impl));
+  auto it = g_profile.groupOf.find(type);
+  if (it != g_profile.groupOf.end()) {
+    *ownerOut = &g_profile.ownerOf[type];
+    return it->second;
+  }
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+  std::string name = status == 0 ? demangled : type.name();
+  std::free(demangled);
+  std::string owner = EventOwner(name);
+  size_t group = c_eventGroups.size() - 1;
+  if (owner.rfind("function ", 0) == 0) {
+    group = c_eventGroups.size() - 2;
+  } else {
+    for (size_t g = 0; g < c_eventGroups.size() && group == c_eventGroups.size() - 1; g++) {
+      for (const auto& sub : c_eventGroups[g].owners) {
+        if (owner.find(sub) != std::string::npos) {
+          group = g;
+          break;
+        }
+      }
+    }
+  }
+  *ownerOut = &(g_profile.ownerOf[type] = owner);
+  return g_profile.groupOf[type] = group;
+}
+
+/**
+ * Close the event that ran since the previous call and open the next one
+ * (nullptr at the end of the run). The next event is classified here, while
+ * it is still alive; only its group and owner are kept.
+ */
+static void EventProfileNext(const EventImpl* next) {
+  auto now = std::chrono::steady_clock::now();
+  if (g_profile.currentOwner) {
+    double dt = std::chrono::duration<double>(now - g_profile.start).count();
+    g_profile.events[g_profile.currentGroup]++;
+    g_profile.seconds[g_profile.currentGroup] += dt;
+    auto& owner = g_profile.owners[*g_profile.currentOwner];
+    owner.first++;
+    owner.second += dt;
+  }
+  g_profile.currentOwner = nullptr;
+  if (next) {
+    g_profile.currentGroup = EventClassify(next, &g_profile.currentOwner);
+  }
+  // Classification (and its first-time demangling) is not charged to the event
+  g_profile.start = std::chrono::steady_clock::now();
+}
+
+// The default MapScheduler, instrumented: it counts the pending events for
+// the memory accounting and feeds the event profiler. Only installed when
+// one of them is enabled.
+class InstrumentedScheduler : public MapScheduler {
+public:
+  static TypeId GetTypeId() {
+    static TypeId tid = TypeId("InstrumentedScheduler")
+                            .SetParent<MapScheduler>()
+                            .SetGroupName("Core")
+                            .AddConstructor<InstrumentedScheduler>();
+    return tid;
+  }
+
+  void Insert(const Event& ev) override {
+    s_pending++;
+    MapScheduler::Insert(ev);
+  }
+
+  Event RemoveNext() override {
+    s_pending--;
+    Event ev = MapScheduler::RemoveNext();
+    if (g_profile.enabled) {
+      // The simulator invokes the event right after removing it
+      EventProfileNext(ev.impl);
+    }
+    return ev;
+  }
+
+  void Remove(const Event& ev) override {
+    s_pending--;
+    MapScheduler::Remove(ev);
+  }
+
+  static inline uint64_t s_pending = 0;
+};
+NS_OBJECT_ENSURE_REGISTERED(InstrumentedScheduler);
+
+static void PrintEventProfile() {
+  EventProfileNext(nullptr);
+  uint64_t totalEvents = 0;
+  double totalSeconds = 0.0;
+  for (size_t g = 0; g < c_eventGroups.size(); g++) {
+    totalEvents += g_profile.events[g];
+    totalSeconds += g_profile.seconds[g];
+  }
+  NS_LOG_UNCOND("=== Event profile (" << totalEvents << " events, " << std::fixed << std::setprecision(3)
+                                      << totalSeconds << " s) ===" << std::defaultfloat);
+  NS_LOG_UNCOND("Group              | Events     | Share  | Wall(s)  | Share  | ns/event");
+  for (size_t g = 0; g < c_eventGroups.size(); g++) {
+    uint64_t n = g_profile.events[g];
+    double sec = g_profile.seconds[g];
+    double eventShare = totalEvents > 0 ? double(n) / double(totalEvents) : 0.0;
+    double timeShare = totalSeconds > 0.0 ? sec / totalSeconds : 0.0;
+    NS_LOG_UNCOND(std::left << std::setw(18) << c_eventGroups[g].label << std::right << " | " << std::setw(10) << n
+                            << " | " << std::fixed << std::setprecision(1) << std::setw(5) << 100.0 * eventShare
+                            << "% | " << std::setprecision(3) << std::setw(8) << sec << " | "
+                            << std::setprecision(1) << std::setw(5) << 100.0 * timeShare << "% | " << std::setw(8)
+                            << (n > 0 ? 1e9 * sec / double(n) : 0.0) << std::defaultfloat);
+    std::string prefix = "profile." + c_eventGroups[g].key + ".";
+    AddResult(prefix + "events", n);
+    AddResult(prefix + "seconds", sec);
+    AddResult(prefix + "timeShare", timeShare);
+  }
+
+  // The most expensive owning types, to see which class inside a group dominates
+  std::vector<std::pair<std::string, std::pair<uint64_t, double>>> owners(g_profile.owners.begin(),
+                                                                          g_profile.owners.end());
+  std::sort(owners.begin(), owners.end(),
+            [](const auto& a, const auto& b) { return a.second.second > b.second.second; });
+  NS_LOG_UNCOND("Top owning types:");
+  for (size_t i = 0; i < owners.size() && i < 10; i++) {
+    NS_LOG_UNCOND("  " << std::fixed << std::setprecision(3) << std::setw(8) << owners[i].second.second << " s "
+                       << std::setw(10) << owners[i].second.first << "  " << owners[i].first << std::defaultfloat);
+  }
+}
+
+// Memory accounting (--memInterval > 0). Every interval the live objects and
+// an estimate of their bytes are sampled per subsystem, next to the process
+// heap (mallinfo2) and resident size. Samples go to --memFile; at the end the
+// breakdown of the sample with the largest heap and the peak of every
+// subsystem are reported. Byte counts of ns-3 internals are estimates from
+// the object counts and sizes, the heap and RSS figures are exact.
+//
+// Pending events are counted by the InstrumentedScheduler.
+
+// Rough per-object overheads: red-black tree node, EventImpl of a bound
+// callback, NWK table entry, FlowMonitor tracked packet
+static const uint64_t c_treeNodeBytes = 32;
+static const uint64_t c_eventImplBytes = 64;
+static const uint64_t c_nwkEntryBytes = 64;
+static const uint64_t c_trackedPacketBytes = 64;
+
+struct MemSample {
+  uint64_t objects = 0;
+  uint64_t bytes = 0;
+};
+
+struct MemoryState {
+  double interval = 0.0;
+  std::string file = "output/memory.csv";
+  std::ofstream out;
+  Ptr<FlowMonitor> flowMonitor;
+  Ptr<SpectrumChannel> channel;
+  uint32_t nwkBaseline[3] = {0, 0, 0}; // lines printed by empty NWK tables
+  // End time and receiver-side bytes of every signal still on the air
+  std::priority_queue<std::pair<double, uint64_t>, std::vector<std::pair<double, uint64_t>>, std::greater<>> signals;
+  uint64_t signalBytes = 0;
+  std::map<std::string, MemSample> peak;
+  std::map<std::string, MemSample> atPeakHeap;
+  uint64_t peakHeap = 0;
+  uint64_t peakRss = 0;
+  double peakTime = 0.0;
+};
+static MemoryState g_memory;
+
+static void MemoryTxSignal(Ptr<SpectrumSignalParameters> params) {
+  // Every receiver gets its own copy of the parameters and (converted) PSD
+  uint64_t receivers = g_memory.channel->GetNDevices() > 0 ? g_memory.channel->GetNDevices() - 1 : 0;
+  uint64_t bytes = receivers * (sizeof(SpectrumSignalParameters) + params->psd->GetValuesN() * sizeof(double));
+  g_memory.signals.emplace(Simulator::Now().GetSeconds() + params->duration.GetSeconds(), bytes);
+  g_memory.signalBytes += bytes;
+}
+
+static uint32_t CountLines(const std::string& s) {
+  return static_cast<uint32_t>(std::count(s.begin(), s.end(), '\n'));
+}
+
+/**
+ * \return lines printed by the neighbor, routing and route discovery tables
+ */
+static std::array<uint32_t, 3> NwkTableLines(Ptr<ZigbeeNwk> nwk) {
+  std::array<uint32_t, 3> lines;
+  std::ostringstream neighbors;
+  std::ostringstream routes;
+  std::ostringstream discoveries;
+  nwk->PrintNeighborTable(Create<OutputStreamWrapper>(&neighbors));
+  nwk->PrintRoutingTable(Create<OutputStreamWrapper>(&routes));
+  nwk->PrintRouteDiscoveryTable(Create<OutputStreamWrapper>(&discoveries));
+  lines[0] = CountLines(neighbors.str());
+  lines[1] = CountLines(routes.str());
+  lines[2] = CountLines(discoveries.str());
+  return lines;
+}
+
+static std::map<std::string, MemSample> MemoryAccount() {
+  std::map<std::string, MemSample> m;
+  double now = Simulator::Now().GetSeconds();
+
+  MemSample& topology = m["scenario"];
+  topology.objects = g_scenario.nodes.size() + g_scenario.flows.size() + g_scenario.faults.size();
+  topology.bytes = g_scenario.nodes.capacity() * sizeof(scenario::NodeSpec) +
+                   g_scenario.flows.capacity() * sizeof(scenario::FlowSpec) +
+                   g_scenario.faults.capacity() * sizeof(scenario::FaultSpec) +
+                   g_scenario.index.size() * (sizeof(std::pair<std::string, uint32_t>) + c_treeNodeBytes);
+
+  MemSample& qos = m["qosTracking"];
+  qos.objects = qosMap.size() + g_delays.size() + g_outstanding.size();
+  qos.bytes = qosMap.size() * (sizeof(QoSInfo) + c_treeNodeBytes) + g_delays.capacity() * sizeof(double) +
+              g_outstanding.size() * (sizeof(std::pair<uint32_t, double>) + c_treeNodeBytes);
+  for (const auto& dst : receivedTracker) {
+    for (const auto& src : dst.second) {
+      qos.objects += src.second.size();
+      qos.bytes += src.second.size() * (sizeof(uint32_t) + c_treeNodeBytes);
+    }
+  }
+
+  MemSample& events = m["eventQueue"];
+  events.objects = InstrumentedScheduler::s_pending;
+  events.bytes = events.objects * (sizeof(Scheduler::Event) + c_treeNodeBytes + c_eventImplBytes);
+
+  // Packets in flight: Zigbee heartbeats not yet received, Wi-Fi packets sent
+  // but neither received nor declared lost
+  MemSample& packets = m["packetsInFlight"];
+  packets.objects = g_outstanding.size();
+  packets.bytes = g_outstanding.size() * (sizeof(Packet) + c_zigbeeBufferSize);
+  MemSample& monitor = m["flowMonitor"];
+  if (g_memory.flowMonitor) {
+    for (const auto& flow : g_memory.flowMonitor->GetFlowStats()) {
+      const FlowMonitor::FlowStats& fs = flow.second;
+      uint64_t done = uint64_t(fs.rxPackets) + fs.lostPackets;
+      uint64_t inFlight = fs.txPackets > done ? fs.txPackets - done : 0;
+      uint64_t avgSize = fs.txPackets > 0 ? fs.txBytes / fs.txPackets : 0;
+      packets.objects += inFlight;
+      packets.bytes += inFlight * (sizeof(Packet) + avgSize);
+      monitor.objects += 1 + inFlight;
+      monitor.bytes += sizeof(FlowMonitor::FlowStats) + c_treeNodeBytes + inFlight * c_trackedPacketBytes +
+                       (fs.delayHistogram.GetNBins() + fs.jitterHistogram.GetNBins() +
+                        fs.packetSizeHistogram.GetNBins() + fs.flowInterruptionsHistogram.GetNBins()) *
+                           sizeof(uint32_t) +
+                       fs.packetsDropped.size() * sizeof(uint32_t) + fs.bytesDropped.size() * sizeof(uint64_t);
+    }
+  }
+
+  MemSample& nwk = m["nwkTables"];
+  for (uint32_t i = 0; i < zigbeeStacks.GetN(); i++) {
+    std::array<uint32_t, 3> lines = NwkTableLines(zigbeeStacks.Get(i)->GetNwk());
+    for (int t = 0; t < 3; t++) {
+      nwk.objects += lines[t] - std::min(lines[t], g_memory.nwkBaseline[t]);
+    }
+  }
+  nwk.bytes = nwk.objects * c_nwkEntryBytes;
+
+  MemSample& spectrum = m["spectrumSignals"];
+  while (!g_memory.signals.empty() && g_memory.signals.top().first <= now) {
+    g_memory.signalBytes -= g_memory.signals.top().second;
+    g_memory.signals.pop();
+  }
+  spectrum.objects = g_memory.signals.size();
+  spectrum.bytes = g_memory.signalBytes;
+  return m;
+}
+
+static uint64_t ResidentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0;
+  uint64_t resident = 0;
+  statm >> size >> resident;
+  return resident * uint64_t(sysconf(_SC_PAGESIZE));
+}
+
+static void MemorySample() {
+  std::map<std::string, MemSample> m = MemoryAccount();
+  struct mallinfo2 mi = mallinfo2();
+  uint64_t heap = mi.uordblks + mi.hblkhd;
+  uint64_t rss = ResidentBytes();
+  double now = Simulator::Now().GetSeconds();
+  for (const auto& kv : m) {
+    g_memory.out << now << "," << kv.first << "," << kv.second.objects << "," << kv.second.bytes << "\n";
+    MemSample& p = g_memory.peak[kv.first];
+    p.objects = std::max(p.objects, kv.second.objects);
+    p.bytes = std::max(p.bytes, kv.second.bytes);
+  }
+  g_memory.out << now << ",heap,0," << heap << "\n" << now << ",rss,0," << rss << "\n";
+  if (heap >= g_memory.peakHeap) {
+    g_memory.peakHeap = heap;
+    g_memory.peakTime = now;
+    g_memory.atPeakHeap = m;
+  }
+  g_memory.peakRss = std::max(g_memory.peakRss, rss);
+}
+
+static void MemoryPeriodic() {
+  MemorySample();
+  Simulator::Schedule(Seconds(g_memory.interval), &MemoryPeriodic);
+}
+
+static void SetupMemory(Ptr<SpectrumChannel> channel, Ptr<FlowMonitor> flowMonitor) {
+  g_memory.channel = channel;
+  g_memory.flowMonitor = flowMonitor;
+  channel->TraceConnectWithoutContext("TxSigParams", MakeCallback(&MemoryTxSignal));
+  if (zigbeeStacks.GetN() > 0) {
+    std::array<uint32_t, 3> lines = NwkTableLines(zigbeeStacks.Get(0)->GetNwk());
+    std::copy(lines.begin(), lines.end(), g_memory.nwkBaseline);
+  }
+  std::filesystem::path parent = std::filesystem::path(g_memory.file).parent_path();
+  if (!parent.empty()) {
+    std::filesystem::create_directories(parent);
+  }
+  g_memory.out.open(g_memory.file);
+  g_memory.out << "time,subsystem,objects,bytes\n";
+  Simulator::Schedule(Seconds(0), &MemoryPeriodic);
+}
+
+static void PrintMemory() {
+  MemorySample();
+  g_memory.out.close();
+  uint64_t accounted = 0;
+  for (const auto& kv : g_memory.atPeakHeap) {
+    accounted += kv.second.bytes;
   }
+  NS_LOG_UNCOND("=== Memory at the heap peak (t=" << g_memory.peakTime << "s, heap "
+                                                  << g_memory.peakHeap / (1 << 20) << " MiB, peak RSS "
+                                                  << g_memory.peakRss / (1 << 20) << " MiB) ===");
+  NS_LOG_UNCOND("Subsystem        | Objects    | MiB      | Heap share | Peak MiB");
+  for (const auto& kv : g_memory.atPeakHeap) {
+    const MemSample& peak = g_memory.peak[kv.first];
+    NS_LOG_UNCOND(std::left << std::setw(16) << kv.first << std::right << " | " << std::setw(10)
+                            << kv.second.objects << " | " << std::fixed << std::setprecision(2) << std::setw(8)
+                            << kv.second.bytes / 1048576.0 << " | " << std::setprecision(1) << std::setw(9)
+                            << (g_memory.peakHeap > 0 ? 100.0 * kv.second.bytes / g_memory.peakHeap : 0.0)
+                            << "% | " << std::setprecision(2) << std::setw(8) << peak.bytes / 1048576.0
+                            << std::defaultfloat);
+    AddResult("mem." + kv.first + ".bytesAtPeak", kv.second.bytes);
+    AddResult("mem." + kv.first + ".peakBytes", peak.bytes);
+    AddResult("mem." + kv.first + ".peakObjects", peak.objects);
+  }
+  NS_LOG_UNCOND("  unaccounted heap: " << std::fixed << std::setprecision(2)
+                                       << (g_memory.peakHeap - std::min(g_memory.peakHeap, accounted)) / 1048576.0
+                                       << " MiB, samples in " << g_memory.file << std::defaultfloat);
+  AddResult("mem.peakHeapBytes", g_memory.peakHeap);
+  AddResult("mem.peakRssBytes", g_memory.peakRss);
+  AddResult("mem.peakTime", g_memory.peakTime);
 }
 
 int main(int argc, char* argv[]) {
@@ -328,28 +4190,179 @@ int main(int argc, char* argv[]) {
   uint32_t rngRun = 1;
   uint32_t seed = 1;
   uint32_t logLevel = 3;
+  uint32_t wifiBeCwMin = 15;
+  uint32_t wifiBeCwMax = 1023;
+  uint32_t wifiBeAifsn = 3;
+  uint32_t zigbeeMinBe = 3;
+  uint32_t zigbeeMaxBe = 5;
+  uint32_t zigbeeMaxCsmaBackoffs = 4;
+  uint32_t zigbeeMaxFrameRetries = 3;
+
+  bool dumpConfig = false;
+  std::string resultsFile = "";
+  std::string scenarioFile = "";
+  bool bulkSetup = false;
+  bool wifiStaticAssoc = false;
+  bool perfCounters = false;
 
   CommandLine cmd;
-  cmd.AddValue("logLevel", "0=ERROR, 1=WARN, 2=INFO, 3=DEBUG, 4=LOGIC", logLevel);
-  cmd.AddValue("wifiDataRate", "DataRate for WiFi (e.g. \"160Mbps\")", wifiDataRate);
-  cmd.AddValue("wifiChannelWidth", "WiFi channel width (MHz)", wifiChannelWidth);
-  cmd.AddValue("wifiPacketSize", "Size of each heartbeat packet (bytes)", wifiPacketSize);
-  cmd.AddValue("heartbeatInterval", "Interval between heartbeats (s)", heartbeatInterval);
-  cmd.AddValue("simulationTime", "Total simulation time (seconds)", simulationTime);
-  cmd.AddValue("rngRun", "RNG run number (for SetRun)", rngRun);
-  cmd.AddValue("seed", "RNG seed (for SetSeed)", seed);
+  AddParam(cmd, "logLevel", "0=ERROR, 1=WARN, 2=INFO, 3=DEBUG, 4=LOGIC", logLevel, false);
+  AddParam(cmd, "wifiDataRate", "DataRate for WiFi (e.g. \"160Mbps\")", wifiDataRate);
+  AddParam(cmd, "wifiChannelWidth", "WiFi channel width (MHz)", wifiChannelWidth);
+  AddParam(cmd, "wifiPacketSize", "Size of each heartbeat packet (bytes)", wifiPacketSize);
+  AddParam(cmd, "heartbeatInterval", "Interval between heartbeats (s)", heartbeatInterval);
+  AddParam(cmd, "simulationTime", "Total simulation time (seconds)", simulationTime);
+  AddParam(cmd, "rngRun", "RNG run number (for SetRun)", rngRun);
+  AddParam(cmd, "seed", "RNG seed (for SetSeed)", seed);
+  AddParam(cmd, "wifiBeCwMin", "EDCA CWmin of AC_BE on all Wi-Fi devices", wifiBeCwMin);
+  AddParam(cmd, "wifiBeCwMax", "EDCA CWmax of AC_BE on all Wi-Fi devices", wifiBeCwMax);
+  AddParam(cmd, "wifiBeAifsn", "EDCA AIFSN of AC_BE on all Wi-Fi devices", wifiBeAifsn);
+  AddParam(cmd, "wifiStaticAssoc", "Pre-associate the STAs at time zero (no beacons, scanning or association)",
+           wifiStaticAssoc);
+  AddParam(cmd, "zigbeeMinBe", "LR-WPAN CSMA/CA macMinBE", zigbeeMinBe);
+  AddParam(cmd, "zigbeeMaxBe", "LR-WPAN CSMA/CA macMaxBE", zigbeeMaxBe);
+  AddParam(cmd, "zigbeeMaxCsmaBackoffs", "LR-WPAN CSMA/CA macMaxCSMABackoffs", zigbeeMaxCsmaBackoffs);
+  AddParam(cmd, "zigbeeMaxFrameRetries", "LR-WPAN macMaxFrameRetries", zigbeeMaxFrameRetries);
+  AddParam(cmd, "progressInterval", "Print PROGRESS lines every interval (s, 0 = disabled)", g_progress.interval,
+           false);
+  AddParam(cmd, "progressDelayBound", "Delay above which a packet counts as late in PROGRESS lines (s)",
+           g_progress.delayBound, false);
+  AddParam(cmd, "progressLossTimeout", "Age after which an outstanding packet counts as lost (s)",
+           g_progress.lossTimeout, false);
+  AddParam(cmd, "loadRamp", "Comma separated Wi-Fi DataRates stepped through in one run (empty = disabled)",
+           g_ramp.rates);
+  AddParam(cmd, "rampSettle", "Load ramp: settle time at the start of each phase (s)", g_ramp.settle);
+  AddParam(cmd, "rampWindow", "Load ramp: measurement window of each phase (s)", g_ramp.window);
+  AddParam(cmd, "probeGrid", "Passive probe grid \"x0:x1:dx,y0:y1:dy\" in meters (empty = disabled)",
+           g_probes.grid);
+  AddParam(cmd, "probeBusyDbm", "Wi-Fi power in the Zigbee band above which a probe counts as busy (dBm)",
+           g_probes.busyDbm);
+  AddParam(cmd, "probeFile", "CSV written with the per-probe results", g_probes.file, false);
+  AddParam(cmd, "partition", "Simulate the components of the interference graph in parallel processes",
+           g_partition.enabled);
+  AddParam(cmd, "partitionThresholdDbm", "Received power that links two radios in the interference graph (dBm)",
+           g_partition.thresholdDbm);
+  AddParam(cmd, "partitionMarginDb", "Fading headroom added to the mean path loss (dB)", g_partition.marginDb);
+  // Trace and map enter the cache key through their content, not their path
+  AddParam(cmd, "replayTrace", "Replay traffic from a CSV or binary trace (empty = disabled)", g_replay.trace,
+           false);
+  AddParam(cmd, "replayMap", "Map of trace device ids to endpoints (zigbee:<i>, ap:<i>, sta:<i>, node:<id>)",
+           g_replay.map, false);
+  g_params.push_back({"replayTraceDigest", true, []() { return replay::FileDigest(g_replay.trace); }});
+  g_params.push_back({"replayMapDigest", true, []() { return replay::FileDigest(g_replay.map); }});
+  AddParam(cmd, "replayLookahead", "Trace records scheduled ahead of time", g_replay.lookahead);
+  AddParam(cmd, "replayStart", "Simulation time of trace time 0 (s)", g_replay.start);
+  AddParam(cmd, "replayReplaces", "Disable the OnOff and heartbeat traffic while replaying", g_replay.replaces);
+  AddParam(cmd, "adaptiveRate", "Heartbeat flows adapt their rate AIMD-style to congestion", g_adaptive.enabled);
+  AddParam(cmd, "adaptiveMinInterval", "Adaptive rate: smallest heartbeat interval (s)", g_adaptive.minInterval);
+  AddParam(cmd, "adaptiveMaxInterval", "Adaptive rate: largest heartbeat interval (s)", g_adaptive.maxInterval);
+  AddParam(cmd, "adaptiveIncrease", "Adaptive rate: additive increase (packets/s per second)", g_adaptive.increase);
+  AddParam(cmd, "adaptiveDecrease", "Adaptive rate: multiplicative decrease factor on congestion",
+           g_adaptive.decrease);
+  AddParam(cmd, "adaptiveDelayTarget", "Adaptive rate: delay above which a delivery signals congestion (s)",
+           g_adaptive.delayTarget);
+  AddParam(cmd, "adaptiveLossTimeout", "Adaptive rate: age after which a heartbeat counts as lost (s)",
+           g_adaptive.lossTimeout);
+  AddParam(cmd, "gapAware",
+           "Time Zigbee heartbeats into predicted Wi-Fi idle gaps (busy/idle from the channel TX trace, not PHY ED)",
+           g_gap.enabled);
+  AddParam(cmd, "gapBusyDbm", "Gap-aware: Wi-Fi power in the Zigbee channel sensed as busy (dBm)", g_gap.busyDbm);
+  AddParam(cmd, "gapHistory", "Gap-aware: idle gaps remembered per node", g_gap.history);
+  AddParam(cmd, "gapThreshold", "Gap-aware: probability the gap must fit the frame with", g_gap.threshold);
+  AddParam(cmd, "gapMaxDefer", "Gap-aware: longest deferral of a heartbeat (s)", g_gap.maxDefer);
+  AddParam(cmd, "tsch", "TSCH-like slotted channel hopping for the heartbeats", g_tsch.enabled);
+  AddParam(cmd, "tschSlot", "TSCH: timeslot duration (s)", g_tsch.slot);
+  AddParam(cmd, "tschSlotframe", "TSCH: slotframe length in slots (0 = one per cell plus a shared slot)",
+           g_tsch.slotframe);
+  AddParam(cmd, "tschQueue", "TSCH: frames queued per link", g_tsch.queueLimit);
+  AddParam(cmd, "channelManager", "AP picks the Wi-Fi channel and width by 802.15.4 activity at runtime",
+           g_chan.enabled);
+  AddParam(cmd, "chanInterval", "Channel manager: measurement interval (s)", g_chan.interval);
+  AddParam(cmd, "chanSenseDbm", "Channel manager: 802.15.4 power at the AP counted as activity (dBm)",
+           g_chan.senseDbm);
+  AddParam(cmd, "chanCapacityWeight", "Channel manager: penalty for giving up the full channel width",
+           g_chan.capacityWeight);
+  AddParam(cmd, "chanHysteresis", "Channel manager: score improvement needed to switch", g_chan.hysteresis);
+  AddParam(cmd, "chanCsaCount", "Channel manager: beacon intervals between announcement and switch",
+           g_chan.csaCount);
+  AddParam(cmd, "tpc", "Wi-Fi transmit power: link (per-link control) or measure (default power)", g_tpc.mode);
+  AddParam(cmd, "tpcTargetMcs", "TPC: HT MCS every link must still support", g_tpc.targetMcs);
+  AddParam(cmd, "tpcMarginDb", "TPC: fading margin over the MCS's SNR (dB)", g_tpc.marginDb);
+  AddParam(cmd, "tpcMinDbm", "TPC: lowest transmit power (dBm)", g_tpc.minDbm);
+  AddParam(cmd, "zigbeePower", "Zigbee transmit power: link (per-link control) or measure (fixed power)",
+           g_zpower.mode);
+  AddParam(cmd, "zpMinDbm", "Zigbee power control: lowest transmit power (dBm)", g_zpower.minDbm);
+  AddParam(cmd, "zpMaxDbm", "Zigbee power control: highest and initial transmit power (dBm)", g_zpower.maxDbm);
+  AddParam(cmd, "zpLqiLow", "Zigbee power control: link LQI below which the power goes up", g_zpower.lqiLow);
+  AddParam(cmd, "zpLqiHigh", "Zigbee power control: link LQI above which the power may go down", g_zpower.lqiHigh);
+  AddParam(cmd, "nwkTables", "Bounded NWK neighbor, routing and route discovery tables", g_nwkTables.enabled);
+  AddParam(cmd, "nwkNeighborCap", "Bounded NWK tables: neighbor table entries per device", g_nwkTables.neighborCap);
+  AddParam(cmd, "nwkRouteCap", "Bounded NWK tables: routing table entries per device", g_nwkTables.routeCap);
+  AddParam(cmd, "nwkDiscoveryCap", "Bounded NWK tables: route discovery table entries per device",
+           g_nwkTables.discoveryCap);
+  AddParam(cmd, "nwkEvict", "Bounded NWK tables: eviction when full, lru, lqi or none", g_nwkTables.evict);
+  AddParam(cmd, "procDelay", "Per-node processing queue for Zigbee frames", g_proc.enabled);
+  AddParam(cmd, "procTxUs", "Processing: service time of a frame the node sends (us)", g_proc.txUs);
+  AddParam(cmd, "procDataUs", "Processing: service time of a data frame for the node (us)", g_proc.dataUs);
+  AddParam(cmd, "procRelayUs", "Processing: service time of a data frame to forward (us)", g_proc.relayUs);
+  AddParam(cmd, "procCommandUs", "Processing: service time of a NWK command frame (us)", g_proc.commandUs);
+  AddParam(cmd, "procSecurity", "Processing: NWK AES-CCM* security (auxiliary header, MIC-32)", g_proc.security);
+  AddParam(cmd, "procAesBlockUs", "Processing: time of one AES-128 block (us)", g_proc.aesBlockUs);
+  AddParam(cmd, "pollMode", "Coordinator polling: round-robin, all or window (empty = disabled)", g_poll.mode);
+  AddParam(cmd, "pollWindow", "Polling: outstanding requests in window mode", g_poll.window);
+  AddParam(cmd, "pollDevices", "Polling: number of routers polled (0 = all)", g_poll.devicesLimit);
+  AddParam(cmd, "pollPeriod", "Polling: interval between cycle starts (s)", g_poll.period);
+  AddParam(cmd, "pollTimeout", "Polling: time after which a request counts as unanswered (s)", g_poll.timeout);
+  AddParam(cmd, "pollSize", "Polling: request and response size (bytes, >= 17)", g_poll.size);
+  AddParam(cmd, "pollStart", "Polling: start of the first cycle (s)", g_poll.start);
+  AddParam(cmd, "resultsFile", "Write key=value results to this file (empty = disabled)", resultsFile, false);
+  // The scenario enters the cache key through its content, not its path
+  AddParam(cmd, "scenario", "Scenario file (empty = built-in topology)", scenarioFile, false);
+  g_params.push_back({"scenarioDigest", true, []() { return g_scenario.digest; }});
+  // Diagnostics that add results of their own are keyed, so that a cached run
+  // without them never stands in for a run that asks for their report
+  AddParam(cmd, "memInterval", "Sample per-subsystem memory every interval (s, 0 = disabled)", g_memory.interval);
+  AddParam(cmd, "memFile", "CSV written with the memory samples", g_memory.file, false);
+  AddParam(cmd, "perfCounters", "Hardware counters for the setup, join and measurement phases", perfCounters);
+  AddParam(cmd, "profileEvents", "Count and time the executed events per owning model", g_profile.enabled);
+  AddParam(cmd, "bulkSetup", "Build large scenarios in batches (same results, faster setup)", bulkSetup, false);
+  AddParam(cmd, "splitFactor", "Rare-event splitting: copies per split (0/1 = disabled)", g_split.factor);
+  AddParam(cmd, "splitRoots", "Rare-event splitting: independent root trajectories", g_split.roots);
+  AddParam(cmd, "splitThreshold", "MAC retries+drops per interval that trigger a split", g_split.threshold);
+  AddParam(cmd, "splitInterval", "Interval between split checks (s)", g_split.interval);
+  AddParam(cmd, "splitMaxDepth", "Maximum number of nested splits per trajectory", g_split.maxDepth);
+  AddParam(cmd, "splitMaxClones", "Maximum number of trajectories in total", g_split.maxClones);
+  cmd.AddValue("dumpConfig", "Print the resolved configuration as key=value lines and exit", dumpConfig);
   cmd.Parse(argc, argv);
 
+  g_setup.last = std::chrono::steady_clock::now();
+  if (scenarioFile.empty()) {
+    g_scenario = scenario::Loader::Default();
+  } else {
+    std::string error;
+    NS_ABORT_MSG_IF(!scenario::Loader().Load(scenarioFile, g_scenario, error), error);
+  }
+  g_setup.Mark("scenario");
+
+  if (dumpConfig) {
+    DumpConfig(std::cout);
+    return 0;
+  }
+
+  if (perfCounters) {
+    std::string error;
+    g_perf.enabled = g_perf.counters.Open(error);
+    if (!error.empty()) {
+      NS_LOG_UNCOND("Hardware counters " << (g_perf.enabled ? "partly " : "") << "unavailable: " << error);
+    }
+    PerfMark("setup");
+  }
+
   NS_LOG_UNCOND("\n============================================================");
   NS_LOG_UNCOND(" Simulation parameters:");
-  NS_LOG_UNCOND("   wifiDataRate      = " << wifiDataRate);
-  NS_LOG_UNCOND("   wifiChannelWidth  = " << wifiChannelWidth);
-  NS_LOG_UNCOND("   wifiPacketSize    = " << wifiPacketSize);
-  NS_LOG_UNCOND("   heartbeatInterval = " << heartbeatInterval);
-  NS_LOG_UNCOND("   simulationTime    = " << simulationTime);
-  NS_LOG_UNCOND("   rngRun            = " << rngRun);
-  NS_LOG_UNCOND("   seed              = " << seed);
-  NS_LOG_UNCOND("   logLevel          = " << logLevel);
+  for (const auto& p : g_params) {
+    NS_LOG_UNCOND("   " << std::left << std::setw(17) << p.name << std::right << " = " << p.value());
+  }
   NS_LOG_UNCOND("============================================================");
 
   LogLevel ns3LogLevel = LOG_LEVEL_ERROR;
@@ -384,55 +4397,121 @@ int main(int argc, char* argv[]) {
 
   RngSeedManager::SetSeed(seed);
   RngSeedManager::SetRun(rngRun);
+  if (g_memory.interval > 0.0 || g_profile.enabled) {
+    Simulator::SetScheduler(ObjectFactory("InstrumentedScheduler"));
+  }
+  g_profile.events.assign(c_eventGroups.size(), 0);
+  g_profile.seconds.assign(c_eventGroups.size(), 0.0);
+
+  // Nodes are created per role in scenario order: APs, STAs, then the
+  // Zigbee nodes. slot[] is a node's index in its device container, with
+  // the Wi-Fi devices ordered APs first (as are the IPv4 interfaces).
+  NS_LOG_UNCOND("Scenario: " << (scenarioFile.empty() ? "built-in" : scenarioFile) << " ("
+                             << g_scenario.nodes.size() << " nodes, " << g_scenario.flows.size() << " flows, "
+                             << g_scenario.faults.size() << " faults) loaded in "
+                             << g_setup.phases.back().second * 1e3 << " ms");
+  std::vector<uint32_t> wifiSpecs;
+  std::vector<uint32_t> zigbeeSpecs;
+  std::vector<uint32_t> slot(g_scenario.nodes.size());
+  for (scenario::Role role : {scenario::Role::AP, scenario::Role::STA}) {
+    for (uint32_t i = 0; i < g_scenario.nodes.size(); i++) {
+      if (g_scenario.nodes[i].role == role) {
+        slot[i] = wifiSpecs.size();
+        wifiSpecs.push_back(i);
+      }
+    }
+  }
+  for (uint32_t i = 0; i < g_scenario.nodes.size(); i++) {
+    if (scenario::IsZigbee(g_scenario.nodes[i].role)) {
+      slot[i] = zigbeeSpecs.size();
+      zigbeeSpecs.push_back(i);
+    }
+  }
+  uint32_t coordinator = 0;
+  for (uint32_t k = 0; k < zigbeeSpecs.size(); k++) {
+    if (g_scenario.nodes[zigbeeSpecs[k]].role == scenario::Role::COORDINATOR) {
+      coordinator = k;
+    }
+  }
+  g_expectedJoins = g_scenario.Count(scenario::Role::ROUTER);
 
   NodeContainer wifiApNodes;
-  wifiApNodes.Create(1);
+  wifiApNodes.Create(g_scenario.Count(scenario::Role::AP));
 
   NodeContainer wifiStaNodes;
-  wifiStaNodes.Create(3);
+  wifiStaNodes.Create(g_scenario.Count(scenario::Role::STA));
 
   NodeContainer zigbeeNodes;
-  zigbeeNodes.Create(5);
-
-  //// Configure MAC
-  LrWpanHelper lrWpanHelper;
-  NetDeviceContainer lrwpanDevices = lrWpanHelper.Install(zigbeeNodes);
-  Ptr<LrWpanNetDevice> dev0 = lrwpanDevices.Get(0)->GetObject<LrWpanNetDevice>();
-  Ptr<LrWpanNetDevice> dev1 = lrwpanDevices.Get(1)->GetObject<LrWpanNetDevice>();
-  Ptr<LrWpanNetDevice> dev2 = lrwpanDevices.Get(2)->GetObject<LrWpanNetDevice>();
-  Ptr<LrWpanNetDevice> dev3 = lrwpanDevices.Get(3)->GetObject<LrWpanNetDevice>();
-  Ptr<LrWpanNetDevice> dev4 = lrwpanDevices.Get(4)->GetObject<LrWpanNetDevice>();
+  zigbeeNodes.Create(zigbeeSpecs.size());
 
-  // Device must ALWAYS have IEEE Address (Extended address) assigned.
-  // Network address (short address) are assigned by the the JOIN mechanism
-  dev0->GetMac()->SetExtendedAddress("00:00:00:00:00:00:CA:FE");
-  dev1->GetMac()->SetExtendedAddress("00:00:00:00:00:00:00:01");
-  dev2->GetMac()->SetExtendedAddress("00:00:00:00:00:00:00:02");
-  dev3->GetMac()->SetExtendedAddress("00:00:00:00:00:00:00:03");
-  dev4->GetMac()->SetExtendedAddress("00:00:00:00:00:00:00:04");
+  NodeContainer wifiNodes(wifiApNodes, wifiStaNodes);
+  std::vector<Ptr<Node>> scenarioNodes(g_scenario.nodes.size());
+  for (uint32_t i = 0; i < g_scenario.nodes.size(); i++) {
+    scenarioNodes[i] = scenario::IsZigbee(g_scenario.nodes[i].role) ? zigbeeNodes.Get(slot[i]) : wifiNodes.Get(slot[i]);
+  }
+  g_setup.Mark("nodes");
 
   // Configure channel and loss models
   Ptr<SpectrumChannel> channel = CreateObject<MultiModelSpectrumChannel>();
   channel->SetPropagationDelayModel(CreateObject<ConstantSpeedPropagationDelayModel>());
-  channel->AddPropagationLossModel(CreateObject<LogDistancePropagationLossModel>());
+  Ptr<LogDistancePropagationLossModel> logDistance = CreateObject<LogDistancePropagationLossModel>();
+  channel->AddPropagationLossModel(logDistance);
   {
     auto nak = CreateObject<NakagamiPropagationLossModel>();
     nak->SetAttribute("m0", DoubleValue(1.0));
     nak->SetAttribute("m1", DoubleValue(3.0));
     nak->SetAttribute("m2", DoubleValue(3.0));
     channel->AddPropagationLossModel(nak);
+    g_streamTargets.lossModels.push_back(nak);
+  }
+
+  //// Configure MAC
+  // The bulk path attaches the devices to the shared channel while
+  // installing them, instead of to the helper's own channel first
+  LrWpanHelper lrWpanHelper;
+  if (bulkSetup) {
+    lrWpanHelper.SetChannel(channel);
+  }
+  NetDeviceContainer lrwpanDevices = lrWpanHelper.Install(zigbeeNodes);
+
+  // Device must ALWAYS have IEEE Address (Extended address) assigned.
+  // Network address (short address) are assigned by the the JOIN mechanism
+  for (uint32_t k = 0; k < zigbeeSpecs.size(); k++) {
+    Ptr<LrWpanNetDevice> dev = DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(k));
+    dev->GetMac()->SetExtendedAddress(Mac64Address(g_scenario.nodes[zigbeeSpecs[k]].ext.c_str()));
+  }
+
+  NS_ABORT_MSG_IF(zigbeeMinBe > zigbeeMaxBe, "zigbeeMinBe must not exceed zigbeeMaxBe");
+  for (uint32_t i = 0; i < lrwpanDevices.GetN(); i++) {
+    Ptr<LrWpanNetDevice> dev = DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(i));
+    Ptr<LrWpanCsmaCa> csma = dev->GetCsmaCa();
+    csma->SetMacMinBE(0);
+    csma->SetMacMaxBE(zigbeeMaxBe);
+    csma->SetMacMinBE(zigbeeMinBe);
+    csma->SetMacMaxCSMABackoffs(zigbeeMaxCsmaBackoffs);
+    dev->GetMac()->SetMacMaxFrameRetries(zigbeeMaxFrameRetries);
+  }
+
+  if (!g_probes.grid.empty()) {
+    SetupProbes(channel, logDistance, DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(coordinator))->GetPhy());
+  }
+
+  if (g_gap.enabled) {
+    SetupGapSensing(channel, logDistance, lrwpanDevices);
   }
 
-  dev0->SetChannel(channel);
-  dev1->SetChannel(channel);
-  dev2->SetChannel(channel);
-  dev3->SetChannel(channel);
-  dev4->SetChannel(channel);
+  if (!bulkSetup) {
+    for (uint32_t i = 0; i < lrwpanDevices.GetN(); i++) {
+      DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(i))->SetChannel(channel);
+    }
+  }
+  g_setup.Mark("lrwpan");
 
   // Configure WiFi
   SpectrumWifiPhyHelper wifiPhyHelper;
   wifiPhyHelper.SetChannel(channel);
-  wifiPhyHelper.Set("ChannelSettings", StringValue("{6," + std::to_string(wifiChannelWidth) + ", BAND_2_4GHZ, 0}"));
+  wifiPhyHelper.Set("ChannelSettings", StringValue("{" + std::to_string(g_scenario.wifiChannel) + "," +
+                                                   std::to_string(wifiChannelWidth) + ", BAND_2_4GHZ, 0}"));
 
   WifiHelper wifiHelper;
   wifiHelper.SetStandard(WIFI_STANDARD_80211n);
@@ -441,191 +4520,468 @@ int main(int argc, char* argv[]) {
   WifiMacHelper wifiMacHelper;
   Ssid ssid = Ssid("wifi-coex");
 
-  wifiMacHelper.SetType("ns3::StaWifiMac", "Ssid", SsidValue(ssid));
+  // Static association: ns-3.44 has no public way to put a StaWifiMac in the
+  // associated state, so every device gets an ad hoc MAC instead. It sends no
+  // beacons, probes or association frames, and takes its own HT capabilities
+  // for the peer on the first frame, which is what the association exchange
+  // would have negotiated between identical devices.
+  wifiMacHelper.SetType(wifiStaticAssoc ? "ns3::AdhocWifiMac" : "ns3::StaWifiMac", "Ssid", SsidValue(ssid));
   NetDeviceContainer staDev = wifiHelper.Install(wifiPhyHelper, wifiMacHelper, wifiStaNodes);
 
-  wifiMacHelper.SetType("ns3::ApWifiMac", "Ssid", SsidValue(ssid));
+  wifiMacHelper.SetType(wifiStaticAssoc ? "ns3::AdhocWifiMac" : "ns3::ApWifiMac", "Ssid", SsidValue(ssid));
   NetDeviceContainer apDev = wifiHelper.Install(wifiPhyHelper, wifiMacHelper, wifiApNodes);
+  NetDeviceContainer wifiDevices(apDev, staDev);
+  for (uint32_t i = 0; i < staDev.GetN() && !wifiStaticAssoc; i++) {
+    DynamicCast<WifiNetDevice>(staDev.Get(i))->GetMac()->TraceConnectWithoutContext("Assoc",
+                                                                                    MakeCallback(&StaAssociated));
+  }
+
+  // The AP advertises its EDCA parameter set, so APs and STAs share the same values
+  for (uint32_t i = 0; i < wifiDevices.GetN(); i++) {
+    Ptr<QosTxop> be = DynamicCast<WifiNetDevice>(wifiDevices.Get(i))->GetMac()->GetQosTxop(AC_BE);
+    be->SetMinCw(wifiBeCwMin);
+    be->SetMaxCw(wifiBeCwMax);
+    be->SetAifsn(wifiBeAifsn);
+  }
+  g_setup.Mark("wifi");
 
   //// Configure NWK
 
   ZigbeeHelper zigbee;
   ZigbeeStackContainer zigbeeStackContainer = zigbee.Install(lrwpanDevices);
 
-  Ptr<ZigbeeStack> zstack0 = zigbeeStackContainer.Get(0)->GetObject<ZigbeeStack>();
-  Ptr<ZigbeeStack> zstack1 = zigbeeStackContainer.Get(1)->GetObject<ZigbeeStack>();
-  Ptr<ZigbeeStack> zstack2 = zigbeeStackContainer.Get(2)->GetObject<ZigbeeStack>();
-  Ptr<ZigbeeStack> zstack3 = zigbeeStackContainer.Get(3)->GetObject<ZigbeeStack>();
-  Ptr<ZigbeeStack> zstack4 = zigbeeStackContainer.Get(4)->GetObject<ZigbeeStack>();
-
   // Add the stacks to a container to later on print routes.
-  zigbeeStacks.Add(zstack0);
-  zigbeeStacks.Add(zstack1);
-  zigbeeStacks.Add(zstack2);
-  zigbeeStacks.Add(zstack3);
-  zigbeeStacks.Add(zstack4);
-
-  // Assign streams to the zigbee stacks to obtain
-  // reprodusable results from random events occurring inside the stack.
-  zstack0->GetNwk()->AssignStreams(0);
-  zstack1->GetNwk()->AssignStreams(10);
-  zstack2->GetNwk()->AssignStreams(20);
-  zstack3->GetNwk()->AssignStreams(30);
-  zstack4->GetNwk()->AssignStreams(40);
-
-  // Zigbee nodes position
-  Ptr<ConstantPositionMobilityModel> dev0Mobility = CreateObject<ConstantPositionMobilityModel>();
-  dev0Mobility->SetPosition(Vector(0, 0, 0));
-  dev0->GetPhy()->SetMobility(dev0Mobility);
-
-  Ptr<ConstantPositionMobilityModel> dev1Mobility = CreateObject<ConstantPositionMobilityModel>();
-  dev1Mobility->SetPosition(Vector(10, 0, 0));
-  dev1->GetPhy()->SetMobility(dev1Mobility);
-
-  Ptr<ConstantPositionMobilityModel> dev2Mobility = CreateObject<ConstantPositionMobilityModel>();
-  dev2Mobility->SetPosition(Vector(20, 0, 0));
-  dev2->GetPhy()->SetMobility(dev2Mobility);
-
-  Ptr<ConstantPositionMobilityModel> dev3Mobility = CreateObject<ConstantPositionMobilityModel>();
-  dev3Mobility->SetPosition(Vector(30, 0, 0));
-  dev3->GetPhy()->SetMobility(dev3Mobility);
-
-  Ptr<ConstantPositionMobilityModel> dev4Mobility = CreateObject<ConstantPositionMobilityModel>();
-  dev4Mobility->SetPosition(Vector(10, 10, 0));
-  dev4->GetPhy()->SetMobility(dev4Mobility);
-
-  Ptr<ConstantPositionMobilityModel> apMob = CreateObject<ConstantPositionMobilityModel>();
-  apMob->SetPosition(Vector(15.0, 0.0, 0));
-  wifiApNodes.Get(0)->AggregateObject(apMob);
-  Ptr<WifiNetDevice> apWifiDev = apDev.Get(0)->GetObject<WifiNetDevice>();
-  apWifiDev->GetPhy()->SetMobility(apMob);
-
-  Ptr<ConstantPositionMobilityModel> sta0mob = CreateObject<ConstantPositionMobilityModel>();
-  sta0mob->SetPosition(Vector(0.0, 10.0, 0));
-  wifiStaNodes.Get(0)->AggregateObject(sta0mob);
-  Ptr<WifiNetDevice> sta0dev = staDev.Get(0)->GetObject<WifiNetDevice>();
-  sta0dev->GetPhy()->SetMobility(sta0mob);
-
-  Ptr<ConstantPositionMobilityModel> sta1mob = CreateObject<ConstantPositionMobilityModel>();
-  sta1mob->SetPosition(Vector(-5.0, 0.0, 0));
-  wifiStaNodes.Get(1)->AggregateObject(sta1mob);
-  Ptr<WifiNetDevice> sta1dev = staDev.Get(1)->GetObject<WifiNetDevice>();
-  sta1dev->GetPhy()->SetMobility(sta1mob);
-
-  Ptr<ConstantPositionMobilityModel> sta2mob = CreateObject<ConstantPositionMobilityModel>();
-  sta2mob->SetPosition(Vector(15, 5.0, 0));
-  wifiStaNodes.Get(2)->AggregateObject(sta2mob);
-  Ptr<WifiNetDevice> sta2dev = staDev.Get(2)->GetObject<WifiNetDevice>();
-  sta2dev->GetPhy()->SetMobility(sta2mob);
+  for (uint32_t k = 0; k < zigbeeStackContainer.GetN(); k++) {
+    zigbeeStacks.Add(zigbeeStackContainer.Get(k)->GetObject<ZigbeeStack>());
+  }
+  g_setup.Mark("zigbee");
+
+  // Node positions. Zigbee PHYs only need the model on the PHY, Wi-Fi nodes
+  // also aggregate it for the applications and helpers. Nothing in this
+  // scenario looks the model up on the node, so the bulk path skips the
+  // aggregation and creates all models in one pass.
+  std::vector<Ptr<ConstantPositionMobilityModel>> mobilities;
+  mobilities.reserve(g_scenario.nodes.size());
+  for (uint32_t k = 0; k < zigbeeSpecs.size(); k++) {
+    const scenario::NodeSpec& spec = g_scenario.nodes[zigbeeSpecs[k]];
+    mobilities.push_back(CreateObject<ConstantPositionMobilityModel>());
+    mobilities.back()->SetPosition(Vector(spec.x, spec.y, spec.z));
+    DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(k))->GetPhy()->SetMobility(mobilities.back());
+  }
+  for (uint32_t k = 0; k < wifiSpecs.size(); k++) {
+    const scenario::NodeSpec& spec = g_scenario.nodes[wifiSpecs[k]];
+    mobilities.push_back(CreateObject<ConstantPositionMobilityModel>());
+    mobilities.back()->SetPosition(Vector(spec.x, spec.y, spec.z));
+    if (!bulkSetup) {
+      wifiNodes.Get(k)->AggregateObject(mobilities.back());
+    }
+    DynamicCast<WifiNetDevice>(wifiDevices.Get(k))->GetPhy()->SetMobility(mobilities.back());
+  }
+  g_setup.Mark("mobility");
+
+  if (!g_tpc.mode.empty()) {
+    NS_ABORT_MSG_IF(g_tpc.mode != "measure" && g_tpc.mode != "link", "tpc must be measure or link");
+    NS_ABORT_MSG_IF(g_tpc.targetMcs > 7, "tpcTargetMcs must be 0..7 (single-stream HT MCS)");
+    SetupTpc(channel, logDistance, apDev, staDev, lrwpanDevices, wifiChannelWidth);
+  }
+  if (!g_zpower.mode.empty()) {
+    NS_ABORT_MSG_IF(g_zpower.mode != "measure" && g_zpower.mode != "link", "zigbeePower must be measure or link");
+    NS_ABORT_MSG_IF(g_zpower.minDbm < -32 || g_zpower.maxDbm > 31 || g_zpower.minDbm > g_zpower.maxDbm,
+                    "zpMinDbm/zpMaxDbm must satisfy -32 <= min <= max <= 31");
+    SetupZigbeePower(channel, logDistance, lrwpanDevices);
+  }
+  if (g_chan.enabled && apDev.GetN() > 0) {
+    SetupChannelManager(channel, logDistance, apDev, staDev, g_scenario.wifiChannel, wifiChannelWidth,
+                        wifiStaticAssoc);
+  }
+
+  if (g_partition.enabled) {
+    NS_ABORT_MSG_IF(g_split.factor > 1 || g_split.roots > 1, "partition cannot be combined with splitting");
+    AnalyzeInterference(logDistance, zigbeeNodes.Get(coordinator),
+                        wifiApNodes.GetN() > 0 ? wifiApNodes.Get(0) : nullptr);
+    if (g_partition.count > 1 && PartitionFork()) {
+      if (!resultsFile.empty()) {
+        WriteResults(resultsFile);
+      }
+      Simulator::Destroy();
+      return 0;
+    }
+    // Silence everything outside this partition
+    g_expectedJoins = 0;
+    for (uint32_t i = 0; i < zigbeeNodes.GetN(); i++) {
+      g_expectedJoins += i != coordinator && NodeActive(zigbeeNodes.Get(i)->GetId()) ? 1 : 0;
+    }
+    for (uint32_t i = 0; i < wifiDevices.GetN(); i++) {
+      if (!NodeActive(wifiDevices.Get(i)->GetNode()->GetId())) {
+        Simulator::Schedule(Seconds(0), &WifiPhy::SetOffMode, DynamicCast<WifiNetDevice>(wifiDevices.Get(i))->GetPhy());
+      }
+    }
+    g_setup.Mark("partition");
+  }
 
   // NWK callbacks hooks
   // These hooks are usually directly connected to the APS layer
   // In this case, there is no APS layer, therefore, we connect the event outputs
   // of all devices directly to our static functions in this example.
-
-  zstack0->GetNwk()->SetNlmeNetworkFormationConfirmCallback(MakeBoundCallback(&NwkNetworkFormationConfirm, zstack0));
-  zstack0->GetNwk()->SetNlmeRouteDiscoveryConfirmCallback(MakeBoundCallback(&NwkRouteDiscoveryConfirm, zstack0));
-
-  zstack0->GetNwk()->SetNldeDataIndicationCallback(MakeBoundCallback(&NwkDataIndication, zstack0));
-  zstack1->GetNwk()->SetNldeDataIndicationCallback(MakeBoundCallback(&NwkDataIndication, zstack1));
-  zstack2->GetNwk()->SetNldeDataIndicationCallback(MakeBoundCallback(&NwkDataIndication, zstack2));
-  zstack3->GetNwk()->SetNldeDataIndicationCallback(MakeBoundCallback(&NwkDataIndication, zstack3));
-  zstack4->GetNwk()->SetNldeDataIndicationCallback(MakeBoundCallback(&NwkDataIndication, zstack4));
-
-  zstack1->GetNwk()->SetNlmeNetworkDiscoveryConfirmCallback(MakeBoundCallback(&NwkNetworkDiscoveryConfirm, zstack1));
-  zstack2->GetNwk()->SetNlmeNetworkDiscoveryConfirmCallback(MakeBoundCallback(&NwkNetworkDiscoveryConfirm, zstack2));
-  zstack3->GetNwk()->SetNlmeNetworkDiscoveryConfirmCallback(MakeBoundCallback(&NwkNetworkDiscoveryConfirm, zstack3));
-  zstack4->GetNwk()->SetNlmeNetworkDiscoveryConfirmCallback(MakeBoundCallback(&NwkNetworkDiscoveryConfirm, zstack4));
-
-  zstack1->GetNwk()->SetNlmeJoinConfirmCallback(MakeBoundCallback(&NwkJoinConfirm, zstack1));
-  zstack2->GetNwk()->SetNlmeJoinConfirmCallback(MakeBoundCallback(&NwkJoinConfirm, zstack2));
-  zstack3->GetNwk()->SetNlmeJoinConfirmCallback(MakeBoundCallback(&NwkJoinConfirm, zstack3));
-  zstack4->GetNwk()->SetNlmeJoinConfirmCallback(MakeBoundCallback(&NwkJoinConfirm, zstack4));
+  for (uint32_t k = 0; k < zigbeeStacks.GetN(); k++) {
+    Ptr<ZigbeeStack> stack = zigbeeStacks.Get(k);
+    Ptr<ZigbeeNwk> nwk = stack->GetNwk();
+    nwk->SetNldeDataIndicationCallback(MakeBoundCallback(&NwkDataIndication, stack));
+    if (k == coordinator) {
+      nwk->SetNlmeNetworkFormationConfirmCallback(MakeBoundCallback(&NwkNetworkFormationConfirm, stack));
+      nwk->SetNlmeRouteDiscoveryConfirmCallback(MakeBoundCallback(&NwkRouteDiscoveryConfirm, stack));
+    } else {
+      nwk->SetNlmeNetworkDiscoveryConfirmCallback(MakeBoundCallback(&NwkNetworkDiscoveryConfirm, stack));
+      nwk->SetNlmeJoinConfirmCallback(MakeBoundCallback(&NwkJoinConfirm, stack));
+    }
+  }
+  if (g_nwkTables.enabled) {
+    NS_ABORT_MSG_IF(g_nwkTables.neighborCap == 0 || g_nwkTables.routeCap == 0 || g_nwkTables.discoveryCap == 0,
+                    "NWK table capacities must be at least 1");
+    NS_ABORT_MSG_IF(g_nwkTables.evict != "lru" && g_nwkTables.evict != "lqi" && g_nwkTables.evict != "none",
+                    "nwkEvict must be lru, lqi or none");
+    NS_ABORT_MSG_IF(g_tsch.enabled, "tsch forwards hop by hop and cannot be combined with nwkTables");
+    SetupNwkTables(lrwpanDevices);
+  }
+  if (g_zpower.mode == "link" || g_nwkTables.enabled || g_proc.enabled) {
+    HookMacIndications(lrwpanDevices);
+  }
 
   // 1 - Initiate the Zigbee coordinator, start the network
   // ALL_CHANNELS = 0x07FFF800 (Channels 11~26)
   NlmeNetworkFormationRequestParams netFormParams;
   netFormParams.m_scanChannelList.channelPageCount = 1;
-  netFormParams.m_scanChannelList.channelsField[0] = ALL_CHANNELS;
+  netFormParams.m_scanChannelList.channelsField[0] = g_scenario.formationMask;
   netFormParams.m_scanDuration = 0;
   netFormParams.m_superFrameOrder = 15;
   netFormParams.m_beaconOrder = 15;
 
-  Simulator::ScheduleWithContext(zstack0->GetNode()->GetId(), Seconds(1), &ZigbeeNwk::NlmeNetworkFormationRequest,
-                                 zstack0->GetNwk(), netFormParams);
+  Ptr<ZigbeeStack> zstack0 = zigbeeStacks.Get(coordinator);
+  if (NodeActive(zstack0->GetNode()->GetId())) {
+    Simulator::ScheduleWithContext(zstack0->GetNode()->GetId(),
+                                   Seconds(g_scenario.nodes[zigbeeSpecs[coordinator]].join),
+                                   &ZigbeeNwk::NlmeNetworkFormationRequest, zstack0->GetNwk(), netFormParams);
+  }
 
   // 2- Schedule devices sequentially find and join the network.
   //    After this procedure, each device make a NLME-START-ROUTER.request to become a router
+  for (uint32_t k = 0; k < zigbeeStacks.GetN(); k++) {
+    const scenario::NodeSpec& spec = g_scenario.nodes[zigbeeSpecs[k]];
+    Ptr<ZigbeeStack> stack = zigbeeStacks.Get(k);
+    if (k == coordinator || !NodeActive(stack->GetNode()->GetId())) {
+      continue;
+    }
+    NlmeNetworkDiscoveryRequestParams netDiscParams;
+    netDiscParams.m_scanChannelList.channelPageCount = 1;
+    netDiscParams.m_scanChannelList.channelsField[0] = spec.scanMask; // e.g. 0x00007800: Channels 11~14
+    netDiscParams.m_scanDuration = spec.scanDuration;
+    Simulator::ScheduleWithContext(stack->GetNode()->GetId(), Seconds(spec.join),
+                                   &ZigbeeNwk::NlmeNetworkDiscoveryRequest, stack->GetNwk(), netDiscParams);
+  }
 
-  NlmeNetworkDiscoveryRequestParams netDiscParams;
-  netDiscParams.m_scanChannelList.channelPageCount = 1;
-  netDiscParams.m_scanChannelList.channelsField[0] = 0x00007800; // BitMap: Channels 11~14
-  netDiscParams.m_scanDuration = 2;
-  Simulator::ScheduleWithContext(zstack1->GetNode()->GetId(), Seconds(3), &ZigbeeNwk::NlmeNetworkDiscoveryRequest,
-                                 zstack1->GetNwk(), netDiscParams);
-
-  NlmeNetworkDiscoveryRequestParams netDiscParams2;
-  netDiscParams2.m_scanChannelList.channelPageCount = 1;
-  netDiscParams2.m_scanChannelList.channelsField[0] = 0x00007800; // BitMap: Channels 11~14
-  netDiscParams2.m_scanDuration = 2;
-  Simulator::ScheduleWithContext(zstack2->GetNode()->GetId(), Seconds(4), &ZigbeeNwk::NlmeNetworkDiscoveryRequest,
-                                 zstack2->GetNwk(), netDiscParams2);
-
-  NlmeNetworkDiscoveryRequestParams netDiscParams3;
-  netDiscParams2.m_scanChannelList.channelPageCount = 1;
-  netDiscParams2.m_scanChannelList.channelsField[0] = 0x00007800; // BitMap: Channels 11~14
-  netDiscParams2.m_scanDuration = 2;
-  Simulator::ScheduleWithContext(zstack3->GetNode()->GetId(), Seconds(5), &ZigbeeNwk::NlmeNetworkDiscoveryRequest,
-                                 zstack3->GetNwk(), netDiscParams3);
-
-  NlmeNetworkDiscoveryRequestParams netDiscParams4;
-  netDiscParams4.m_scanChannelList.channelPageCount = 1;
-  netDiscParams4.m_scanChannelList.channelsField[0] = 0x00007800; // BitMap: Channels 11~14
-  netDiscParams4.m_scanDuration = 2;
-  Simulator::ScheduleWithContext(zstack4->GetNode()->GetId(), Seconds(6), &ZigbeeNwk::NlmeNetworkDiscoveryRequest,
-                                 zstack4->GetNwk(), netDiscParams4);
+  for (const auto& fault : g_scenario.faults) {
+    Simulator::Schedule(Seconds(fault.time), &ScenarioFault, scenarioNodes[fault.node], fault.up);
+  }
+  g_setup.Mark("nwk");
 
   // Install WiFi Stack
   // WiFi IP configuration
   InternetStackHelper inet;
   inet.Install(wifiApNodes);
   inet.Install(wifiStaNodes);
+  // A /24 holds 253 hosts; larger scenarios get the smallest subnet that fits
+  uint32_t prefix = 24;
+  while (prefix > 8 && (1u << (32 - prefix)) < wifiDevices.GetN() + 2) {
+    prefix--;
+  }
   Ipv4AddressHelper ipv4;
-  ipv4.SetBase("10.0.0.0", "255.255.255.0");
-  ipv4.Assign(NetDeviceContainer(apDev, staDev));
+  ipv4.SetBase("10.0.0.0", Ipv4Mask(("/" + std::to_string(prefix)).c_str()));
+  Ipv4InterfaceContainer wifiInterfaces = ipv4.Assign(wifiDevices);
+  if (wifiStaticAssoc) {
+    // No ARP exchange either before the first packet
+    NeighborCacheHelper neighborCache;
+    neighborCache.PopulateNeighborCache();
+  }
+  g_setup.Mark("internet");
 
-  // Wifi sink
+  // Wifi sink on every OnOff destination (on every Wi-Fi node when replaying,
+  // since traces may target any of them)
+  bool replaying = !g_replay.trace.empty();
+  NodeContainer sinkNodes;
+  std::set<uint32_t> sinks;
+  for (const auto& flow : g_scenario.flows) {
+    if (flow.kind == scenario::FlowSpec::ONOFF && sinks.insert(flow.dst).second) {
+      sinkNodes.Add(scenarioNodes[flow.dst]);
+    }
+  }
   PacketSinkHelper wifiSink("ns3::UdpSocketFactory", InetSocketAddress(Ipv4Address::GetAny(), wifiPort));
-  ApplicationContainer wifiSinkApp = wifiSink.Install(wifiApNodes.Get(0));
+  ApplicationContainer wifiSinkApp = wifiSink.Install(replaying ? wifiNodes : sinkNodes);
   wifiSinkApp.Start(Seconds(0));
   wifiSinkApp.Stop(Seconds(simulationTime));
 
-  // Wifi traffic app
+  // Load ramp phases, back to back from the start of the Wi-Fi traffic
+  if (!g_ramp.rates.empty()) {
+    std::istringstream rates(g_ramp.rates);
+    std::string rate;
+    double phaseStart = 16;
+    while (std::getline(rates, rate, ',')) {
+      RampPhase phase;
+      phase.rate = rate;
+      phase.start = phaseStart + g_ramp.settle;
+      phase.stop = phase.start + g_ramp.window;
+      g_ramp.phases.push_back(phase);
+      phaseStart = phase.stop;
+    }
+    NS_ABORT_MSG_IF(phaseStart > simulationTime, "loadRamp needs simulationTime >= " << phaseStart);
+  }
+
+  // Scenario flows: OnOff traffic between Wi-Fi nodes, heartbeats between
+  // Zigbee nodes. Unset flow settings come from the command line.
   ApplicationContainer wifiTrafficApps;
-  OnOffHelper wifiTrafficApp("ns3::UdpSocketFactory", InetSocketAddress("10.0.0.1", wifiPort));
-  wifiTrafficApp.SetAttribute("DataRate", DataRateValue(wifiDataRate));
-  wifiTrafficApp.SetAttribute("PacketSize", UintegerValue(wifiPacketSize));
-  for (uint32_t i = 0; i < wifiStaNodes.GetN(); i++) {
-    ApplicationContainer app = wifiTrafficApp.Install(wifiStaNodes.Get(i));
-    app.Start(Seconds(16));
-    app.Stop(Seconds(16 + simulationTime));
-    wifiTrafficApps.Add(app);
+  for (const auto& flow : g_scenario.flows) {
+    Ptr<Node> src = scenarioNodes[flow.src];
+    Ptr<Node> dst = scenarioNodes[flow.dst];
+    if (!NodeActive(src->GetId()) || !NodeActive(dst->GetId()) || (replaying && g_replay.replaces)) {
+      continue;
+    }
+    if (flow.kind == scenario::FlowSpec::ONOFF) {
+      OnOffHelper wifiTrafficApp("ns3::UdpSocketFactory",
+                                 InetSocketAddress(wifiInterfaces.GetAddress(slot[flow.dst]), wifiPort));
+      std::string rate = g_ramp.phases.empty() ? wifiDataRate : g_ramp.phases[0].rate;
+      wifiTrafficApp.SetAttribute("DataRate", DataRateValue(flow.rate.empty() ? rate : flow.rate));
+      wifiTrafficApp.SetAttribute("PacketSize", UintegerValue(flow.size > 0 ? flow.size : wifiPacketSize));
+      ApplicationContainer app = wifiTrafficApp.Install(src);
+      app.Start(Seconds(flow.start));
+      app.Stop(Seconds(flow.stop >= 0.0 ? flow.stop : 16 + simulationTime));
+      wifiTrafficApps.Add(app);
+    } else {
+      double interval = flow.interval > 0.0 ? flow.interval : heartbeatInterval;
+      double stop = flow.stop >= 0.0 ? std::min(flow.stop, simulationTime) : simulationTime;
+      uint32_t size = flow.size > 0 ? flow.size : c_zigbeeBufferSize;
+      g_heartbeatFlows.bytes[{src->GetId(), dst->GetId()}] += 0;
+      g_heartbeatFlows.start = std::min(g_heartbeatFlows.start, flow.start);
+      g_heartbeatFlows.stop = std::max(g_heartbeatFlows.stop, stop);
+      if (g_adaptive.enabled) {
+        NS_ABORT_MSG_IF(size < 16, "Heartbeat size must be >= 16");
+        AdaptiveFlow f;
+        f.src = zigbeeStacks.Get(slot[flow.src]);
+        f.dst = zigbeeStacks.Get(slot[flow.dst]);
+        f.size = size;
+        f.stop = stop;
+        f.rate = 1.0 / std::clamp(interval, g_adaptive.minInterval, g_adaptive.maxInterval);
+        g_adaptive.flows.push_back(f);
+        Simulator::Schedule(Seconds(flow.start), &AdaptiveSend, uint32_t(g_adaptive.flows.size() - 1));
+        g_progress.expected += ExpectedHeartbeats(flow.start, g_adaptive.minInterval, stop);
+        continue;
+      }
+      Simulator::Schedule(Seconds(flow.start), &SendDataPeriod, zigbeeStacks.Get(slot[flow.src]),
+                          zigbeeStacks.Get(slot[flow.dst]), interval, size, stop);
+      g_progress.expected += ExpectedHeartbeats(flow.start, interval, stop);
+    }
+  }
+  if (g_adaptive.enabled) {
+    NS_ABORT_MSG_IF(g_adaptive.minInterval <= 0.0 || g_adaptive.maxInterval < g_adaptive.minInterval,
+                    "adaptiveMinInterval must be > 0 and <= adaptiveMaxInterval");
+    NS_ABORT_MSG_IF(g_adaptive.decrease <= 0.0 || g_adaptive.decrease >= 1.0, "adaptiveDecrease must be in (0, 1)");
+    for (uint32_t i = 0; i < lrwpanDevices.GetN(); i++) {
+      DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(i))
+          ->GetMac()
+          ->TraceConnectWithoutContext("MacTxDrop", MakeCallback(&AdaptiveMacDrop));
+    }
+  }
+  for (uint32_t k = 1; k < g_ramp.phases.size(); k++) {
+    Simulator::Schedule(Seconds(g_ramp.phases[k].start - g_ramp.settle), &RampSetRate, wifiTrafficApps,
+                        g_ramp.phases[k].rate);
+  }
+
+  if (g_tsch.enabled) {
+    NS_ABORT_MSG_IF(g_gap.enabled, "tsch cannot be combined with gapAware");
+    NS_ABORT_MSG_IF(g_tsch.slot < 0.005, "tschSlot must leave room for a frame and its ACK (>= 5 ms)");
+    for (uint32_t k = 0; k < zigbeeStacks.GetN(); k++) {
+      uint32_t id = zigbeeStacks.Get(k)->GetNode()->GetId();
+      g_tsch.stacks[id] = zigbeeStacks.Get(k);
+      g_tsch.devices[id] = DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(k));
+    }
+    double start = g_heartbeatFlows.start < simulationTime ? g_heartbeatFlows.start : 16.0;
+    Simulator::Schedule(Seconds(std::max(0.0, start - 1.0)), &TschStart);
+  }
+
+  if (!g_poll.mode.empty()) {
+    NS_ABORT_MSG_IF(g_poll.mode != "round-robin" && g_poll.mode != "all" && g_poll.mode != "window",
+                    "pollMode must be round-robin, all or window");
+    NS_ABORT_MSG_IF(g_poll.size < 17, "pollSize must be >= 17");
+    g_poll.coordinator = zigbeeStacks.Get(coordinator);
+    for (uint32_t k = 0; k < zigbeeStacks.GetN(); k++) {
+      bool limited = g_poll.devicesLimit > 0 && g_poll.devices.size() >= g_poll.devicesLimit;
+      if (k != coordinator && !limited && NodeActive(zigbeeStacks.Get(k)->GetNode()->GetId())) {
+        g_poll.devices.push_back(zigbeeStacks.Get(k));
+      }
+    }
+    g_poll.concurrency = g_poll.mode == "round-robin" ? 1
+                         : g_poll.mode == "all"       ? std::max<uint32_t>(g_poll.devices.size(), 1)
+                                                      : std::max<uint32_t>(g_poll.window, 1);
+    g_poll.stop = simulationTime;
+    if (!g_poll.devices.empty() && NodeActive(g_poll.coordinator->GetNode()->GetId())) {
+      Simulator::Schedule(Seconds(g_poll.start), &PollCycle);
+    }
+  }
+
+  if (g_progress.interval > 0.0) {
+    Simulator::Schedule(Seconds(g_progress.interval), &PrintProgress);
+  }
+
+  if (replaying) {
+    for (uint32_t i = 0; i < zigbeeNodes.GetN(); i++) {
+      g_replay.endpoints["zigbee:" + std::to_string(i)] = {zigbeeNodes.Get(i), zigbeeStackContainer.Get(i), {}};
+    }
+    for (uint32_t i = 0; i < wifiApNodes.GetN(); i++) {
+      g_replay.endpoints["ap:" + std::to_string(i)] = {wifiApNodes.Get(i), nullptr, wifiInterfaces.GetAddress(i)};
+    }
+    for (uint32_t i = 0; i < wifiStaNodes.GetN(); i++) {
+      g_replay.endpoints["sta:" + std::to_string(i)] = {wifiStaNodes.Get(i), nullptr,
+                                                        wifiInterfaces.GetAddress(wifiApNodes.GetN() + i)};
+    }
+    for (uint32_t i = 0; i < g_scenario.nodes.size(); i++) {
+      bool zigbeeNode = scenario::IsZigbee(g_scenario.nodes[i].role);
+      g_replay.endpoints[g_scenario.nodes[i].name] = {scenarioNodes[i],
+                                                      zigbeeNode ? zigbeeStacks.Get(slot[i]) : nullptr,
+                                                      zigbeeNode ? Ipv4Address() : wifiInterfaces.GetAddress(slot[i])};
+    }
+    std::vector<std::pair<std::string, ReplayEndpoint>> byNode;
+    for (const auto& kv : g_replay.endpoints) {
+      byNode.emplace_back("node:" + std::to_string(kv.second.node->GetId()), kv.second);
+    }
+    g_replay.endpoints.insert(byNode.begin(), byNode.end());
+    g_replay.port = wifiPort;
+    ReplayStart();
   }
+  g_setup.Mark("apps");
 
-  Simulator::Schedule(Seconds(16), &SendDataPeriod, zstack0, zstack1, heartbeatInterval);
-  Simulator::Schedule(Seconds(16.2), &SendDataPeriod, zstack0, zstack2, heartbeatInterval);
-  Simulator::Schedule(Seconds(16.4), &SendDataPeriod, zstack0, zstack3, heartbeatInterval);
-  Simulator::Schedule(Seconds(16.6), &SendDataPeriod, zstack0, zstack4, heartbeatInterval);
+  // Assign streams to every random component (see StreamRole) to obtain
+  // reproducible results that stay paired across configurations.
+  g_streamTargets.zigbeeStacks = zigbeeStacks;
+  g_streamTargets.lrwpanDevices = lrwpanDevices;
+  g_streamTargets.apDevices = apDev;
+  g_streamTargets.staDevices = staDev;
+  g_streamTargets.apNodes = wifiApNodes;
+  g_streamTargets.staNodes = wifiStaNodes;
+  g_streamTargets.wifiApps = wifiTrafficApps;
+  AssignAllStreams(0);
+  g_setup.Mark("streams");
 
   Simulator::Stop(Seconds(simulationTime));
 
   FlowMonitorHelper flowHelper;
   Ptr<FlowMonitor> flowMonitor = flowHelper.InstallAll();
+  if (g_scenario.windowStart >= 0.0) {
+    flowMonitor->Start(Seconds(g_scenario.windowStart));
+    flowMonitor->Stop(Seconds(g_scenario.windowStop));
+  }
+  for (auto& phase : g_ramp.phases) {
+    Simulator::Schedule(Seconds(phase.start), &RampSnapshot, flowMonitor, &phase, 0);
+    Simulator::Schedule(Seconds(phase.stop), &RampSnapshot, flowMonitor, &phase, 1);
+  }
+  if (g_memory.interval > 0.0) {
+    SetupMemory(channel, flowMonitor);
+  }
+  g_setup.Mark("monitor");
+  PrintSetupTimes(NodeList::GetNNodes());
+
+  bool splitting = g_split.factor > 1 || g_split.roots > 1;
+  for (uint32_t i = 0; i < lrwpanDevices.GetN(); i++) {
+    Ptr<LrWpanMac> mac = DynamicCast<LrWpanNetDevice>(lrwpanDevices.Get(i))->GetMac();
+    mac->TraceConnectWithoutContext("MacSentPkt", MakeCallback(&LrWpanMacSentPkt));
+    mac->TraceConnectWithoutContext("MacTxDrop", MakeCallback(&LrWpanMacTxDrop));
+  }
+  if (splitting) {
+    void* mem = mmap(nullptr, sizeof(SplitShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    NS_ABORT_MSG_IF(mem == MAP_FAILED || pipe(g_split.pipeFd) != 0, "Unable to set up rare-event splitting");
+    g_split.shared = new (mem) SplitShared();
+    g_split.shared->trajectories = 1;
+    if (g_split.factor > 1) {
+      Simulator::Schedule(Seconds(16 + g_split.interval), &SplitCheck);
+    }
+    // Independent roots differ from the first one only by their streams
+    SplitStartRoots();
+  }
 
+  PerfMark("join");
+  auto wallStart = std::chrono::steady_clock::now();
   Simulator::Run();
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  PerfMark("");
+
+  if (splitting) {
+    SplitCollect();
+  }
 
   PrintWifiFlowStats(flowHelper, flowMonitor);
   PrintZigbeeQoS();
+  if (g_adaptive.enabled) {
+    PrintAdaptiveRate();
+  }
+  if (g_gap.enabled) {
+    PrintGapScheduling();
+  }
+  if (g_tsch.running) {
+    PrintTsch();
+  }
+  if (g_chan.enabled && apDev.GetN() > 0) {
+    PrintChannelManager();
+  }
+  if (!g_tpc.mode.empty()) {
+    PrintTpc();
+  }
+  if (!g_zpower.mode.empty()) {
+    PrintZigbeePower();
+  }
+  if (g_nwkTables.enabled) {
+    PrintNwkTables();
+  }
+  if (g_proc.enabled) {
+    PrintProcessing(zigbeeStacks.Get(coordinator)->GetNode()->GetId());
+  }
+  if (!g_ramp.phases.empty()) {
+    PrintLoadRamp();
+  }
+  if (!g_probes.probes.empty()) {
+    PrintProbes();
+  }
+  if (replaying) {
+    PrintReplay();
+  }
+  if (!g_poll.mode.empty()) {
+    PrintPolling();
+  }
+  if (g_memory.interval > 0.0) {
+    PrintMemory();
+  }
+  if (g_profile.enabled) {
+    PrintEventProfile();
+  }
+  if (perfCounters) {
+    AddResult("perf.available", g_perf.enabled ? 1 : 0);
+    if (g_perf.enabled) {
+      PrintPerfCounters();
+    }
+  }
+
+  NS_LOG_UNCOND("Wi-Fi association: " << (wifiStaticAssoc ? "static" : std::to_string(g_staAssociations) +
+                                                                          " STAs associated, last at " +
+                                                                          std::to_string(g_lastAssocTime) + " s"));
+  AddResult("wifi.staAssociations", wifiStaticAssoc ? staDev.GetN() : g_staAssociations);
+  AddResult("wifi.lastAssocSeconds", g_lastAssocTime);
+  AddResult("sim.events", Simulator::GetEventCount());
+  AddResult("sim.runWallSeconds", wallSeconds);
+  if (g_partition.active >= 0) {
+    PartitionCollect();
+  }
+  if (splitting) {
+    SplitRenameTopResults();
+  }
+  if (!resultsFile.empty()) {
+    WriteResults(resultsFile);
+  }
 
   Simulator::Destroy();
   return 0;